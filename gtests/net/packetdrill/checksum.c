@@ -26,11 +26,25 @@
 
 #include <assert.h>
 
+/* On x86-64 we have SSE2 everywhere and pick an AVX2 kernel at run
+ * time when the CPU has it. Other targets use the portable loop.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(ECOS)
+#define CHECKSUM_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Buffers shorter than this (pseudo-headers, IP headers, small
+ * segments) are summed with the portable loop, since setting up the
+ * vector accumulators would cost more than it saves.
+ */
+#define CHECKSUM_SIMD_MIN_BYTES	64
+
 /* Add bytes in buffer to a running checksum. Returns the new
  * intermediate checksum. Use ip_checksum_fold() to convert the
  * intermediate checksum to final form.
  */
-static u64 ip_checksum_partial(const void *p, size_t len, u64 sum)
+static u64 ip_checksum_partial_generic(const void *p, size_t len, u64 sum)
 {
 	/* Main loop: 32 bits at a time.
 	 * We take advantage of intel's ability to do unaligned memory
@@ -57,6 +71,117 @@ static u64 ip_checksum_partial(const void *p, size_t len, u64 sum)
 	return sum;
 }
 
+#ifdef CHECKSUM_X86_SIMD
+
+/* The vector kernels compute exactly what the portable loop does: the
+ * sum of the buffer's 32-bit words in a 64-bit accumulator. Each
+ * 32-bit lane is zero-extended into a 64-bit lane, so no carries are
+ * lost and the folded result is bit-for-bit identical.
+ */
+static u64 ip_checksum_partial_sse2(const void *p, size_t len, u64 sum)
+{
+	const u8 *p8 = (const u8 *)(p);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	u64 lanes[2];
+
+	for (; len >= 32; len -= 32, p8 += 32)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(p8));
+		__m128i b = _mm_loadu_si128((const __m128i *)(p8 + 16));
+
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc2 = _mm_add_epi64(acc2, _mm_unpacklo_epi32(b, zero));
+		acc3 = _mm_add_epi64(acc3, _mm_unpackhi_epi32(b, zero));
+	}
+	acc0 = _mm_add_epi64(_mm_add_epi64(acc0, acc1),
+			     _mm_add_epi64(acc2, acc3));
+	_mm_storeu_si128((__m128i *)lanes, acc0);
+	sum += lanes[0] + lanes[1];
+
+	return ip_checksum_partial_generic(p8, len, sum);
+}
+
+__attribute__((target("avx2")))
+static u64 ip_checksum_partial_avx2(const void *p, size_t len, u64 sum)
+{
+	const u8 *p8 = (const u8 *)(p);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	u64 lanes[4];
+
+	for (; len >= 64; len -= 64, p8 += 64)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p8));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p8 + 32));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(b, zero));
+		acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(b, zero));
+	}
+	acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1),
+				_mm256_add_epi64(acc2, acc3));
+	_mm256_storeu_si256((__m256i *)lanes, acc0);
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return ip_checksum_partial_sse2(p8, len, sum);
+}
+
+#endif  /* CHECKSUM_X86_SIMD */
+
+typedef u64 (*checksum_partial_func)(const void *p, size_t len, u64 sum);
+
+static u64 ip_checksum_partial_resolve(const void *p, size_t len, u64 sum);
+
+/* The summing kernel for large buffers. This starts out pointing at
+ * a resolver that probes the CPU on first use and then replaces
+ * itself; every thread that races through the resolver stores the
+ * same value, so no locking is needed.
+ */
+static checksum_partial_func ip_checksum_partial_engine =
+	ip_checksum_partial_resolve;
+static const char *ip_checksum_engine_name;
+
+static void ip_checksum_select_engine(void)
+{
+#ifdef CHECKSUM_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		ip_checksum_engine_name = "avx2";
+		ip_checksum_partial_engine = ip_checksum_partial_avx2;
+		return;
+	}
+	ip_checksum_engine_name = "sse2";
+	ip_checksum_partial_engine = ip_checksum_partial_sse2;
+#else
+	ip_checksum_engine_name = "generic";
+	ip_checksum_partial_engine = ip_checksum_partial_generic;
+#endif
+}
+
+static u64 ip_checksum_partial_resolve(const void *p, size_t len, u64 sum)
+{
+	ip_checksum_select_engine();
+	return ip_checksum_partial_engine(p, len, sum);
+}
+
+const char *ip_checksum_engine(void)
+{
+	if (ip_checksum_engine_name == NULL)
+		ip_checksum_select_engine();
+	return ip_checksum_engine_name;
+}
+
+static u64 ip_checksum_partial(const void *p, size_t len, u64 sum)
+{
+	if (len < CHECKSUM_SIMD_MIN_BYTES)
+		return ip_checksum_partial_generic(p, len, sum);
+	return ip_checksum_partial_engine(p, len, sum);
+}
+
 static __be16 ip_checksum_fold(u64 sum)
 {
 	while (sum & ~0xffffffffULL)
@@ -159,6 +284,25 @@ __be16 tcp_udp_v6_checksum(const struct in6_addr *src_ip,
 	return ip_checksum_fold(sum);
 }
 
+/* Incremental update per RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m').
+ * Only the 16-bit words that actually changed are folded in.
+ */
+__be16 checksum_update(__be16 check, const void *old_data,
+		       const void *new_data, size_t len)
+{
+	const u16 *old16 = (const u16 *)(old_data);
+	const u16 *new16 = (const u16 *)(new_data);
+	u64 sum = (u16)~check;
+
+	assert((len & 1) == 0);
+	for (; len >= sizeof(u16); len -= sizeof(u16), ++old16, ++new16)
+	{
+		if (*old16 != *new16)
+			sum += (u16)~*old16 + (u32)*new16;
+	}
+	return ip_checksum_fold(sum);
+}
+
 #define CRC32C(c, d) (c = (c>>8) ^ crc_c[(c^(d))&0xFF])
 
 static u32 crc_c[256] =
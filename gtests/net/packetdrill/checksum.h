@@ -46,6 +46,21 @@ extern __be16 tcp_udp_v6_checksum(const struct in6_addr *src_ip,
 				  const struct in6_addr *dst_ip,
 				  u8 protocol, const void *payload, u32 len);
 
+/* Incremental update ... */
+
+/* Returns the checksum 'check' (in network byte order) updated for the
+ * 'len' bytes at 'old_data' having been replaced by those at
+ * 'new_data', as described in RFC 1624. 'len' must be even, and the
+ * bytes must start at an even offset within the checksummed data.
+ */
+extern __be16 checksum_update(__be16 check, const void *old_data,
+			      const void *new_data, size_t len);
+
+/* Returns the name of the summing kernel picked for this CPU
+ * ("avx2", "sse2", or "generic").
+ */
+extern const char *ip_checksum_engine(void);
+
 /* SCTP ... */
 
 /* Calculates the CRC32C checksum used by SCTP (in network byte order). */
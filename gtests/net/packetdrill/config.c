@@ -22,6 +22,7 @@
  * Helper functions for configuration information for a test run.
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -49,15 +50,23 @@ enum option_codes {
 	OPT_MTU,
 	OPT_INIT_SCRIPTS,
 	OPT_TOLERANCE_USECS,
+	OPT_SPIN_USECS,
 	OPT_WIRE_CLIENT,
 	OPT_WIRE_SERVER,
 	OPT_WIRE_SERVER_IP,
 	OPT_WIRE_SERVER_PORT,
 	OPT_WIRE_CLIENT_DEV,
 	OPT_WIRE_SERVER_DEV,
+	OPT_WIRE_SHARED_CAPTURE,
 	OPT_TCP_TS_TICK_USECS,
 	OPT_NON_FATAL,
 	OPT_DRY_RUN,
+	OPT_JOBS,
+	OPT_PACKET_SOCKET,
+	OPT_TIMESTAMPS,
+	OPT_TIMING_REPORT,
+	OPT_NO_INBOUND_BATCH,
+	OPT_NO_REUSE_NETDEV,
 	OPT_VERBOSE = 'v',	/* our only single-letter option */
 };
 
@@ -77,15 +86,24 @@ struct option options[] = {
 	{ "mtu",		.has_arg = true,  NULL, OPT_MTU },
 	{ "init_scripts",	.has_arg = true,  NULL, OPT_INIT_SCRIPTS },
 	{ "tolerance_usecs",	.has_arg = true,  NULL, OPT_TOLERANCE_USECS },
+	{ "spin_usecs",		.has_arg = true,  NULL, OPT_SPIN_USECS },
 	{ "wire_client",	.has_arg = false, NULL, OPT_WIRE_CLIENT },
 	{ "wire_server",	.has_arg = false, NULL, OPT_WIRE_SERVER },
 	{ "wire_server_ip",	.has_arg = true,  NULL, OPT_WIRE_SERVER_IP },
 	{ "wire_server_port",	.has_arg = true,  NULL, OPT_WIRE_SERVER_PORT },
 	{ "wire_client_dev",	.has_arg = true,  NULL, OPT_WIRE_CLIENT_DEV },
 	{ "wire_server_dev",	.has_arg = true,  NULL, OPT_WIRE_SERVER_DEV },
+	{ "wire_shared_capture", .has_arg = false, NULL,
+	  OPT_WIRE_SHARED_CAPTURE },
 	{ "tcp_ts_tick_usecs",	.has_arg = true,  NULL, OPT_TCP_TS_TICK_USECS },
 	{ "non_fatal",		.has_arg = true,  NULL, OPT_NON_FATAL },
 	{ "dry_run",		.has_arg = false, NULL, OPT_DRY_RUN },
+	{ "jobs",		.has_arg = true,  NULL, OPT_JOBS },
+	{ "packet_socket",	.has_arg = true,  NULL, OPT_PACKET_SOCKET },
+	{ "timestamps",		.has_arg = true,  NULL, OPT_TIMESTAMPS },
+	{ "timing_report",	.has_arg = true,  NULL, OPT_TIMING_REPORT },
+	{ "no_inbound_batch",	.has_arg = false, NULL, OPT_NO_INBOUND_BATCH },
+	{ "no_reuse_netdev",	.has_arg = false, NULL, OPT_NO_REUSE_NETDEV },
 	{ "verbose",		.has_arg = false, NULL, OPT_VERBOSE },
 	{ NULL },
 };
@@ -107,6 +125,7 @@ void show_usage(void)
 		"\t[--speed=<speed in Mbps>]\n"
 		"\t[--mtu=<MTU in bytes>]\n"
 		"\t[--tolerance_usecs=tolerance_usecs]\n"
+		"\t[--spin_usecs=<usecs to spin before each event, or auto>]\n"
 		"\t[--tcp_ts_tick_usecs=<microseconds per TCP TS val tick>]\n"
 		"\t[--non_fatal=<comma separated types: packet,syscall>]\n"
 		"\t[--wire_client]\n"
@@ -115,7 +134,14 @@ void show_usage(void)
 		"\t[--wire_server_port=<server_port>]\n"
 		"\t[--wire_client_dev=<eth_dev_name>]\n"
 		"\t[--wire_server_dev=<eth_dev_name>]\n"
+		"\t[--wire_shared_capture]\n"
 		"\t[--dry_run]\n"
+		"\t[--jobs=<max scripts to run in parallel>]\n"
+		"\t[--packet_socket=[recvfrom,rx_ring,rings]]\n"
+		"\t[--timestamps=[off,software,hardware]]\n"
+		"\t[--timing_report=[text,json]]\n"
+		"\t[--no_inbound_batch]\n"
+		"\t[--no_reuse_netdev]\n"
 		"\t[--verbose|-v]\n"
 		"\tscript_path ...\n");
 }
@@ -197,8 +223,15 @@ void set_default_config(struct config *config)
 	config->live_bind_port		= 8080;
 	config->live_connect_port	= 8080;
 	config->tolerance_usecs		= 4000;
+	config->spin_usecs		= DEFAULT_SPIN_USECS;
 	config->speed			= TUN_DRIVER_SPEED_CUR;
 	config->mtu			= TUN_DRIVER_DEFAULT_MTU;
+	config->jobs			= 1;
+	config->packet_socket_mode	= PACKET_SOCKET_RECVFROM;
+	config->timestamps		= PACKET_TIMESTAMPS_OFF;
+	config->timing_report		= TIMING_REPORT_NONE;
+	config->inbound_batch		= true;
+	config->reuse_netdev		= true;
 
 	/* For now, by default we disable checks of outbound TS val
 	 * values, since there are timestamp val bugs in the tests and
@@ -417,6 +450,15 @@ static void process_option(int opt, char *optarg, struct config *config,
 		if (config->tolerance_usecs <= 0)
 			die("%s: bad --tolerance_usecs: %s\n", where, optarg);
 		break;
+	case OPT_SPIN_USECS:
+		if (strcmp(optarg, "auto") == 0) {
+			config->spin_usecs = SPIN_USECS_AUTO;
+			break;
+		}
+		config->spin_usecs = strtol(optarg, &end, 10);
+		if (end == optarg || *end || config->spin_usecs < 0)
+			die("%s: bad --spin_usecs: %s\n", where, optarg);
+		break;
 	case OPT_TCP_TS_TICK_USECS:
 		config->tcp_ts_tick_usecs = atoi(optarg);
 		if (config->tcp_ts_tick_usecs < 0 ||
@@ -446,9 +488,51 @@ static void process_option(int opt, char *optarg, struct config *config,
 	case OPT_WIRE_SERVER_DEV:
 		config->wire_server_device = strdup(optarg);
 		break;
+	case OPT_WIRE_SHARED_CAPTURE:
+		config->wire_shared_capture = true;
+		break;
 	case OPT_DRY_RUN:
 		config->dry_run = true;
 		break;
+	case OPT_JOBS:
+		config->jobs = atoi(optarg);
+		if (config->jobs <= 0)
+			die("%s: bad --jobs: %s\n", where, optarg);
+		break;
+	case OPT_PACKET_SOCKET:
+		if (strcmp(optarg, "recvfrom") == 0)
+			config->packet_socket_mode = PACKET_SOCKET_RECVFROM;
+		else if (strcmp(optarg, "rx_ring") == 0)
+			config->packet_socket_mode = PACKET_SOCKET_RX_RING;
+		else if (strcmp(optarg, "rings") == 0)
+			config->packet_socket_mode = PACKET_SOCKET_RINGS;
+		else
+			die("%s: bad --packet_socket: %s\n", where, optarg);
+		break;
+	case OPT_TIMESTAMPS:
+		if (strcmp(optarg, "off") == 0)
+			config->timestamps = PACKET_TIMESTAMPS_OFF;
+		else if (strcmp(optarg, "software") == 0)
+			config->timestamps = PACKET_TIMESTAMPS_SOFTWARE;
+		else if (strcmp(optarg, "hardware") == 0)
+			config->timestamps = PACKET_TIMESTAMPS_HARDWARE;
+		else
+			die("%s: bad --timestamps: %s\n", where, optarg);
+		break;
+	case OPT_TIMING_REPORT:
+		if (strcmp(optarg, "text") == 0)
+			config->timing_report = TIMING_REPORT_TEXT;
+		else if (strcmp(optarg, "json") == 0)
+			config->timing_report = TIMING_REPORT_JSON;
+		else
+			die("%s: bad --timing_report: %s\n", where, optarg);
+		break;
+	case OPT_NO_INBOUND_BATCH:
+		config->inbound_batch = false;
+		break;
+	case OPT_NO_REUSE_NETDEV:
+		config->reuse_netdev = false;
+		break;
 	case OPT_VERBOSE:
 		config->verbose = true;
 		break;
@@ -459,12 +543,19 @@ static void process_option(int opt, char *optarg, struct config *config,
 }
 
 
+/* getopt_long() keeps its state in the globals optind and optarg, and
+ * wire server session threads parse their clients' options
+ * concurrently, so we serialize all getopt_long() calls.
+ */
+static pthread_mutex_t getopt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Parse command line options. Returns a pointer to the first argument
  * beyond the options.
  */
 char **parse_command_line_options(int argc, char *argv[],
 				  struct config *config)
 {
+	char **args = NULL;
 	int c = 0;
 	int i = 0;
 
@@ -482,10 +573,15 @@ char **parse_command_line_options(int argc, char *argv[],
 		config->argv[i] = strdup(argv[i]);
 
 	/* Parse the arguments. */
+	if (pthread_mutex_lock(&getopt_mutex) != 0)
+		die_perror("pthread_mutex_lock");
 	optind = 0;
 	while ((c = getopt_long(argc, argv, "v", options, NULL)) > 0)
 		process_option(c, optarg, config, "Command Line");
-	return argv + optind;
+	args = argv + optind;
+	if (pthread_mutex_unlock(&getopt_mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+	return args;
 }
 
 static void parse_script_options(struct config *config,
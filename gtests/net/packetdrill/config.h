@@ -37,11 +37,29 @@
 #endif
 #include "ip_address.h"
 #include "ip_prefix.h"
+#include "packet_socket.h"
 #include "script.h"
+#include "timing_report.h"
 
 #define TUN_DRIVER_SPEED_CUR	0	/* don't change current speed */
 #define TUN_DRIVER_DEFAULT_MTU 1500	/* default MTU for tun device */
 
+/* DEFAULT_SPIN_USECS is the default maximum amount of time (in
+ * microseconds) to spin waiting for an event; see --spin_usecs. We
+ * sleep up until this many microseconds before a script event. We get
+ * the best results on tickless (CONFIG_NO_HZ=y) kernels when we try to
+ * sleep until the exact jiffy of a script event; this reduces the
+ * staleness/noise we see in jiffies values on tickless kernels, since
+ * the kernel updates the jiffies value at the time we wake, and then we
+ * execute the test event shortly thereafter. The value below was chosen
+ * experimentally based on experiences on a 2.2GHz machine for which
+ * there was a measured overhead of roughly 15 usec for the
+ * unlock/sleep/lock sequence that wait_for_event() must execute while
+ * waiting for the next event.
+ */
+#define DEFAULT_SPIN_USECS	20
+#define SPIN_USECS_AUTO		-1	/* calibrate spin time at start */
+
 extern struct option options[];
 
 struct config
@@ -73,6 +91,9 @@ struct config
 	int live_prefix_len;		/* IPv4/IPv6 interface prefix len */
 
 	int tolerance_usecs;		/* tolerance for time divergence */
+	int spin_usecs;			/* spin this long before events, or
+					 * SPIN_USECS_AUTO to calibrate
+					 */
 	int tcp_ts_tick_usecs;		/* microseconds per TS val tick */
 
 	u32 speed;			/* speed reported by tun driver;
@@ -80,10 +101,21 @@ struct config
 					 */
 	int mtu;			/* MTU of tun device */
 
+	enum packet_socket_mode_t packet_socket_mode;	/* how we sniff */
+	enum packet_timestamps_t timestamps;	/* wire server timestamps */
+	enum timing_report_format_t timing_report;	/* end-of-run report */
+	bool inbound_batch;		/* inject same-time inbound packets
+					 * back to back?
+					 */
+	bool reuse_netdev;		/* keep the tun device for the next
+					 * script if its setup matches?
+					 */
+
 	bool non_fatal_packet;		/* treat packet asserts as non-fatal */
 	bool non_fatal_syscall;		/* treat syscall asserts as non-fatal */
 
 	bool dry_run;			/* parse script but don't execute? */
+	int jobs;			/* max scripts to run concurrently */
 
 	bool verbose;			/* print detailed debug info? */
 	char *script_path;		/* pathname of script file */
@@ -108,6 +140,7 @@ struct config
 	struct ip_address wire_server_ip;  /* IP of on-the-wire server */
 	char *wire_server_ip_string;	   /* malloc-ed server IP string */
 	u16 wire_server_port;		   /* the port the server listens on */
+	bool wire_shared_capture;	   /* one sniffer for all sessions? */
 };
 
 /* Top-level info about the invocation of a test script */
@@ -26,137 +26,132 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include "hash.h"
 
-static const size_t MAX_BUCKETS = 1ULL << 30;	/* max 1B buckets */
+static const size_t MAX_SLOTS = 1ULL << 30;	/* max 1B slots */
+static const size_t MIN_SLOTS = 8;
 
-/* Hash a key. We use the fast, public-domain MurmurHash3.*/
-static inline size_t hash_key(u32 key)
+/* Hash a key. For a 4-byte key the MurmurHash3 finalizer alone mixes
+ * well enough, and costs a few multiplies and shifts.
+ */
+static inline u32 hash_key(u32 key)
 {
-	u32 hash;
-	MurmurHash3_x86_32(&key, sizeof(key), 0, &hash);
-	return hash;
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+	return key;
 }
 
-/* Find the bucket number for a key. */
-static inline size_t hash_bucket_num(const struct hash_map *map, u32 key)
+/* Find the slot holding the given nonzero key, or the empty slot where
+ * it would go.
+ */
+static inline struct hash_slot *hash_map_find(const struct hash_map *map,
+					      u32 key)
 {
-	size_t bucket_num = hash_key(key) & map->bucket_mask;
-	return bucket_num;
+	size_t slot_num = hash_key(key) & map->slot_mask;
+
+	while (map->slots[slot_num].key != 0 &&
+	       map->slots[slot_num].key != key)
+		slot_num = (slot_num + 1) & map->slot_mask;
+	return &map->slots[slot_num];
 }
 
-/* Try to find the smallest bucket count that is a power of 2 and is
- * greater than the given number of keys.
+/* Find the smallest slot count that is a power of 2 and keeps the load
+ * factor for the given number of keys at or below 1/2.
  */
-static inline size_t hash_map_pick_bucket_count(size_t num_keys)
+static inline size_t hash_map_pick_slot_count(size_t num_keys)
 {
-	size_t buckets = 1;
-	while ((buckets < num_keys) && (buckets < MAX_BUCKETS))
-		buckets <<= 1;
-	return buckets;
+	size_t slots = MIN_SLOTS;
+	while ((slots < 2 * num_keys) && (slots < MAX_SLOTS))
+		slots <<= 1;
+	return slots;
 }
 
 struct hash_map *hash_map_new(size_t num_keys)
 {
 	struct hash_map *map = calloc(1, sizeof(struct hash_map));
-	map->num_buckets = hash_map_pick_bucket_count(num_keys);
-	map->bucket_mask = map->num_buckets - 1;
-	map->buckets = calloc(map->num_buckets, sizeof(struct hash_node *));
+	map->num_slots = hash_map_pick_slot_count(num_keys);
+	map->slot_mask = map->num_slots - 1;
+	map->slots = calloc(map->num_slots, sizeof(struct hash_slot));
 	return map;
 }
 
 void hash_map_free(struct hash_map *map)
 {
-	/* Walk through the buckets and free nodes. */
-	int bucket_num;
-	for (bucket_num = 0; bucket_num < map->num_buckets; ++bucket_num) {
-		struct hash_node *node = NULL;
-		struct hash_node *next = NULL;
-		for (node = map->buckets[bucket_num]; node != NULL;
-		     node = next) {
-			next = node->next;
-			free(node);
-		}
-	}
-
-	free(map->buckets);
+	free(map->slots);
 	memset(map, 0, sizeof(*map));	/* paranoia to help catch bugs */
 	free(map);
 }
 
-/* Link the given node into the correct bucket linked list in the hash map. */
-static void hash_map_link(struct hash_map *map,
-				  struct hash_node *node)
-{
-	const size_t bucket_num = hash_bucket_num(map, node->key);
-	node->next = map->buckets[bucket_num];
-	map->buckets[bucket_num] = node;
-}
-
-/* Create a new array of buckets that's twice the size of the current
- * array. Then Walk through the old buckets and move all the nodes to
- * the new buckets.
+/* Create a new array of slots that's twice the size of the current
+ * array. Then walk through the old slots and move all the entries to
+ * the new slots.
  */
 static void hash_map_grow(struct hash_map *map)
 {
-	const size_t old_num_buckets = map->num_buckets;
-	map->num_buckets *= 2;
-	map->bucket_mask = map->num_buckets - 1;
-	struct hash_node **old_buckets = map->buckets;
-	map->buckets = calloc(map->num_buckets, sizeof(struct hash_node *));
-
-	size_t old_bucket_num = 0;
-	for (old_bucket_num = 0; old_bucket_num < old_num_buckets;
-	     ++old_bucket_num) {
-		struct hash_node *node = NULL;
-		struct hash_node *next = NULL;
-		for (node = old_buckets[old_bucket_num]; node != NULL;
-		     node = next) {
-			next = node->next;
-			hash_map_link(map, node);
-		}
+	const size_t old_num_slots = map->num_slots;
+	struct hash_slot *old_slots = map->slots;
+	size_t old_slot_num = 0;
+
+	map->num_slots *= 2;
+	map->slot_mask = map->num_slots - 1;
+	map->slots = calloc(map->num_slots, sizeof(struct hash_slot));
+
+	for (old_slot_num = 0; old_slot_num < old_num_slots; ++old_slot_num) {
+		const struct hash_slot *old = &old_slots[old_slot_num];
+		if (old->key != 0)
+			*hash_map_find(map, old->key) = *old;
 	}
 
-	free(old_buckets);
+	free(old_slots);
 }
 
-/* Insert a new node in the hash map, first growing the map if needed. */
-static void hash_map_insert(struct hash_map *map, u32 key, u32 value)
+void hash_map_set(struct hash_map *map, u32 key, u32 value)
 {
-	/* To keep things simple, we target a load factor of 1.0. */
-	if ((map->num_keys >= map->num_buckets) &&
-	    (map->num_buckets < MAX_BUCKETS)) {
-		hash_map_grow(map);
+	struct hash_slot *slot = NULL;
+
+	if (key == 0) {
+		if (!map->has_zero_key)
+			++map->num_keys;
+		map->has_zero_key = true;
+		map->zero_key_value = value;
+		return;
 	}
-	++map->num_keys;
-	struct hash_node *node = calloc(1, sizeof(struct hash_node));
-	node->key = key;
-	node->value = value;
-	hash_map_link(map, node);
-}
 
-void hash_map_set(struct hash_map *map, u32 key, u32 value)
-{
-	const size_t bucket_num = hash_bucket_num(map, key);
-	struct hash_node *node = NULL;
-	for (node = map->buckets[bucket_num]; node != NULL; node = node->next) {
-		if (node->key == key) {
-			node->value = value;
-			return;
-		}
+	slot = hash_map_find(map, key);
+	if (slot->key == key) {
+		slot->value = value;
+		return;
+	}
+
+	/* Grow to keep the load factor at or below 1/2, so probe
+	 * sequences stay short.
+	 */
+	if ((2 * (map->num_keys + 1) > map->num_slots) &&
+	    (map->num_slots < MAX_SLOTS)) {
+		hash_map_grow(map);
+		slot = hash_map_find(map, key);
 	}
-	hash_map_insert(map, key, value);
+	assert(map->num_keys + 1 < map->num_slots);	/* keep a free slot */
+	++map->num_keys;
+	slot->key = key;
+	slot->value = value;
 }
 
 bool hash_map_get(const struct hash_map *map, u32 key, u32 *value)
 {
-	const size_t bucket_num = hash_bucket_num(map, key);
-	struct hash_node *node = NULL;
-	for (node = map->buckets[bucket_num]; node != NULL; node = node->next) {
-		if (node->key == key) {
-			*value = node->value;
-			return true;
-		}
+	const struct hash_slot *slot = NULL;
+
+	if (key == 0) {
+		if (map->has_zero_key)
+			*value = map->zero_key_value;
+		return map->has_zero_key;
 	}
-	return false;
+
+	slot = hash_map_find(map, key);
+	if (slot->key != key)
+		return false;
+	*value = slot->value;
+	return true;
 }
@@ -28,19 +28,24 @@
 
 #include "types.h"
 
-/* Node for hash table buckets; maps u32 key to u32 value. */
-struct hash_node {
+/* Slot in the hash table, holding a key and its value inline. */
+struct hash_slot {
 	u32 key;
 	u32 value;
-	struct hash_node *next;
 };
 
-/* Hash map mapping u32 to u32. */
+/* Hash map mapping u32 to u32, using open addressing with linear
+ * probing. All entries live in one array, so the map costs no
+ * allocation per insert and is freed in one go. Key 0 marks an empty
+ * slot, so a 0 key, if present, is stored outside the array.
+ */
 struct hash_map {
-	size_t num_keys;		/* number of keys */
-	size_t num_buckets;		/* number of buckets (a power of 2) */
-	size_t bucket_mask;		/* bit mask to find bucket number */
-	struct hash_node **buckets;	/* array of hash buckets */
+	size_t num_keys;		/* number of keys, including key 0 */
+	size_t num_slots;		/* number of slots (a power of 2) */
+	size_t slot_mask;		/* bit mask to find slot number */
+	struct hash_slot *slots;	/* array of slots */
+	bool has_zero_key;		/* is key 0 in the map? */
+	u32 zero_key_value;		/* if so, its value */
 };
 
 extern struct hash_map *hash_map_new(size_t num_keys);
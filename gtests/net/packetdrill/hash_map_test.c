@@ -0,0 +1,135 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Unit test and micro-benchmark for hash_map.c.
+ */
+
+#include "hash_map.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+static void test_set_and_get(void)
+{
+	struct hash_map *map = hash_map_new(1);
+	u32 value = 0;
+
+	assert(!hash_map_get(map, 1, &value));
+
+	hash_map_set(map, 1, 100);
+	hash_map_set(map, 0xffffffff, 200);
+	assert(hash_map_get(map, 1, &value));
+	assert(value == 100);
+	assert(hash_map_get(map, 0xffffffff, &value));
+	assert(value == 200);
+	assert(!hash_map_get(map, 2, &value));
+	assert(map->num_keys == 2);
+
+	/* Setting an existing key replaces its value. */
+	hash_map_set(map, 1, 101);
+	assert(hash_map_get(map, 1, &value));
+	assert(value == 101);
+	assert(map->num_keys == 2);
+
+	hash_map_free(map);
+}
+
+static void test_zero_key(void)
+{
+	struct hash_map *map = hash_map_new(1);
+	u32 value = 0;
+
+	assert(!hash_map_get(map, 0, &value));
+	hash_map_set(map, 0, 7);
+	assert(hash_map_get(map, 0, &value));
+	assert(value == 7);
+	hash_map_set(map, 0, 8);
+	assert(hash_map_get(map, 0, &value));
+	assert(value == 8);
+	assert(map->num_keys == 1);
+
+	hash_map_free(map);
+}
+
+static void test_grow(void)
+{
+	const u32 num_keys = 100000;
+	struct hash_map *map = hash_map_new(1);
+	u32 key = 0, value = 0;
+
+	/* Keys spaced like TCP timestamp values at 1ms granularity. */
+	for (key = 1; key <= num_keys; ++key)
+		hash_map_set(map, key * 1000, key);
+	assert(map->num_keys == num_keys);
+	assert(2 * map->num_keys <= map->num_slots);
+
+	for (key = 1; key <= num_keys; ++key) {
+		assert(hash_map_get(map, key * 1000, &value));
+		assert(value == key);
+		assert(!hash_map_get(map, key * 1000 + 1, &value));
+	}
+
+	hash_map_free(map);
+}
+
+/* Time inserts and lookups of the kind set_outbound_ts_val_mapping()
+ * and its readers do over a long script, and print the cost per
+ * operation. This only reports numbers; it asserts nothing about them.
+ */
+static void benchmark_ts_val_mapping(void)
+{
+	const int num_keys = 1 << 16;
+	const int rounds = 16;
+	struct hash_map *map = NULL;
+	u32 key = 0, value = 0;
+	u64 sum = 0;
+	s64 set_nsecs = 0, get_nsecs = 0, start = 0;
+	int round = 0;
+
+	for (round = 0; round < rounds; ++round) {
+		map = hash_map_new(1);
+		start = now_nsecs();
+		for (key = 1; key <= num_keys; ++key)
+			hash_map_set(map, 0x9e3779b9 * key, key);
+		set_nsecs += now_nsecs() - start;
+
+		start = now_nsecs();
+		for (key = 1; key <= num_keys; ++key) {
+			if (hash_map_get(map, 0x9e3779b9 * key, &value))
+				sum += value;
+		}
+		get_nsecs += now_nsecs() - start;
+		hash_map_free(map);
+	}
+	assert(sum == (u64)rounds * ((u64)num_keys * (num_keys + 1) / 2));
+
+	printf("hash_map benchmark: %d keys: set: %.1f ns/op "
+	       "get: %.1f ns/op\n", num_keys,
+	       (double)set_nsecs / (rounds * num_keys),
+	       (double)get_nsecs / (rounds * num_keys));
+}
+
+int main(void)
+{
+	test_set_and_get();
+	test_zero_key();
+	test_grow();
+	benchmark_ts_val_mapping();
+	return 0;
+}
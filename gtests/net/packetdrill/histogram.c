@@ -0,0 +1,101 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Implementation for compact histograms of microsecond values.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+/* Return the bucket index for the given non-negative value. */
+static int histogram_bucket(s64 value)
+{
+	int msb = 0, shift = 0;
+
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	if (value >= (1LL << HISTOGRAM_MAX_BITS))
+		return HISTOGRAM_BUCKETS - 1;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+	return shift * HISTOGRAM_SUB_BUCKETS + (value >> shift);
+}
+
+/* Return the largest value that lands in the given bucket. */
+static s64 histogram_bucket_max(int bucket)
+{
+	int shift = 0;
+	s64 sub = 0;
+
+	if (bucket < 2 * HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_reset(struct histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_add(struct histogram *histogram, s64 value)
+{
+	if (value < 0)
+		value = 0;
+
+	if (histogram->num_samples == 0 || value < histogram->min)
+		histogram->min = value;
+	if (histogram->num_samples == 0 || value > histogram->max)
+		histogram->max = value;
+
+	++histogram->counts[histogram_bucket(value)];
+	++histogram->num_samples;
+	histogram->sum += value;
+}
+
+s64 histogram_percentile(const struct histogram *histogram,
+			 double percentile)
+{
+	u64 rank = 0, seen = 0;
+	int i;
+
+	if (histogram->num_samples == 0)
+		return 0;
+
+	/* The rank of the sample we want, counting from 1. */
+	rank = (u64)(percentile / 100.0 * histogram->num_samples + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > histogram->num_samples)
+		rank = histogram->num_samples;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		seen += histogram->counts[i];
+		if (seen >= rank)
+			return min(histogram_bucket_max(i), histogram->max);
+	}
+
+	assert(!"histogram counts do not add up");
+	return histogram->max;
+}
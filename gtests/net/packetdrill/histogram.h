@@ -0,0 +1,75 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Compact fixed-size histograms of non-negative microsecond values,
+ * for summarizing timing behavior over a test run without keeping
+ * every sample around.
+ *
+ * Values below 64 get a bucket of their own; above that each power of
+ * two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so any
+ * percentile we report is within about 3% of the true sample.
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include "types.h"
+
+#define HISTOGRAM_SUB_BUCKET_BITS	5
+#define HISTOGRAM_SUB_BUCKETS		(1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/* Values at or beyond 2^HISTOGRAM_MAX_BITS usecs (about 19 hours) are
+ * counted in the last bucket.
+ */
+#define HISTOGRAM_MAX_BITS		36
+
+#define HISTOGRAM_BUCKETS	\
+	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * \
+	 HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	u32 counts[HISTOGRAM_BUCKETS];	/* samples in each bucket */
+	u64 num_samples;		/* total number of samples */
+	s64 min;			/* smallest sample seen */
+	s64 max;			/* largest sample seen */
+	s64 sum;			/* sum of all samples */
+};
+
+/* Clear out all samples from the histogram. */
+extern void histogram_reset(struct histogram *histogram);
+
+/* Record a sample. Negative values are recorded as 0. */
+extern void histogram_add(struct histogram *histogram, s64 value);
+
+/* Return an estimate of the given percentile (0 to 100) of the samples
+ * so far: the upper bound of the bucket holding that percentile,
+ * clamped to the largest sample. Returns 0 for an empty histogram.
+ */
+extern s64 histogram_percentile(const struct histogram *histogram,
+				double percentile);
+
+/* Return the mean of the samples so far, or 0 for an empty histogram. */
+static inline double histogram_mean(const struct histogram *histogram)
+{
+	if (histogram->num_samples == 0)
+		return 0.0;
+	return (double)histogram->sum / (double)histogram->num_samples;
+}
+
+#endif /* __HISTOGRAM_H__ */
@@ -24,12 +24,24 @@
 
 #include "net_utils.h"
 
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#ifdef linux
+#include <linux/ethtool.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#endif
+
 #include "logging.h"
 
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 static void verbose_system(const char *command)
 {
 	int result;
@@ -40,28 +52,157 @@ static void verbose_system(const char *command)
 	if (result != 0)
 		DEBUGP("error executing command '%s'\n", command);
 }
+#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
+
+#ifdef linux
+
+/* Space for one rtnetlink request: the netlink header, the family
+ * header for the address or route, and a few attributes.
+ */
+struct netlink_request {
+	struct nlmsghdr hdr;
+	union {
+		struct ifaddrmsg ifa;
+		struct rtmsg rtm;
+	};
+	char attrs[128];
+};
+
+/* Append an attribute with the given payload to the request. */
+static void netlink_add_attr(struct netlink_request *req, int type,
+			     const void *data, int data_len)
+{
+	int offset = NLMSG_ALIGN(req->hdr.nlmsg_len);
+	struct rtattr *rta = (struct rtattr *)((char *)req + offset);
+
+	assert(offset + RTA_SPACE(data_len) <= sizeof(*req));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(data_len);
+	memcpy(RTA_DATA(rta), data, data_len);
+	req->hdr.nlmsg_len = offset + RTA_SPACE(data_len);
+}
+
+/* Send the request to the kernel and wait for its acknowledgement.
+ * Returns 0 on success or a negative errno value on failure.
+ */
+static int netlink_transact(struct netlink_request *req)
+{
+	static u32 seq;
+	struct sockaddr_nl kernel;
+	char reply[1024];
+	int fd, result = -EIO;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0)
+		die_perror("socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)");
+
+	req->hdr.nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	req->hdr.nlmsg_seq = ++seq;
+
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+	if (sendto(fd, req, req->hdr.nlmsg_len, 0,
+		   (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+		die_perror("netlink sendto");
+
+	for (;;) {
+		struct nlmsghdr *nlh;
+		int len = recv(fd, reply, sizeof(reply), 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("netlink recv");
+		}
+		for (nlh = (struct nlmsghdr *)reply; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != req->hdr.nlmsg_seq ||
+			    nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			result = ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+			goto out;
+		}
+	}
+
+out:
+	close(fd);
+	return result;
+}
+
+static int dev_index(const char *dev_name)
+{
+	int index = if_nametoindex(dev_name);
+
+	if (index == 0)
+		die_perror("if_nametoindex");
+	return index;
+}
+
+/* Add (RTM_NEWADDR) or delete (RTM_DELADDR) an interface address.
+ * Adding an address that is already there, or deleting one that is
+ * already gone, is fine; any other failure is fatal, as it is for
+ * routes, since the test can't run without the address.
+ */
+static void netlink_change_address(int type, int flags, u8 ifa_flags,
+				   const char *dev_name,
+				   const struct ip_address *ip,
+				   int prefix_len)
+{
+	struct netlink_request req;
+	char ip_string[ADDR_STR_LEN];
+	int addr_len = ip_address_length(ip->address_family);
+	int result;
+
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.hdr.nlmsg_type = type;
+	req.hdr.nlmsg_flags = flags;
+	req.ifa.ifa_family = ip->address_family;
+	req.ifa.ifa_prefixlen = prefix_len;
+	req.ifa.ifa_flags = ifa_flags;
+	req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	req.ifa.ifa_index = dev_index(dev_name);
+	netlink_add_attr(&req, IFA_LOCAL, &ip->ip, addr_len);
+	netlink_add_attr(&req, IFA_ADDRESS, &ip->ip, addr_len);
+
+	result = netlink_transact(&req);
+	if ((type == RTM_NEWADDR && result == -EEXIST) ||
+	    (type == RTM_DELADDR && result == -EADDRNOTAVAIL)) {
+		DEBUGP("%s %s/%d dev %s: %s\n",
+		       type == RTM_NEWADDR ? "RTM_NEWADDR" : "RTM_DELADDR",
+		       ip_to_string(ip, ip_string), prefix_len, dev_name,
+		       strerror(-result));
+	} else if (result != 0) {
+		die("error %s address %s/%d dev %s: %s\n",
+		    type == RTM_NEWADDR ? "adding" : "deleting",
+		    ip_to_string(ip, ip_string), prefix_len, dev_name,
+		    strerror(-result));
+	}
+}
+
+#endif /* linux */
 
 /* Configure a local IPv4 address and netmask for the device */
 static void net_add_ipv4_address(const char *dev_name,
 				 const struct ip_address *ip,
 				 int prefix_len)
 {
+#ifdef linux
+	netlink_change_address(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, 0,
+			       dev_name, ip, prefix_len);
+#endif
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	char *command = NULL;
 	char ip_string[ADDR_STR_LEN];
 
 	ip_to_string(ip, ip_string);
 
-#ifdef linux
-	asprintf(&command, "ip addr add %s/%d dev %s > /dev/null 2>&1",
-		 ip_string, prefix_len, dev_name);
-#endif
-#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	asprintf(&command, "/sbin/ifconfig %s %s/%d alias",
 		 dev_name, ip_string, prefix_len);
-#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
 
 	verbose_system(command);
 	free(command);
+#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
 }
 
 /* Configure a local IPv6 address and prefix length for the device */
@@ -69,37 +210,32 @@ static void net_add_ipv6_address(const char *dev_name,
 				 const struct ip_address *ip,
 				 int prefix_len)
 {
+#ifdef linux
+	/* Ask the kernel to skip duplicate address detection, so that
+	 * the address is usable immediately rather than showing as
+	 * "tentative" for a second or two, e.g. "ip addr show" shows:
+	 * inet6 fd3d:fa7b:d17d::36/48 scope global tentative
+	 */
+	netlink_change_address(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+			       IFA_F_NODAD, dev_name, ip, prefix_len);
+#endif
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	char *command = NULL;
 	char ip_string[ADDR_STR_LEN];
 
 	ip_to_string(ip, ip_string);
 
-#ifdef linux
-
-	asprintf(&command, "ip addr add %s/%d dev %s > /dev/null 2>&1",
-		 ip_string, prefix_len, dev_name);
-#endif
-#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
-
 	asprintf(&command, "/sbin/ifconfig %s inet6 %s/%d",
 		 dev_name, ip_string, prefix_len);
-#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
 
 	verbose_system(command);
 	free(command);
 
 	/* Wait for IPv6 duplicate address detection to converge,
 	 * so that this address no longer shows as "tentative".
-	 * e.g. "ip addr show" shows:
-	 * inet6 fd3d:fa7b:d17d::36/48 scope global tentative
 	 */
-#ifdef linux
-	if (!strstr(dev_name, "tun"))
-		sleep(2);
-#endif
-#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	sleep(3);
-#endif
+#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
 }
 
 void net_add_dev_address(const char *dev_name,
@@ -123,24 +259,23 @@ void net_del_dev_address(const char *dev_name,
 			 const struct ip_address *ip,
 			 int prefix_len)
 {
+#ifdef linux
+	netlink_change_address(RTM_DELADDR, 0, 0, dev_name, ip, prefix_len);
+#endif
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	char *command = NULL;
 	char ip_string[ADDR_STR_LEN];
 
 	ip_to_string(ip, ip_string);
 
-#ifdef linux
-	asprintf(&command, "ip addr del %s/%d dev %s > /dev/null 2>&1",
-		 ip_string, prefix_len, dev_name);
-#endif
-#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	asprintf(&command, "/sbin/ifconfig %s %s %s/%d -alias",
 		 dev_name,
 		 ip->address_family ==  AF_INET6 ? "inet6" : "",
 		 ip_string, prefix_len);
-#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
 
 	verbose_system(command);
 	free(command);
+#endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) */
 }
 
 /* In general we want to avoid configuring a new IP address on an
@@ -170,3 +305,131 @@ void net_setup_dev_address(const char *dev_name,
 		net_del_dev_address(cur_dev_name, ip, prefix_len);
 	net_add_dev_address(dev_name, ip, prefix_len);
 }
+
+/* Set and clear the given IFF_* flags on the device. */
+static void net_change_dev_flags(const char *dev_name, short set, short clear)
+{
+	struct ifreq ifr;
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+
+	if (fd < 0)
+		die_perror("opening AF_INET, SOCK_DGRAM, IPPROTO_IP socket");
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev_name, IFNAMSIZ - 1);
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0)
+		die_perror("SIOCGIFFLAGS");
+	ifr.ifr_flags = (ifr.ifr_flags | set) & ~clear;
+	if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0)
+		die_perror("SIOCSIFFLAGS");
+
+	close(fd);
+}
+
+void net_bring_up_dev(const char *dev_name)
+{
+	net_change_dev_flags(dev_name, IFF_UP | IFF_RUNNING, 0);
+}
+
+void net_bring_down_dev(const char *dev_name)
+{
+	net_change_dev_flags(dev_name, 0, IFF_UP);
+}
+
+#ifdef linux
+
+void net_set_dev_speed(const char *dev_name, u32 speed)
+{
+	struct ethtool_cmd ecmd;
+	struct ifreq ifr;
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+
+	if (fd < 0)
+		die_perror("opening AF_INET, SOCK_DGRAM, IPPROTO_IP socket");
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev_name, IFNAMSIZ - 1);
+	ifr.ifr_data = (void *)&ecmd;
+
+	/* Like "ethtool -s <dev> speed <speed> autoneg off". Older tun
+	 * drivers cannot change their speed, so as with ethtool itself
+	 * a failure here is reported but is not fatal.
+	 */
+	memset(&ecmd, 0, sizeof(ecmd));
+	ecmd.cmd = ETHTOOL_GSET;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) < 0) {
+		fprintf(stderr, "warning: ETHTOOL_GSET on %s: %s\n",
+			dev_name, strerror(errno));
+		goto out;
+	}
+	ethtool_cmd_speed_set(&ecmd, speed);
+	ecmd.autoneg = AUTONEG_DISABLE;
+	ecmd.cmd = ETHTOOL_SSET;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+		fprintf(stderr, "warning: ETHTOOL_SSET speed %u on %s: %s\n",
+			speed, dev_name, strerror(errno));
+
+out:
+	close(fd);
+}
+
+void net_set_dev_mtu(const char *dev_name, int mtu)
+{
+	struct ifreq ifr;
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+
+	if (fd < 0)
+		die_perror("opening AF_INET, SOCK_DGRAM, IPPROTO_IP socket");
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev_name, IFNAMSIZ - 1);
+	ifr.ifr_mtu = mtu;
+	if (ioctl(fd, SIOCSIFMTU, &ifr) < 0)
+		die_perror("SIOCSIFMTU");
+
+	close(fd);
+}
+
+void net_setup_dev_route(const char *dev_name,
+			 const struct ip_prefix *prefix,
+			 const struct ip_address *gateway)
+{
+	struct netlink_request req;
+	char prefix_string[ADDR_STR_LEN];
+	char gateway_string[ADDR_STR_LEN];
+	int family = prefix->ip.address_family;
+	int addr_len = ip_address_length(family);
+	int index = dev_index(dev_name);
+	int result;
+
+	assert(gateway->address_family == family);
+
+	/* Like "ip route replace <prefix> dev <dev> via <gateway>":
+	 * a single request that atomically replaces any existing route
+	 * for this prefix, e.g. one left behind by a previous test.
+	 */
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.hdr.nlmsg_type = RTM_NEWROUTE;
+	req.hdr.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+	req.rtm.rtm_family = family;
+	req.rtm.rtm_dst_len = prefix->prefix_len;
+	req.rtm.rtm_table = RT_TABLE_MAIN;
+	req.rtm.rtm_protocol = RTPROT_BOOT;
+	req.rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+	req.rtm.rtm_type = RTN_UNICAST;
+	netlink_add_attr(&req, RTA_DST, &prefix->ip.ip, addr_len);
+	netlink_add_attr(&req, RTA_GATEWAY, &gateway->ip, addr_len);
+	netlink_add_attr(&req, RTA_OIF, &index, sizeof(index));
+
+	result = netlink_transact(&req);
+	if (result != 0) {
+		die("error adding route %s/%d dev %s via %s: %s\n",
+		    ip_to_string(&prefix->ip, prefix_string),
+		    prefix->prefix_len, dev_name,
+		    ip_to_string(gateway, gateway_string),
+		    strerror(-result));
+	}
+}
+
+#endif /* linux */
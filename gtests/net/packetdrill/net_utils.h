@@ -29,6 +29,7 @@
 #include "types.h"
 
 #include "ip_address.h"
+#include "ip_prefix.h"
 
 /* Add the given IP address, with the given subnet/prefix length,
  * to the given device.
@@ -53,4 +54,29 @@ extern void net_setup_dev_address(const char *dev_name,
 				  const struct ip_address *ip,
 				  int prefix_len);
 
+/* Mark the given network device as up and running. */
+extern void net_bring_up_dev(const char *dev_name);
+
+/* Mark the given network device as down. */
+extern void net_bring_down_dev(const char *dev_name);
+
+#ifdef linux
+/* Set the link speed reported by the given device's ethtool
+ * interface, with autonegotiation off. The kernel only copies the
+ * new speed into the fields TCP consults when the device next comes
+ * up, so callers should (re)start the device afterward.
+ */
+extern void net_set_dev_speed(const char *dev_name, u32 speed);
+
+/* Set the MTU of the given device. */
+extern void net_set_dev_mtu(const char *dev_name, int mtu);
+
+/* Route the given prefix through the given device and gateway,
+ * replacing any existing route for that prefix.
+ */
+extern void net_setup_dev_route(const char *dev_name,
+				const struct ip_prefix *prefix,
+				const struct ip_address *gateway);
+#endif /* linux */
+
 #endif /* __NET_UTILS_H__ */
@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -70,8 +71,33 @@ struct local_netdev
 	int ipv6_control_fd;	/* fd for IPv6 configuration of tun interface */
 	int index;		/* interface index from if_nametoindex */
 	struct packet_socket *psock;	/* for sniffing packets (owned) */
+	struct local_netdev_key *key;	/* setup it was built for (owned) */
+	bool reuse;		/* park it for the next script when freed? */
 };
 
+/* The configuration a local netdev was set up with. A later script
+ * whose configuration yields an identical key can reuse the device,
+ * its addresses, its route and its packet socket as they are.
+ */
+struct local_netdev_key
+{
+	int wire_protocol;
+	struct ip_address live_local_ip;
+	int live_prefix_len;
+	struct ip_prefix live_remote_prefix;
+	struct ip_address live_gateway_ip;
+	int mtu;
+	u32 speed;
+	enum packet_socket_mode_t packet_socket_mode;
+};
+
+/* The netdev of the previous script, kept for reuse; NULL if none. */
+static struct local_netdev *idle_netdev;
+
+static void local_netdev_destroy(struct local_netdev *netdev);
+static void local_netdev_read_queue(struct local_netdev *netdev,
+                                    int num_packets);
+
 struct netdev_ops local_netdev_ops;
 
 /* "Downcast" an abstract netdev to our local flavor. */
@@ -167,6 +193,15 @@ static void create_device(struct config *config, struct local_netdev *netdev)
 
 	if (config->speed != TUN_DRIVER_SPEED_CUR)
 	{
+#ifdef linux
+		/* Need to bring interface down so the interface speed
+		 * will be copied to the link_speed field when
+		 * bring_up_device() brings it back up. This field is
+		 * used by TCP's cwnd bound.
+		 */
+		net_set_dev_speed(netdev->name, config->speed);
+		net_bring_down_dev(netdev->name);
+#else
 		char *command;
 #ifdef ECOS
 		int len = strlen("ethtool -s  speed  autoneg off") + strlen(netdev->name) + 8;
@@ -196,10 +231,14 @@ static void create_device(struct config *config, struct local_netdev *netdev)
 		if (system(command) < 0)
 			die("Error executing %s\n", command);
 		free(command);
+#endif
 	}
 
 	if (config->mtu != TUN_DRIVER_DEFAULT_MTU)
 	{
+#ifdef linux
+		net_set_dev_mtu(netdev->name, config->mtu);
+#else
 		char *command;
 #ifdef ECOS
 
@@ -214,6 +253,7 @@ static void create_device(struct config *config, struct local_netdev *netdev)
 		if (system(command) < 0)
 			die("Error executing %s\n", command);
 		free(command);
+#endif
 	}
 
 	/* Open a socket we can use to configure the tun interface.
@@ -255,16 +295,11 @@ static void bring_up_device(struct local_netdev *netdev)
 static void route_traffic_to_device(struct config *config,
                                     struct local_netdev *netdev)
 {
-	char *route_command = NULL;
 #ifdef linux
-	asprintf(&route_command,
-	         "ip route del %s > /dev/null 2>&1 ; "
-	         "ip route add %s dev %s via %s > /dev/null 2>&1",
-	         config->live_remote_prefix_string,
-	         config->live_remote_prefix_string,
-	         netdev->name,
-	         config->live_gateway_ip_string);
-#endif
+	net_setup_dev_route(netdev->name, &config->live_remote_prefix,
+	                    &config->live_gateway_ip);
+#else
+	char *route_command = NULL;
 #if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
 	if (config->wire_protocol == AF_INET)
 	{
@@ -300,35 +335,139 @@ static void route_traffic_to_device(struct config *config,
 		    route_command);
 	}
 	free(route_command);
+#endif /* linux */
+}
+
+static struct local_netdev_key *local_netdev_key_new(struct config *config)
+{
+	struct local_netdev_key *key = calloc(1, sizeof(*key));
+
+	key->wire_protocol = config->wire_protocol;
+	key->live_local_ip = config->live_local_ip;
+	key->live_prefix_len = config->live_prefix_len;
+	key->live_remote_prefix = config->live_remote_prefix;
+	key->live_gateway_ip = config->live_gateway_ip;
+	key->mtu = config->mtu;
+	key->speed = config->speed;
+	key->packet_socket_mode = config->packet_socket_mode;
+	return key;
+}
+
+/* Discard anything the previous script left queued in the tun device
+ * or in the packet socket, so the next script starts from a clean
+ * slate. Returns the number of packets discarded.
+ */
+static int local_netdev_drain(struct local_netdev *netdev)
+{
+	struct pollfd pfd;
+	int packets = 0;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = netdev->tun_fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+	{
+		local_netdev_read_queue(netdev, 1);
+		++packets;
+	}
+
+	return packets + packet_socket_drain(netdev->psock);
+}
+
+/* Take the previous script's netdev if it was set up exactly the way
+ * this script needs; otherwise tear it down. Returns NULL if there is
+ * nothing to reuse.
+ */
+static struct local_netdev *reuse_idle_netdev(struct config *config)
+{
+	struct local_netdev *netdev = idle_netdev;
+	struct local_netdev_key *key = NULL;
+	int packets = 0;
+
+	if (netdev == NULL)
+		return NULL;
+	idle_netdev = NULL;
+
+	key = local_netdev_key_new(config);
+	if (!config->reuse_netdev ||
+	        memcmp(key, netdev->key, sizeof(*key)) != 0)
+	{
+		free(key);
+		local_netdev_destroy(netdev);
+		return NULL;
+	}
+	free(key);
+
+	packets = local_netdev_drain(netdev);
+	if (config->verbose)
+	{
+		printf("netdev setup: reusing %s, drained %d packets\n",
+		       netdev->name, packets);
+	}
+	return netdev;
+}
+
+/* In verbose mode, print how long the setup step that started at
+ * start_usecs took, and return the current time as the start of the
+ * next step.
+ */
+static s64 report_setup_step(struct config *config, const char *step,
+                             s64 start_usecs)
+{
+	s64 end_usecs = now_usecs();
+
+	if (config->verbose)
+	{
+		printf("netdev setup: %-16s %6lld usecs\n",
+		       step, end_usecs - start_usecs);
+	}
+	return end_usecs;
 }
 
 struct netdev *local_netdev_new(struct config *config)
 {
-	struct local_netdev *netdev = calloc(1, sizeof(struct local_netdev));
+	struct local_netdev *netdev = reuse_idle_netdev(config);
+	s64 setup_start_usecs = now_usecs();
+	s64 step_usecs = setup_start_usecs;
+
+	if (netdev != NULL)
+		return (struct netdev *)netdev;
 
+	netdev = calloc(1, sizeof(struct local_netdev));
 	netdev->netdev.ops = &local_netdev_ops;
+	netdev->key = local_netdev_key_new(config);
+	netdev->reuse = config->reuse_netdev;
 
 	cleanup_old_device(config, netdev);
 
 	check_remote_address(config, netdev);
 	create_device(config, netdev);
+	step_usecs = report_setup_step(config, "create device", step_usecs);
 	set_device_offload_flags(netdev);
 	bring_up_device(netdev);
+	step_usecs = report_setup_step(config, "bring up device", step_usecs);
 
 	net_setup_dev_address(netdev->name,
 	                      &config->live_local_ip,
 	                      config->live_prefix_len);
+	step_usecs = report_setup_step(config, "set up address", step_usecs);
 
 	route_traffic_to_device(config, netdev);
-	netdev->psock = packet_socket_new(netdev->name);
+	step_usecs = report_setup_step(config, "set up route", step_usecs);
+	netdev->psock = packet_socket_new(netdev->name,
+	                                  config->packet_socket_mode);
+	packet_socket_set_outbound_filter(netdev->psock,
+	                                  &config->live_local_ip,
+	                                  &config->live_remote_prefix);
+	step_usecs = report_setup_step(config, "open packet socket",
+	                               step_usecs);
+	report_setup_step(config, "total", setup_start_usecs);
 
 	return (struct netdev *)netdev;
 }
 
-static void local_netdev_free(struct netdev *a_netdev)
+static void local_netdev_destroy(struct local_netdev *netdev)
 {
-	struct local_netdev *netdev = to_local_netdev(a_netdev);
-
 	if (netdev->psock)
 		packet_socket_free(netdev->psock);
 	if (netdev->tun_fd >= 0)
@@ -339,10 +478,25 @@ static void local_netdev_free(struct netdev *a_netdev)
 		close(netdev->ipv6_control_fd);
 	if (netdev->name != NULL)
 		free(netdev->name);
+	free(netdev->key);
 	memset(netdev, 0, sizeof(*netdev));  /* paranoia to help catch bugs */
 	free(netdev);
 }
 
+/* Rather than tearing down the device, keep it around in case the
+ * next script in this process can use it as is. The process exiting
+ * closes the tun fd, which removes the device.
+ */
+static void local_netdev_free(struct netdev *a_netdev)
+{
+	struct local_netdev *netdev = to_local_netdev(a_netdev);
+
+	if (netdev->reuse && idle_netdev == NULL)
+		idle_netdev = netdev;
+	else
+		local_netdev_destroy(netdev);
+}
+
 #if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(ECOS)
 /* According to `man 4 tun` on OpenBSD: "Each packet read or written
  * is prefixed with a tunnel header consisting of a 4-byte network
@@ -445,6 +599,24 @@ static int local_netdev_receive(struct netdev *a_netdev,
 	return status;
 }
 
+int netdev_send_batch(struct netdev *netdev,
+                      struct packet **packets, int num_packets)
+{
+	int i;
+
+	if (netdev->ops->send_batch != NULL)
+		return netdev->ops->send_batch(netdev, packets, num_packets);
+
+	for (i = 0; i < num_packets; ++i)
+	{
+		if (netdev_send(netdev, packets[i]))
+			return STATUS_ERR;
+		packets[i]->time_usecs = now_usecs();
+		packets[i]->time_source = TIME_SOURCE_USER;
+	}
+	return STATUS_OK;
+}
+
 int netdev_receive_loop(struct packet_socket *psock,
                         enum packet_layer_t layer,
                         enum direction_t direction,
@@ -460,11 +632,18 @@ int netdev_receive_loop(struct packet_socket *psock,
 		int in_bytes = 0;
 		enum packet_parse_result_t result;
 
-		*packet = packet_new(PACKET_READ_BYTES);
+		/* Sniffed packets come from the packet pool, since we
+		 * discard most of them right away on a busy interface.
+		 */
+		*packet = packet_new_pooled(PACKET_READ_BYTES);
 
 		/* Sniff the next outbound packet from the kernel under test. */
 		if (packet_socket_receive(psock, direction, *packet, &in_bytes))
+		{
+			packet_free(*packet);
+			*packet = NULL;
 			continue;
+		}
 
 		++*num_packets;
 		result = parse_packet(*packet, in_bytes, layer, error);
@@ -54,6 +54,14 @@ struct netdev_ops {
 	 */
 	int (*receive)(struct netdev *netdev,
 		       struct packet **packet, char **error);
+
+	/* Optional: inject the given raw TCP/IP packets into the kernel,
+	 * in order and as close together in time as the device allows,
+	 * and set the time_usecs of each to the now_usecs() time it was
+	 * sent at, as best the device can tell.
+	 */
+	int (*send_batch)(struct netdev *netdev,
+			  struct packet **packets, int num_packets);
 };
 
 
@@ -82,6 +90,14 @@ static inline int netdev_receive(struct netdev *netdev,
 }
 
 
+/* Inject the given raw TCP/IP packets into the kernel, in order and
+ * as close together in time as the device allows, and set the
+ * time_usecs of each to the now_usecs() time it was sent at. Devices
+ * without a batch send operation get the packets one at a time.
+ */
+extern int netdev_send_batch(struct netdev *netdev,
+			     struct packet **packets, int num_packets);
+
 /* Keep sniffing packets leaving the kernel until we see one we know
  * about and can parse. Return a pointer to the newly-allocated
  * packet. Caller must free the packet with packet_free().
@@ -26,11 +26,13 @@
 #include "packet.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include "ethernet.h"
 #include "gre_packet.h"
 #include "ip_packet.h"
+#include "logging.h"
 #include "mpls_packet.h"
 
 
@@ -47,6 +49,36 @@ struct header_type_info header_types[HEADER_NUM_TYPES] = {
 	{ "ICMPV6", IPPROTO_ICMPV6,	0,		NULL },
 };
 
+/* A process-wide pool of recycled packets with PACKET_POOL_BUFFER_BYTES
+ * buffers. The sniffing loop allocates and discards a packet for every
+ * frame it sees, most of which turn out to be irrelevant to the test,
+ * so we keep freed packets around instead of handing their 64KB
+ * buffers back to malloc. The wire server has one thread per client,
+ * so the pool is protected by a mutex.
+ */
+struct packet_pool {
+	pthread_mutex_t mutex;
+	struct packet *free_packets[PACKET_POOL_MAX_FREE];
+	int num_free;			/* entries used in free_packets */
+	struct packet_pool_stats stats;
+};
+
+static struct packet_pool packet_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void packet_pool_lock(void)
+{
+	if (pthread_mutex_lock(&packet_pool.mutex) != 0)
+		die_perror("pthread_mutex_lock");
+}
+
+static void packet_pool_unlock(void)
+{
+	if (pthread_mutex_unlock(&packet_pool.mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+}
+
 struct packet *packet_new(u32 buffer_bytes)
 {
 	struct packet *packet = calloc(1, sizeof(struct packet));
@@ -55,13 +87,72 @@ struct packet *packet_new(u32 buffer_bytes)
 	return packet;
 }
 
+struct packet *packet_new_pooled(u32 buffer_bytes)
+{
+	struct packet *packet = NULL;
+	u8 *buffer = NULL;
+
+	if (buffer_bytes > PACKET_POOL_BUFFER_BYTES)
+		return packet_new(buffer_bytes);
+
+	packet_pool_lock();
+	if (packet_pool.num_free > 0) {
+		packet = packet_pool.free_packets[--packet_pool.num_free];
+		++packet_pool.stats.hits;
+	} else {
+		++packet_pool.stats.misses;
+	}
+	++packet_pool.stats.in_use;
+	packet_pool.stats.high_water = max(packet_pool.stats.high_water,
+					   packet_pool.stats.in_use);
+	packet_pool_unlock();
+
+	if (packet == NULL) {
+		packet = packet_new(PACKET_POOL_BUFFER_BYTES);
+		packet->is_pooled = true;
+		return packet;
+	}
+
+	/* Hand out a recycled packet that looks freshly calloc-ed. */
+	buffer = packet->buffer;
+	memset(packet, 0, sizeof(*packet));
+	packet->buffer = buffer;
+	packet->buffer_bytes = PACKET_POOL_BUFFER_BYTES;
+	packet->is_pooled = true;
+	return packet;
+}
+
 void packet_free(struct packet *packet)
 {
+	if (packet->is_pooled) {
+		bool recycled = false;
+
+		packet_pool_lock();
+		--packet_pool.stats.in_use;
+		if (packet_pool.num_free < PACKET_POOL_MAX_FREE) {
+			packet_pool.free_packets[packet_pool.num_free++] =
+				packet;
+			recycled = true;
+		}
+		packet_pool_unlock();
+
+		if (recycled)
+			return;
+	}
+
 	free(packet->buffer);
 	memset(packet, 0, sizeof(*packet));  /* paranoia to help catch bugs */
 	free(packet);
 }
 
+void packet_pool_get_stats(struct packet_pool_stats *stats)
+{
+	packet_pool_lock();
+	*stats = packet_pool.stats;
+	stats->free = packet_pool.num_free;
+	packet_pool_unlock();
+}
+
 int packet_header_count(const struct packet *packet)
 {
 	int i;
@@ -133,16 +224,20 @@ static void *offset_ptr(u8 *old_base, u8* new_base, void *old_ptr)
 /* Make a copy of the given old packet, but in the new copy reserve the
  * given number of bytes of headroom at the start of the packet->buffer.
  * This empty headroom can later be filled with outer packet headers.
- * A slow but simple model.
+ * A slow but simple model. Short-lived copies should come from the
+ * packet pool; long-lived ones should not pin a full pool buffer.
  */
 static struct packet *packet_copy_with_headroom(struct packet *old_packet,
-						int bytes_headroom)
+						int bytes_headroom,
+						bool use_pool)
 {
 	/* Allocate a new packet and copy link layer header and IP datagram. */
 	const int bytes_used = packet_end(old_packet) - old_packet->buffer;
 	assert(bytes_used >= 0);
 	assert(bytes_used <= 128*1024);
-	struct packet *packet = packet_new(bytes_headroom + bytes_used);
+	struct packet *packet = use_pool ?
+		packet_new_pooled(bytes_headroom + bytes_used) :
+		packet_new(bytes_headroom + bytes_used);
 	u8 *old_base = old_packet->buffer;
 	u8 *new_base = packet->buffer + bytes_headroom;
 
@@ -151,6 +246,7 @@ static struct packet *packet_copy_with_headroom(struct packet *old_packet,
 	packet->ip_bytes	= old_packet->ip_bytes;
 	packet->direction	= old_packet->direction;
 	packet->time_usecs	= old_packet->time_usecs;
+	packet->time_source	= old_packet->time_source;
 	packet->flags		= old_packet->flags;
 	packet->ecn		= old_packet->ecn;
 
@@ -174,7 +270,24 @@ static struct packet *packet_copy_with_headroom(struct packet *old_packet,
 
 struct packet *packet_copy(struct packet *old_packet)
 {
-	return packet_copy_with_headroom(old_packet, 0);
+	return packet_copy_with_headroom(old_packet, 0, true);
+}
+
+struct packet *packet_copy_unpooled(struct packet *old_packet)
+{
+	return packet_copy_with_headroom(old_packet, 0, false);
+}
+
+const char *packet_time_source_label(enum packet_time_source_t source)
+{
+	switch (source) {
+	case TIME_SOURCE_USER:		return "";
+	case TIME_SOURCE_SOFTWARE:	return " (kernel timestamp)";
+	case TIME_SOURCE_HARDWARE:	return " (NIC timestamp)";
+	/* We omit the default case so compiler catches missing values. */
+	}
+	assert(!"not reached");
+	return "";
 }
 
 /* Finalize all the headers once we know what's inside inner layers. */
@@ -206,7 +319,7 @@ struct packet *packet_encapsulate(struct packet *outer, struct packet *inner)
 	assert(outer_headers + inner_headers <= PACKET_MAX_HEADERS);
 
 	/* Copy the inner packet bits and header metadata. */
-	packet = packet_copy_with_headroom(inner, outer->ip_bytes);
+	packet = packet_copy_with_headroom(inner, outer->ip_bytes, false);
 
 	/* Copy over the bits in the outer headers. */
 	memcpy(packet->buffer, outer->buffer, outer->ip_bytes);
@@ -54,12 +54,27 @@
  */
 static const int PACKET_READ_BYTES = 64 * 1024;
 
+/* Every packet in the packet pool has a buffer of this size, so the
+ * pool can serve any sniffed packet or any copy of one.
+ */
+#define PACKET_POOL_BUFFER_BYTES	(64 * 1024)
+
+/* Maximum number of free packets the pool keeps around for reuse. */
+#define PACKET_POOL_MAX_FREE		64
+
 /* Maximum number of headers. */
 #define PACKET_MAX_HEADERS	6
 
 /* Maximum number of bytes of headers. */
 #define PACKET_MAX_HEADER_BYTES	256
 
+/* Who took a packet's time_usecs, from least to most accurate. */
+enum packet_time_source_t {
+	TIME_SOURCE_USER = 0,	/* us, just before or after a system call */
+	TIME_SOURCE_SOFTWARE,	/* the kernel, as it sent or sniffed it */
+	TIME_SOURCE_HARDWARE,	/* the NIC, as it went over the wire */
+};
+
 /* TCP/UDP/IPv4 packet, including IPv4 header, TCP/UDP header, and data. There
  * may also be a link layer header between the 'buffer' and 'ip'
  * pointers, but we typically ignore that. The 'buffer_bytes' field
@@ -98,26 +113,65 @@ struct packet
 	struct icmpv6 *icmpv6;	/* start of ICMPv6 header, if present */
 
 	s64 time_usecs;		/* wall time of receive/send if non-zero */
+	enum packet_time_source_t time_source;	/* who took time_usecs */
 
 	u32 flags;		/* various meta-flags */
 #define FLAG_WIN_NOCHECK	0x1  /* don't check TCP receive window */
 #define FLAG_OPTIONS_NOCHECK	0x2  /* don't check TCP options */
+#define FLAG_CHECKSUMS_VALID	0x4  /* L3 and L4 checksums filled in */
 
 	enum ip_ecn_t ecn;	/* IPv4/IPv6 ECN treatment for packet */
 
 	__be32 *tcp_ts_val;	/* location of TCP timestamp val, or NULL */
 	__be32 *tcp_ts_ecr;	/* location of TCP timestamp ecr, or NULL */
+
+	bool is_pooled;		/* packet_free() returns us to the pool? */
+};
+
+/* Counters describing how well the packet pool is doing. */
+struct packet_pool_stats {
+	u64 hits;		/* allocations served from the free list */
+	u64 misses;		/* allocations that had to call malloc */
+	int in_use;		/* pooled packets currently allocated */
+	int high_water;		/* maximum value of in_use so far */
+	int free;		/* packets sitting on the free list */
 };
 
 /* Allocate and initialize a packet. */
 extern struct packet *packet_new(u32 buffer_length);
 
-/* Free all the memory used by the packet. */
+/* Allocate and initialize a packet, recycling a previously freed
+ * pooled packet if possible. Buffers of pooled packets are
+ * PACKET_POOL_BUFFER_BYTES long; if buffer_length is larger than
+ * that, this falls back to packet_new().
+ */
+extern struct packet *packet_new_pooled(u32 buffer_length);
+
+/* Free all the memory used by the packet, or return it to the packet
+ * pool if it came from there.
+ */
 extern void packet_free(struct packet *packet);
 
-/* Create a packet that is a copy of the contents of the given packet. */
+/* Fill in *stats with a snapshot of the packet pool counters. */
+extern void packet_pool_get_stats(struct packet_pool_stats *stats);
+
+/* Create a packet that is a copy of the contents of the given packet.
+ * The copy comes from the packet pool when it fits.
+ */
 extern struct packet *packet_copy(struct packet *old_packet);
 
+/* Create an exactly-sized copy of the given packet that does not come
+ * from the packet pool, for packets that are kept around for a long
+ * time, like those in cached scripts.
+ */
+extern struct packet *packet_copy_unpooled(struct packet *old_packet);
+
+/* Return a note on who took a packet's timestamp, such as
+ * " (NIC timestamp)" for dumps and error messages, or "" for
+ * timestamps we took ourselves.
+ */
+extern const char *packet_time_source_label(enum packet_time_source_t source);
+
 /* Return the number of headers in the given packet. */
 extern int packet_header_count(const struct packet *packet);
 
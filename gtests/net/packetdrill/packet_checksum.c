@@ -114,3 +114,65 @@ void checksum_packet(struct packet *packet)
 	else
 		assert(!"bad ip version");
 }
+
+/* Return the number of leading layer 4 bytes that map_inbound_packet()
+ * may rewrite, or 0 if the packet needs a full checksum. ICMP is in
+ * the latter group, since remapping it rewrites the headers quoted in
+ * its payload.
+ */
+static int rewritable_l4_header_len(const struct packet *packet)
+{
+	if (packet->tcp != NULL)
+		return packet_tcp_header_len(packet);
+	else if (packet->udp != NULL)
+		return packet_udp_header_len(packet);
+	else
+		return 0;
+}
+
+void checksum_packet_update(struct packet *packet,
+			    const struct packet *original)
+{
+	const int l4_header_bytes = rewritable_l4_header_len(packet);
+	const u8 *old_l4 = NULL, *new_l4 = NULL;
+	__sum16 *l4_check = NULL;
+	__sum16 check;
+
+	assert(packet->ip_bytes == original->ip_bytes);
+	if (l4_header_bytes == 0) {
+		checksum_packet(packet);
+		return;
+	}
+
+	if (packet->tcp != NULL) {
+		old_l4 = (const u8 *)original->tcp;
+		new_l4 = (const u8 *)packet->tcp;
+		l4_check = &packet->tcp->check;
+	} else {
+		old_l4 = (const u8 *)original->udp;
+		new_l4 = (const u8 *)packet->udp;
+		l4_check = &packet->udp->check;
+	}
+
+	/* The layer 4 checksum covers the addresses in the pseudo-header
+	 * and the header we may have rewritten; the payload is untouched.
+	 * The original and new headers hold the same old checksum, so it
+	 * must not be stored until all the deltas have been folded in.
+	 */
+	check = *l4_check;
+	if (packet->ipv4 != NULL) {
+		struct ipv4 *ipv4 = packet->ipv4;
+
+		ipv4->check = checksum_update(ipv4->check, original->ipv4,
+					      ipv4, ipv4_header_len(ipv4));
+		check = checksum_update(check, &original->ipv4->src_ip,
+					&ipv4->src_ip,
+					2 * sizeof(struct in_addr));
+	} else {
+		check = checksum_update(check, &original->ipv6->src_ip,
+					&packet->ipv6->src_ip,
+					2 * sizeof(struct in6_addr));
+	}
+	check = checksum_update(check, old_l4, new_l4, l4_header_bytes);
+	*l4_check = check;
+}
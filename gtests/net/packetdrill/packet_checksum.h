@@ -30,4 +30,13 @@
 /* Fill in layer 3 and layer 4 checksums for the given input 'packet'. */
 extern void checksum_packet(struct packet *packet);
 
+/* Fill in the checksums for 'packet', a copy of 'original' whose
+ * checksums were valid and in which only the IP addresses and layer 4
+ * header fields have since been rewritten. Only the changed words are
+ * folded into the checksums (RFC 1624), so the cost does not grow with
+ * the payload. Falls back to checksum_packet() for ICMP.
+ */
+extern void checksum_packet_update(struct packet *packet,
+				   const struct packet *original);
+
 #endif /* __PACKET_CHECKSUM_H__ */
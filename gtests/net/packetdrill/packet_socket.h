@@ -33,12 +33,61 @@
 
 #include "ethernet.h"
 #include "ip_address.h"
+#include "ip_prefix.h"
 #include "packet.h"
 
 struct packet_socket;
 
-/* Allocate and initialize a packet socket. */
-extern struct packet_socket *packet_socket_new(const char *device_name);
+/* The ways we can pull sniffed packets out of the kernel. */
+enum packet_socket_mode_t {
+	/* One recvfrom() plus one SIOCGSTAMP ioctl per packet. */
+	PACKET_SOCKET_RECVFROM = 0,
+
+	/* A memory-mapped TPACKET_V3 receive ring (PACKET_RX_RING);
+	 * timestamps come from the per-frame ring header. Linux only.
+	 */
+	PACKET_SOCKET_RX_RING,
+
+	/* Like PACKET_SOCKET_RX_RING, but also send frames through a
+	 * memory-mapped PACKET_TX_RING, so that a batch of frames queued
+	 * with packet_socket_queue() goes out with a single send() call.
+	 * Linux only.
+	 */
+	PACKET_SOCKET_RINGS,
+};
+
+/* The kernel timestamps we can ask for on sent and sniffed frames. */
+enum packet_timestamps_t {
+	/* No timestamps on sent frames; sniffed frames get the
+	 * kernel's default software timestamp.
+	 */
+	PACKET_TIMESTAMPS_OFF = 0,
+
+	/* SO_TIMESTAMPING software timestamps, taken as the driver is
+	 * handed a sent frame or as a sniffed frame arrives.
+	 */
+	PACKET_TIMESTAMPS_SOFTWARE,
+
+	/* SO_TIMESTAMPING raw hardware timestamps taken by the NIC,
+	 * translated to wall clock time using the NIC's PTP hardware
+	 * clock. Frames the NIC doesn't stamp get software times.
+	 */
+	PACKET_TIMESTAMPS_HARDWARE,
+};
+
+/* Counts of the traffic through a packet socket. */
+struct packet_socket_stats {
+	int tx_frames;		/* frames we have sent */
+	int tx_batches;		/* system calls it took to send them */
+	int rx_frames;		/* frames the kernel has sniffed for us */
+	int rx_drops;		/* frames it dropped for lack of room */
+};
+
+/* Allocate and initialize a packet socket that sniffs packets using
+ * the given mode.
+ */
+extern struct packet_socket *packet_socket_new(
+	const char *device_name, enum packet_socket_mode_t mode);
 
 /* Free all the memory used by the packet socket. */
 extern void packet_socket_free(struct packet_socket *packet_socket);
@@ -49,16 +98,66 @@ extern void packet_socket_set_filter(
 	const struct ether_addr *client_ether_addr,
 	const struct ip_address *client_live_ip);
 
+/* Add a filter so we only sniff TCP and UDP packets the kernel sends
+ * from local_ip to an address in remote_prefix; the kernel drops all
+ * other packets before they reach our receive buffer.
+ */
+extern void packet_socket_set_outbound_filter(
+	struct packet_socket *psock,
+	const struct ip_address *local_ip,
+	const struct ip_prefix *remote_prefix);
+
 /* Send the given packet using writev. Return STATUS_OK on success,
  * or STATUS_ERR if writev returns an error.
  */
 extern int packet_socket_writev(struct packet_socket *psock,
 				const struct iovec *iov, int iovcnt);
 
+/* Queue the given frame to go out with the next packet_socket_flush().
+ * Without a TX ring the frame is sent right away using writev. Return
+ * STATUS_OK on success, or STATUS_ERR on error.
+ */
+extern int packet_socket_queue(struct packet_socket *psock,
+			       const struct iovec *iov, int iovcnt);
+
+/* Send all the frames queued with packet_socket_queue(), in order,
+ * and wait until the kernel has handed them to the device. Return
+ * STATUS_OK on success, or STATUS_ERR on error.
+ */
+extern int packet_socket_flush(struct packet_socket *psock);
+
+/* Fill in the given stats with the traffic since the socket was
+ * created. Reading the receive counts resets them in the kernel.
+ */
+extern void packet_socket_get_stats(struct packet_socket *psock,
+				    struct packet_socket_stats *stats);
+
+/* Ask the kernel to timestamp the frames we send and sniff as given.
+ * Returns the kinds of timestamps we actually got, which is software
+ * timestamps if the device or platform can't do hardware ones.
+ */
+extern enum packet_timestamps_t packet_socket_enable_timestamps(
+	struct packet_socket *psock, enum packet_timestamps_t timestamps);
+
+/* Wait briefly for the kernel to report when the frames sent since the
+ * last call went out, and fill in their wall clock times, in the order
+ * they were queued, in tx_usecs[0..num_frames-1]. Returns where the
+ * times came from, or TIME_SOURCE_USER if timestamps are off or we
+ * didn't get one for every frame, in which case tx_usecs is untouched.
+ */
+extern enum packet_time_source_t packet_socket_tx_times(
+	struct packet_socket *psock, s64 *tx_usecs, int num_frames);
+
+/* Discard, without blocking, any sniffed packets that are buffered
+ * in the kernel or in our receive ring. Returns the number of packets
+ * discarded.
+ */
+extern int packet_socket_drain(struct packet_socket *psock);
+
 /* Do a blocking sniff of the next packet going over the given device
  * in the given direction, fill in the given packet with the sniffed
- * packet info, and return the number of bytes in the packet in
- * *in_bytes. If we successfully read a matching packet, return
+ * packet info and wall clock time, and return the number of bytes in
+ * the packet in *in_bytes. If we successfully read a matching packet, return
  * STATUS_OK; else return STATUS_ERR (in which case the caller can
  * retry).
  */
@@ -35,8 +35,16 @@
 
 #ifdef linux
 
-#include <netpacket/packet.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/ethtool.h>
+#include <linux/if_packet.h>
 #include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/ptp_clock.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 #include "ethernet.h"
 #include "logging.h"
@@ -44,12 +52,100 @@
 /* Number of bytes to buffer in the packet socket we use for sniffing. */
 static const int PACKET_SOCKET_RCVBUF_BYTES = 2*1024*1024;
 
+/* Geometry of the TPACKET_V3 receive ring. Blocks must be a multiple
+ * of the page size and big enough to hold a maximal (64KB TSO/GSO)
+ * frame plus its tpacket3_hdr and sockaddr_ll. The total ring size
+ * matches PACKET_SOCKET_RCVBUF_BYTES so both modes buffer about the
+ * same amount of traffic.
+ */
+static const int RX_RING_BLOCK_BYTES = 256*1024;
+static const int RX_RING_BLOCKS = 8;
+static const int RX_RING_FRAME_BYTES = 2048;
+
+/* With TPACKET_V3 the kernel only hands a block to user space once
+ * the block fills up or this many milliseconds pass since its first
+ * frame. Since tests typically send a handful of packets at a time,
+ * we nearly always wake up due to this timeout, so keep it as short
+ * as the kernel allows. The timestamps themselves are taken when the
+ * kernel sniffs the packet, so this delay does not skew them.
+ */
+static const int RX_RING_BLOCK_TIMEOUT_MSECS = 1;
+
+/* Geometry of the TPACKET_V2 transmit ring used in PACKET_SOCKET_RINGS
+ * mode. Each frame slot holds a jumbo ethernet frame plus its
+ * tpacket2_hdr; larger frames bypass the ring. A full ring is as many
+ * frames as the longest batch run_inbound_packet_batch() sends.
+ */
+static const int TX_RING_BLOCK_BYTES = 64*1024;
+static const int TX_RING_FRAME_BYTES = 16*1024;
+static const int TX_RING_FRAMES = 64;
+
+/* How long we wait for the kernel to report when sent frames left. */
+static const int TX_TIMESTAMP_TIMEOUT_MSECS = 5;
+
+/* After this many batches in a row without a single report of when a
+ * frame left, we stop waiting for them.
+ */
+static const int TX_TIMESTAMP_MAX_MISSES = 3;
+
+/* The NIC's hardware clock and the wall clock drift apart, so we
+ * measure the offset between them again for any timestamp this far
+ * from the last measurement.
+ */
+static const s64 PHC_RESAMPLE_USECS = 100000;
+
+/* Offset of the frame data within a TX ring slot. */
+#define TX_RING_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
 struct packet_socket {
 	int packet_fd;	/* socket for sending, sniffing timestamped packets */
 	char *name;	/* malloc-allocated copy of interface name */
 	int index;	/* interface index from if_nametoindex */
+
+	enum packet_socket_mode_t mode;	/* how we read sniffed packets */
+
+	/* State for the receive ring in PACKET_SOCKET_RX_RING and
+	 * PACKET_SOCKET_RINGS modes.
+	 */
+	u8 *ring;		/* mmap-ed ring of ring_blocks blocks */
+	int ring_bytes;		/* total bytes mapped at ring */
+	int ring_block_bytes;	/* bytes in each block of the ring */
+	int ring_blocks;	/* number of blocks in the ring */
+	int block_index;	/* index of block we're reading or waiting on */
+	struct tpacket3_hdr *next_frame;  /* next unread frame in block */
+	int frames_left;	/* number of unread frames in current block */
+
+	/* State for the PACKET_SOCKET_RINGS transmit ring. We send from
+	 * a separate socket bound to protocol 0, which the kernel never
+	 * hands received frames, so that none of its work is wasted.
+	 */
+	int tx_fd;		/* TX ring socket, or -1 until first send */
+	u8 *tx_ring;		/* mmap-ed ring of tx_frames frame slots */
+	int tx_ring_bytes;	/* total bytes mapped at tx_ring */
+	int tx_frame_bytes;	/* bytes in each frame slot */
+	int tx_frames;		/* number of frame slots in the ring */
+	int tx_head;		/* index of next slot to fill */
+	int tx_queued;		/* slots filled since the last send() */
+
+	int tx_frames_sent;	/* frames we have sent */
+	int tx_batches;		/* system calls it took to send them */
+
+	/* State for timestamps; see packet_socket_enable_timestamps(). */
+	enum packet_timestamps_t timestamps;	/* kinds we got */
+	int timestamping_flags;	/* our SO_TIMESTAMPING flags */
+	int tx_unreported;	/* frames sent since the last tx_times */
+	int tx_missed_reports;	/* batches in a row with no TX times */
+	int phc_fd;		/* the NIC's PTP hardware clock, or -1 */
+	s64 phc_offset_usecs;	/* wall clock time minus PHC time */
+	s64 phc_sampled_usecs;	/* wall clock time of that measurement */
+	bool phc_failed;	/* whether a measurement has failed */
 };
 
+static inline s64 timespec_to_usecs(const struct timespec *ts)
+{
+	return ((s64)ts->tv_sec) * 1000000LL + ts->tv_nsec / 1000;
+}
+
 /* Set the receive buffer for a socket to the given size in bytes. */
 static void set_receive_buffer_size(int fd, int bytes)
 {
@@ -70,6 +166,115 @@ static void bind_to_interface(int fd, int interface_index)
 		die_perror("bind packet socket");
 }
 
+/* Switch the packet socket to TPACKET_V3 and map a receive ring, so
+ * the kernel copies sniffed frames straight into our address space
+ * and we need no system calls to read them while frames are pending.
+ */
+static void rx_ring_setup(struct packet_socket *psock)
+{
+	struct tpacket_req3 req;
+	int version = TPACKET_V3;
+
+	if (setsockopt(psock->packet_fd, SOL_PACKET, PACKET_VERSION,
+		       &version, sizeof(version)) < 0)
+		die_perror("setsockopt SOL_PACKET PACKET_VERSION");
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size	= RX_RING_BLOCK_BYTES;
+	req.tp_block_nr		= RX_RING_BLOCKS;
+	req.tp_frame_size	= RX_RING_FRAME_BYTES;
+	req.tp_frame_nr		= (RX_RING_BLOCK_BYTES / RX_RING_FRAME_BYTES) *
+				  RX_RING_BLOCKS;
+	req.tp_retire_blk_tov	= RX_RING_BLOCK_TIMEOUT_MSECS;
+	req.tp_feature_req_word	= 0;
+
+	if (setsockopt(psock->packet_fd, SOL_PACKET, PACKET_RX_RING,
+		       &req, sizeof(req)) < 0)
+		die_perror("setsockopt SOL_PACKET PACKET_RX_RING");
+
+	psock->ring_block_bytes	= req.tp_block_size;
+	psock->ring_blocks	= req.tp_block_nr;
+	psock->ring_bytes	= req.tp_block_size * req.tp_block_nr;
+	psock->ring = mmap(NULL, psock->ring_bytes, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, psock->packet_fd, 0);
+	if (psock->ring == MAP_FAILED)
+		die_perror("mmap PACKET_RX_RING");
+
+	psock->block_index	= 0;
+	psock->next_frame	= NULL;
+	psock->frames_left	= 0;
+}
+
+/* Create the socket and map the ring we use to send frames in
+ * PACKET_SOCKET_RINGS mode. We do this on the first send, since most
+ * packet sockets only ever sniff.
+ */
+static void tx_ring_setup(struct packet_socket *psock)
+{
+	struct tpacket_req req;
+	struct sockaddr_ll sll;
+	int version = TPACKET_V2;
+
+	psock->tx_fd = socket(PF_PACKET, SOCK_RAW, 0);
+	if (psock->tx_fd < 0)
+		die_perror("socket(PF_PACKET, SOCK_RAW, 0)");
+
+	if (setsockopt(psock->tx_fd, SOL_PACKET, PACKET_VERSION,
+		       &version, sizeof(version)) < 0)
+		die_perror("setsockopt SOL_PACKET PACKET_VERSION");
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size	= TX_RING_BLOCK_BYTES;
+	req.tp_frame_size	= TX_RING_FRAME_BYTES;
+	req.tp_frame_nr		= TX_RING_FRAMES;
+	req.tp_block_nr		= TX_RING_FRAMES /
+				  (TX_RING_BLOCK_BYTES / TX_RING_FRAME_BYTES);
+
+	if (setsockopt(psock->tx_fd, SOL_PACKET, PACKET_TX_RING,
+		       &req, sizeof(req)) < 0)
+		die_perror("setsockopt SOL_PACKET PACKET_TX_RING");
+
+	psock->tx_frame_bytes	= req.tp_frame_size;
+	psock->tx_frames	= req.tp_frame_nr;
+	psock->tx_ring_bytes	= req.tp_block_size * req.tp_block_nr;
+	psock->tx_ring = mmap(NULL, psock->tx_ring_bytes,
+			      PROT_READ | PROT_WRITE, MAP_SHARED,
+			      psock->tx_fd, 0);
+	if (psock->tx_ring == MAP_FAILED)
+		die_perror("mmap PACKET_TX_RING");
+
+	/* Protocol 0 means we send on the device but never receive. */
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family		= AF_PACKET;
+	sll.sll_ifindex		= psock->index;
+	sll.sll_protocol	= 0;
+	if (bind(psock->tx_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		die_perror("bind packet socket TX ring");
+
+	if (psock->timestamping_flags != 0 &&
+	    setsockopt(psock->tx_fd, SOL_SOCKET, SO_TIMESTAMPING,
+		       &psock->timestamping_flags,
+		       sizeof(psock->timestamping_flags)) < 0)
+		die_perror("setsockopt SOL_SOCKET SO_TIMESTAMPING");
+
+	psock->tx_head		= 0;
+	psock->tx_queued	= 0;
+}
+
+/* Return the header of the TX ring slot with the given index. Slots
+ * never straddle blocks, and blocks are contiguous in the mapping.
+ */
+static inline struct tpacket2_hdr *tx_ring_frame(struct packet_socket *psock,
+						 int index)
+{
+	int frames_per_block = TX_RING_BLOCK_BYTES / psock->tx_frame_bytes;
+
+	return (struct tpacket2_hdr *)
+		(psock->tx_ring +
+		 (index / frames_per_block) * TX_RING_BLOCK_BYTES +
+		 (index % frames_per_block) * psock->tx_frame_bytes);
+}
+
 /* Allocate and configure a packet socket just like the one tcpdump
  * uses. We do this so we can get timestamps on the outbound packets
  * the kernel sends, to verify the correct timing (tun devices do not
@@ -88,9 +293,14 @@ static void packet_socket_setup(struct packet_socket *psock)
 		die_perror("if_nametoindex");
 	DEBUGP("device index: %s -> %d\n", psock->name, psock->index);
 
-	bind_to_interface(psock->packet_fd, psock->index);
+	/* Size the kernel-side buffering before binding to the device. */
+	if (psock->mode != PACKET_SOCKET_RECVFROM)
+		rx_ring_setup(psock);
+	else
+		set_receive_buffer_size(psock->packet_fd,
+					PACKET_SOCKET_RCVBUF_BYTES);
 
-	set_receive_buffer_size(psock->packet_fd, PACKET_SOCKET_RCVBUF_BYTES);
+	bind_to_interface(psock->packet_fd, psock->index);
 }
 
 /* Add a filter so we only sniff packets we want. */
@@ -180,12 +390,123 @@ void packet_socket_set_filter(struct packet_socket *psock,
 	}
 }
 
-struct packet_socket *packet_socket_new(const char *device_name)
+/* Placeholder jump target in outbound filter programs; patched to
+ * point at the final "drop" instruction once the program is complete.
+ */
+#define BPF_JUMP_TO_DROP 0xff
+
+/* Maximum length of the outbound filter program: 7 instructions for
+ * direction, protocol and transport checks, at most 3 per address word
+ * for 4 source and 4 destination words, and accept/drop.
+ */
+#define MAX_OUTBOUND_FILTER_LEN (7 + 3*8 + 2)
+
+/* Append instructions checking that the 32-bit words of the address at
+ * the given packet offset, masked to the first prefix_len bits, equal
+ * those of ip.
+ */
+static int outbound_filter_add_address(struct sock_filter *filter, int len,
+				       int offset, const struct ip_address *ip,
+				       int prefix_len)
+{
+	int words = ip_address_length(ip->address_family) / sizeof(u32);
+	int i;
+
+	for (i = 0; i < words && prefix_len > 0; ++i, prefix_len -= 32) {
+		u32 mask = (prefix_len >= 32) ? 0xffffffff :
+			~(0xffffffff >> prefix_len);
+		u32 word = ntohl(((const u32 *)ip->ip.bytes)[i]);
+
+		filter[len++] = (struct sock_filter)
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset + 4*i);
+		if (mask != 0xffffffff)
+			filter[len++] = (struct sock_filter)
+				BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask);
+		filter[len++] = (struct sock_filter)
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, word & mask,
+				 0, BPF_JUMP_TO_DROP);
+	}
+	return len;
+}
+
+/* Add a filter so we only sniff outbound packets we want. */
+void packet_socket_set_outbound_filter(struct packet_socket *psock,
+				       const struct ip_address *local_ip,
+				       const struct ip_prefix *remote_prefix)
+{
+	struct sock_filter filter[MAX_OUTBOUND_FILTER_LEN];
+	struct sock_fprog bpfcode;
+	bool ipv6 = (local_ip->address_family == AF_INET6);
+	int len = 0, i;
+
+	/* Tun devices have no link-layer header, so the IP header is at
+	 * offset 0. The direction and ethertype come from the kernel's
+	 * ancillary data rather than the packet itself.
+	 */
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	filter[len++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING,
+			 0, BPF_JUMP_TO_DROP);
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+	filter[len++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			 ipv6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP,
+			 0, BPF_JUMP_TO_DROP);
+
+	/* IPv4 protocol or IPv6 next header: TCP or UDP. */
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ipv6 ? 6 : 9);
+	filter[len++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0);
+	filter[len++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP,
+			 0, BPF_JUMP_TO_DROP);
+
+	/* Source is our local IP; destination is in the remote prefix. */
+	len = outbound_filter_add_address(filter, len, ipv6 ? 8 : 12,
+					  local_ip, ipv6 ? 128 : 32);
+	len = outbound_filter_add_address(filter, len, ipv6 ? 24 : 16,
+					  &remote_prefix->ip,
+					  remote_prefix->prefix_len);
+
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_RET | BPF_K, 0x0000ffff);	/* accept */
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_RET | BPF_K, 0);		/* drop */
+	assert(len <= ARRAY_SIZE(filter));
+
+	for (i = 0; i < len; ++i) {
+		if (BPF_CLASS(filter[i].code) == BPF_JMP &&
+		    filter[i].jf == BPF_JUMP_TO_DROP)
+			filter[i].jf = (len - 1) - (i + 1);
+	}
+
+	bpfcode.len	= len;
+	bpfcode.filter	= filter;
+
+	if (setsockopt(psock->packet_fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		       &bpfcode, sizeof(bpfcode)) < 0) {
+		die_perror("setsockopt SOL_SOCKET, SO_ATTACH_FILTER");
+	}
+
+	/* Packets queued before the filter was attached were not
+	 * filtered; throw them away.
+	 */
+	packet_socket_drain(psock);
+}
+
+struct packet_socket *packet_socket_new(const char *device_name,
+				       enum packet_socket_mode_t mode)
 {
 	struct packet_socket *psock = calloc(1, sizeof(struct packet_socket));
 
 	psock->name = strdup(device_name);
 	psock->packet_fd = -1;
+	psock->tx_fd = -1;
+	psock->phc_fd = -1;
+	psock->mode = mode;
 
 	packet_socket_setup(psock);
 
@@ -194,6 +515,28 @@ struct packet_socket *packet_socket_new(const char *device_name)
 
 void packet_socket_free(struct packet_socket *psock)
 {
+	if (psock->ring != NULL) {
+		if (DEBUG_LOGGING) {
+			struct tpacket_stats_v3 stats;
+			socklen_t len = sizeof(stats);
+			if (getsockopt(psock->packet_fd, SOL_PACKET,
+				       PACKET_STATISTICS, &stats, &len) == 0)
+				DEBUGP("rx ring: packets: %u drops: %u "
+				       "freeze_q_cnt: %u\n",
+				       stats.tp_packets, stats.tp_drops,
+				       stats.tp_freeze_q_cnt);
+		}
+		munmap(psock->ring, psock->ring_bytes);
+	}
+
+	if (psock->tx_ring != NULL)
+		munmap(psock->tx_ring, psock->tx_ring_bytes);
+	if (psock->tx_fd >= 0)
+		close(psock->tx_fd);
+
+	if (psock->phc_fd >= 0)
+		close(psock->phc_fd);
+
 	if (psock->packet_fd >= 0)
 		close(psock->packet_fd);
 
@@ -204,46 +547,471 @@ void packet_socket_free(struct packet_socket *psock)
 	free(psock);
 }
 
-int packet_socket_writev(struct packet_socket *psock,
-			 const struct iovec *iov, int iovcnt)
+/* Send the given frame right away with a writev on the sniffing
+ * socket, which has no TX ring.
+ */
+static int packet_socket_send_now(struct packet_socket *psock,
+				  const struct iovec *iov, int iovcnt)
 {
 	if (writev(psock->packet_fd, iov, iovcnt) < 0) {
 		perror("writev");
 		return STATUS_ERR;
 	}
+	++psock->tx_frames_sent;
+	++psock->tx_batches;
+	++psock->tx_unreported;
 	return STATUS_OK;
 }
 
-int packet_socket_receive(struct packet_socket *psock,
-			  enum direction_t direction,
-			  struct packet *packet, int *in_bytes)
+/* Copy the given frame into the next TX ring slot and mark it ready
+ * for the kernel to send on the next flush.
+ */
+static int tx_ring_queue(struct packet_socket *psock,
+			 const struct iovec *iov, int iovcnt)
 {
-	struct sockaddr_ll from;
-	memset(&from, 0, sizeof(from));
-	socklen_t from_len = sizeof(from);
+	struct tpacket2_hdr *frame = NULL;
+	u8 *data = NULL;
+	int len = 0, i;
 
-	/* Read the packet out of our kernel packet socket buffer. */
-	*in_bytes = recvfrom(psock->packet_fd,
-			     packet->buffer, packet->buffer_bytes, 0,
-			     (struct sockaddr *)&from, &from_len);
-	assert(*in_bytes <= packet->buffer_bytes);
-	if (*in_bytes < 0) {
-		if (errno == EINTR) {
-			DEBUGP("EINTR\n");
+	for (i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+
+	/* Frames too big for a slot go out on their own, after
+	 * anything queued ahead of them.
+	 */
+	if (len > psock->tx_frame_bytes - TX_RING_DATA_OFFSET) {
+		if (packet_socket_flush(psock))
 			return STATUS_ERR;
-		} else {
-			die_perror("packet socket recvfrom()");
+		return packet_socket_send_now(psock, iov, iovcnt);
+	}
+
+	/* If the ring is full, send what's in it to make room. A
+	 * blocking send() returns once the kernel has released every
+	 * slot it sent.
+	 */
+	frame = tx_ring_frame(psock, psock->tx_head);
+	if (frame->tp_status != TP_STATUS_AVAILABLE &&
+	    packet_socket_flush(psock))
+		return STATUS_ERR;
+	if (frame->tp_status != TP_STATUS_AVAILABLE) {
+		fprintf(stderr, "packet socket TX ring slot %d is busy "
+			"(status 0x%x)\n", psock->tx_head, frame->tp_status);
+		return STATUS_ERR;
+	}
+
+	data = (u8 *)frame + TX_RING_DATA_OFFSET;
+	for (i = 0; i < iovcnt; ++i) {
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+	frame->tp_len = len;
+
+	__sync_synchronize();	/* write frame contents before status */
+	frame->tp_status = TP_STATUS_SEND_REQUEST;
+
+	psock->tx_head = (psock->tx_head + 1) % psock->tx_frames;
+	++psock->tx_queued;
+	return STATUS_OK;
+}
+
+/* Return the socket we send frames on. */
+static inline int tx_socket(const struct packet_socket *psock)
+{
+	return (psock->tx_fd >= 0) ? psock->tx_fd : psock->packet_fd;
+}
+
+/* Read one report of when a sent frame left from the error queue of
+ * the given socket, without blocking. Return STATUS_OK and fill in the
+ * wall clock time and its source, or return STATUS_ERR if there are no
+ * more reports.
+ */
+static int read_tx_timestamp(struct packet_socket *psock, int fd,
+			     s64 *tx_usecs,
+			     enum packet_time_source_t *source);
+
+/* Throw away reports of when frames left that arrived too late for the
+ * packet_socket_tx_times() call that wanted them, so they won't be
+ * mistaken for reports about the frames we're about to send.
+ */
+static void discard_tx_timestamps(struct packet_socket *psock)
+{
+	s64 tx_usecs;
+	enum packet_time_source_t source;
+
+	while (read_tx_timestamp(psock, tx_socket(psock),
+				 &tx_usecs, &source) == STATUS_OK)
+		;
+	psock->tx_unreported = 0;
+}
+
+int packet_socket_queue(struct packet_socket *psock,
+			const struct iovec *iov, int iovcnt)
+{
+	if (psock->timestamps != PACKET_TIMESTAMPS_OFF &&
+	    psock->tx_unreported == 0 && psock->tx_queued == 0)
+		discard_tx_timestamps(psock);
+
+	if (psock->mode != PACKET_SOCKET_RINGS)
+		return packet_socket_send_now(psock, iov, iovcnt);
+
+	if (psock->tx_ring == NULL)
+		tx_ring_setup(psock);
+	return tx_ring_queue(psock, iov, iovcnt);
+}
+
+int packet_socket_flush(struct packet_socket *psock)
+{
+	if (psock->tx_queued == 0)
+		return STATUS_OK;
+
+	/* With no address and no data, send() tells the kernel to send
+	 * every slot marked TP_STATUS_SEND_REQUEST.
+	 */
+	while (send(psock->tx_fd, NULL, 0, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		perror("packet socket TX ring send");
+		return STATUS_ERR;
+	}
+
+	psock->tx_frames_sent += psock->tx_queued;
+	psock->tx_unreported += psock->tx_queued;
+	++psock->tx_batches;
+	psock->tx_queued = 0;
+	return STATUS_OK;
+}
+
+int packet_socket_writev(struct packet_socket *psock,
+			 const struct iovec *iov, int iovcnt)
+{
+	if (packet_socket_queue(psock, iov, iovcnt))
+		return STATUS_ERR;
+	return packet_socket_flush(psock);
+}
+
+/* Find and open the PTP hardware clock of the NIC we're bound to.
+ * Return STATUS_OK on success, or STATUS_ERR if it has none.
+ */
+static int phc_open(struct packet_socket *psock)
+{
+	struct ethtool_ts_info info;
+	struct ifreq ifr;
+	char path[32];
+
+	memset(&info, 0, sizeof(info));
+	info.cmd = ETHTOOL_GET_TS_INFO;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, psock->name, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_data = (void *)&info;
+	if (ioctl(psock->packet_fd, SIOCETHTOOL, &ifr) < 0 ||
+	    info.phc_index < 0)
+		return STATUS_ERR;
+
+	snprintf(path, sizeof(path), "/dev/ptp%d", info.phc_index);
+	psock->phc_fd = open(path, O_RDONLY);
+	if (psock->phc_fd < 0) {
+		perror(path);
+		return STATUS_ERR;
+	}
+	return STATUS_OK;
+}
+
+/* Measure the offset between the wall clock and the NIC's hardware
+ * clock, using the reading that the kernel bracketed most tightly
+ * with wall clock readings.
+ */
+static int phc_sample_offset(struct packet_socket *psock)
+{
+	struct ptp_sys_offset offset;
+	s64 best_window = -1;
+	int i;
+
+	memset(&offset, 0, sizeof(offset));
+	offset.n_samples = 5;
+	if (ioctl(psock->phc_fd, PTP_SYS_OFFSET, &offset) < 0) {
+		if (!psock->phc_failed)
+			perror("ioctl PTP_SYS_OFFSET");
+		psock->phc_failed = true;
+		return STATUS_ERR;
+	}
+
+	for (i = 0; i < offset.n_samples; ++i) {
+		const struct ptp_clock_time *t = &offset.ts[2 * i];
+		s64 before = t[0].sec * 1000000LL + t[0].nsec / 1000;
+		s64 phc = t[1].sec * 1000000LL + t[1].nsec / 1000;
+		s64 after = t[2].sec * 1000000LL + t[2].nsec / 1000;
+
+		if (best_window < 0 || after - before < best_window) {
+			best_window = after - before;
+			psock->phc_offset_usecs = before + (after - before) / 2
+						  - phc;
+			psock->phc_sampled_usecs = after;
 		}
 	}
+	return STATUS_OK;
+}
 
+/* Convert a raw hardware timestamp taken by the NIC to wall clock time.
+ * If we can't measure the offset again, we keep using the old one and
+ * try again no sooner than PHC_RESAMPLE_USECS later.
+ */
+static s64 phc_to_wall_usecs(struct packet_socket *psock,
+			     const struct timespec *ts)
+{
+	s64 phc_usecs = timespec_to_usecs(ts);
+	s64 wall_usecs = phc_usecs + psock->phc_offset_usecs;
+
+	if (llabs(wall_usecs - psock->phc_sampled_usecs) <=
+	    PHC_RESAMPLE_USECS)
+		return wall_usecs;
+	if (phc_sample_offset(psock) == STATUS_OK)
+		return phc_usecs + psock->phc_offset_usecs;
+	psock->phc_sampled_usecs = wall_usecs;
+	return wall_usecs;
+}
+
+/* Pick the best of the timestamps in the given SCM_TIMESTAMPING
+ * message, converting it to wall clock time. Return STATUS_ERR if
+ * it has none.
+ */
+static int best_timestamp(struct packet_socket *psock,
+			  const struct scm_timestamping *tss,
+			  s64 *usecs, enum packet_time_source_t *source)
+{
+	/* ts[0] is the software timestamp; ts[2] the raw hardware one. */
+	if (tss->ts[2].tv_sec != 0 || tss->ts[2].tv_nsec != 0) {
+		*usecs = phc_to_wall_usecs(psock, &tss->ts[2]);
+		*source = TIME_SOURCE_HARDWARE;
+		return STATUS_OK;
+	}
+	if (tss->ts[0].tv_sec != 0 || tss->ts[0].tv_nsec != 0) {
+		*usecs = timespec_to_usecs(&tss->ts[0]);
+		*source = TIME_SOURCE_SOFTWARE;
+		return STATUS_OK;
+	}
+	return STATUS_ERR;
+}
+
+/* Ask the NIC to timestamp all frames it sends and receives. */
+static int hw_timestamps_setup(struct packet_socket *psock)
+{
+	struct hwtstamp_config hwconfig;
+	struct ifreq ifr;
+
+	if (phc_open(psock) || phc_sample_offset(psock))
+		return STATUS_ERR;
+
+	memset(&hwconfig, 0, sizeof(hwconfig));
+	hwconfig.tx_type = HWTSTAMP_TX_ON;
+	hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, psock->name, sizeof(ifr.ifr_name) - 1);
+	ifr.ifr_data = (void *)&hwconfig;
+	if (ioctl(psock->packet_fd, SIOCSHWTSTAMP, &ifr) < 0) {
+		perror("ioctl SIOCSHWTSTAMP");
+		return STATUS_ERR;
+	}
+	DEBUGP("hw timestamps: tx_type %d rx_filter %d\n",
+	       hwconfig.tx_type, hwconfig.rx_filter);
+	return STATUS_OK;
+}
+
+enum packet_timestamps_t packet_socket_enable_timestamps(
+	struct packet_socket *psock, enum packet_timestamps_t timestamps)
+{
+	/* Sniffed frames always get a software timestamp, even if the
+	 * NIC stamps them too. Sent frames only get one kind, so that
+	 * the reports of when they left line up with the frames.
+	 */
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE |
+		    SOF_TIMESTAMPING_SOFTWARE |
+		    SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (timestamps == PACKET_TIMESTAMPS_OFF)
+		return PACKET_TIMESTAMPS_OFF;
+
+	if (timestamps == PACKET_TIMESTAMPS_HARDWARE &&
+	    hw_timestamps_setup(psock) != STATUS_OK) {
+		fprintf(stderr, "%s: no hardware timestamps; "
+			"using software timestamps\n", psock->name);
+		timestamps = PACKET_TIMESTAMPS_SOFTWARE;
+	}
+
+	if (timestamps == PACKET_TIMESTAMPS_HARDWARE)
+		flags |= SOF_TIMESTAMPING_RX_HARDWARE |
+			 SOF_TIMESTAMPING_TX_HARDWARE |
+			 SOF_TIMESTAMPING_RAW_HARDWARE;
+	else
+		flags |= SOF_TIMESTAMPING_TX_SOFTWARE;
+
+	if (setsockopt(psock->packet_fd, SOL_SOCKET, SO_TIMESTAMPING,
+		       &flags, sizeof(flags)) < 0)
+		die_perror("setsockopt SOL_SOCKET SO_TIMESTAMPING");
+	if (psock->tx_fd >= 0 &&
+	    setsockopt(psock->tx_fd, SOL_SOCKET, SO_TIMESTAMPING,
+		       &flags, sizeof(flags)) < 0)
+		die_perror("setsockopt SOL_SOCKET SO_TIMESTAMPING");
+
+	/* The receive ring has one timestamp per frame; ask for the
+	 * NIC's when there is one.
+	 */
+	if (psock->mode != PACKET_SOCKET_RECVFROM &&
+	    timestamps == PACKET_TIMESTAMPS_HARDWARE) {
+		int ring_flags = SOF_TIMESTAMPING_RAW_HARDWARE;
+		if (setsockopt(psock->packet_fd, SOL_PACKET, PACKET_TIMESTAMP,
+			       &ring_flags, sizeof(ring_flags)) < 0)
+			die_perror("setsockopt SOL_PACKET PACKET_TIMESTAMP");
+	}
+
+	psock->timestamps = timestamps;
+	psock->timestamping_flags = flags;
+	psock->tx_unreported = 0;
+	psock->tx_missed_reports = 0;
+	return timestamps;
+}
+
+static int read_tx_timestamp(struct packet_socket *psock, int fd,
+			     s64 *tx_usecs,
+			     enum packet_time_source_t *source)
+{
+	char control[256];
+	struct msghdr msg;
+	struct cmsghdr *cmsg = NULL;
+	const struct scm_timestamping *tss = NULL;
+	bool is_timestamp = false;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			return STATUS_ERR;
+		}
+
+		tss = NULL;
+		is_timestamp = false;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_TIMESTAMPING) {
+				tss = (const struct scm_timestamping *)
+					CMSG_DATA(cmsg);
+			} else if (cmsg->cmsg_level == SOL_PACKET &&
+				   cmsg->cmsg_type == PACKET_TX_TIMESTAMP) {
+				const struct sock_extended_err *err =
+					(const struct sock_extended_err *)
+					CMSG_DATA(cmsg);
+				is_timestamp = (err->ee_errno == ENOMSG &&
+						err->ee_origin ==
+						SO_EE_ORIGIN_TIMESTAMPING);
+			}
+		}
+
+		/* Skip anything on the error queue that isn't a report
+		 * of when a frame left.
+		 */
+		if (is_timestamp && tss != NULL &&
+		    best_timestamp(psock, tss, tx_usecs, source) == STATUS_OK)
+			return STATUS_OK;
+	}
+}
+
+enum packet_time_source_t packet_socket_tx_times(
+	struct packet_socket *psock, s64 *tx_usecs, int num_frames)
+{
+	enum packet_time_source_t source = TIME_SOURCE_USER;
+	enum packet_time_source_t worst = TIME_SOURCE_HARDWARE;
+	int fd = tx_socket(psock);
+	int reported = 0;
+	s64 *times = NULL;
+
+	if (psock->timestamps == PACKET_TIMESTAMPS_OFF ||
+	    psock->tx_missed_reports >= TX_TIMESTAMP_MAX_MISSES)
+		return TIME_SOURCE_USER;
+
+	/* Reports might only cover some of the frames we sent since
+	 * the last call; only trust them if they cover every frame.
+	 */
+	if (num_frames != psock->tx_unreported) {
+		psock->tx_unreported = 0;
+		return TIME_SOURCE_USER;
+	}
+
+	times = calloc(num_frames, sizeof(s64));
+	while (reported < num_frames) {
+		struct pollfd pfd;
+
+		if (read_tx_timestamp(psock, fd, &times[reported],
+				      &source) == STATUS_OK) {
+			worst = min(worst, source);
+			++reported;
+			continue;
+		}
+
+		/* The error queue shows up as POLLERR. */
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = fd;
+		if (poll(&pfd, 1, TX_TIMESTAMP_TIMEOUT_MSECS) <= 0)
+			break;
+	}
+	psock->tx_unreported = 0;
+
+	if (reported == 0 &&
+	    ++psock->tx_missed_reports == TX_TIMESTAMP_MAX_MISSES)
+		fprintf(stderr, "%s: no reports of when sent frames left; "
+			"no longer waiting for them\n", psock->name);
+	else if (reported > 0)
+		psock->tx_missed_reports = 0;
+
+	if (reported < num_frames) {
+		DEBUGP("got %d of %d TX timestamps\n", reported, num_frames);
+		free(times);
+		return TIME_SOURCE_USER;
+	}
+
+	memcpy(tx_usecs, times, num_frames * sizeof(s64));
+	free(times);
+	return worst;
+}
+
+void packet_socket_get_stats(struct packet_socket *psock,
+			     struct packet_socket_stats *stats)
+{
+	struct tpacket_stats_v3 kernel_stats;
+	socklen_t len = sizeof(kernel_stats);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->tx_frames = psock->tx_frames_sent;
+	stats->tx_batches = psock->tx_batches;
+
+	/* TPACKET_V1 and V2 sockets fill in the prefix of this that
+	 * they share with struct tpacket_stats.
+	 */
+	memset(&kernel_stats, 0, sizeof(kernel_stats));
+	if (getsockopt(psock->packet_fd, SOL_PACKET, PACKET_STATISTICS,
+		       &kernel_stats, &len) == 0) {
+		stats->rx_frames = kernel_stats.tp_packets;
+		stats->rx_drops = kernel_stats.tp_drops;
+	}
+}
+
+/* Check whether a packet sniffed with the given link-level info is one
+ * the caller asked for.
+ */
+static int check_sniffed_packet(struct packet_socket *psock,
+				enum direction_t direction,
+				const struct sockaddr_ll *from)
+{
 	/* We only want packets our kernel is sending out. */
 	if (direction == DIRECTION_OUTBOUND &&
-	    from.sll_pkttype != PACKET_OUTGOING) {
+	    from->sll_pkttype != PACKET_OUTGOING) {
 		DEBUGP("not outbound\n");
 		return STATUS_ERR;
 	}
 	if (direction == DIRECTION_INBOUND &&
-	    from.sll_pkttype != PACKET_HOST) {
+	    from->sll_pkttype != PACKET_HOST) {
 		DEBUGP("not inbound\n");
 		return STATUS_ERR;
 	}
@@ -253,19 +1021,247 @@ int packet_socket_receive(struct packet_socket *psock,
 	 * buffer before we bind the packet socket to the tun
 	 * device.
 	 */
-	if (from.sll_ifindex != psock->index) {
+	if (from->sll_ifindex != psock->index) {
 		DEBUGP("not correct index\n");
 		return STATUS_ERR;
 	}
 
-	/* Get the time at which the kernel sniffed the packet. */
+	return STATUS_OK;
+}
+
+/* Return the header of the ring block we're currently consuming. */
+static inline struct tpacket_block_desc *rx_ring_block(
+	struct packet_socket *psock)
+{
+	return (struct tpacket_block_desc *)
+		(psock->ring + psock->block_index * psock->ring_block_bytes);
+}
+
+/* Hand the current block back to the kernel and move to the next one. */
+static void rx_ring_release_block(struct packet_socket *psock)
+{
+	struct tpacket_block_desc *block = rx_ring_block(psock);
+
+	__sync_synchronize();	/* finish reading frames before release */
+	block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	psock->block_index = (psock->block_index + 1) % psock->ring_blocks;
+	psock->next_frame = NULL;
+	psock->frames_left = 0;
+}
+
+/* Wait until the kernel has retired the current block to user space. On
+ * success, point next_frame at its first frame and return STATUS_OK.
+ * Return STATUS_ERR if we were interrupted by a signal.
+ */
+static int rx_ring_wait_for_block(struct packet_socket *psock)
+{
+	struct tpacket_block_desc *block = rx_ring_block(psock);
+
+	while (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+		struct pollfd pfd;
+
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = psock->packet_fd;
+		pfd.events = POLLIN | POLLERR;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR) {
+				DEBUGP("EINTR\n");
+				return STATUS_ERR;
+			}
+			die_perror("packet socket poll()");
+		}
+	}
+	__sync_synchronize();	/* see block_status before frame contents */
+
+	psock->frames_left = block->hdr.bh1.num_pkts;
+	psock->next_frame = (struct tpacket3_hdr *)
+		((u8 *)block + block->hdr.bh1.offset_to_first_pkt);
+	return STATUS_OK;
+}
+
+/* Copy the next frame out of the RX ring into the given packet. */
+static int rx_ring_receive(struct packet_socket *psock,
+			   enum direction_t direction,
+			   struct packet *packet, int *in_bytes)
+{
+	struct tpacket3_hdr *frame = NULL;
+	const struct sockaddr_ll *from = NULL;
+
+	while (psock->frames_left == 0) {
+		if (psock->next_frame != NULL)
+			rx_ring_release_block(psock);
+		if (rx_ring_wait_for_block(psock))
+			return STATUS_ERR;
+		if (psock->frames_left == 0)	/* empty retired block */
+			rx_ring_release_block(psock);
+	}
+
+	frame = psock->next_frame;
+	from = (const struct sockaddr_ll *)
+		((u8 *)frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+	*in_bytes = min(frame->tp_snaplen, packet->buffer_bytes);
+	memcpy(packet->buffer, (u8 *)frame + frame->tp_mac, *in_bytes);
+
+	/* Get the time at which the kernel, or the NIC if we asked for
+	 * raw hardware timestamps and it took one, sniffed the packet.
+	 */
+	if (frame->tp_status & TP_STATUS_TS_RAW_HARDWARE) {
+		struct timespec ts;
+		ts.tv_sec = frame->tp_sec;
+		ts.tv_nsec = frame->tp_nsec;
+		packet->time_usecs = phc_to_wall_usecs(psock, &ts);
+		packet->time_source = TIME_SOURCE_HARDWARE;
+	} else {
+		packet->time_usecs = ((s64)frame->tp_sec) * 1000000LL +
+				     frame->tp_nsec / 1000;
+		packet->time_source = TIME_SOURCE_SOFTWARE;
+	}
+
+	--psock->frames_left;
+	psock->next_frame = (struct tpacket3_hdr *)
+		((u8 *)frame + frame->tp_next_offset);
+
+	if (check_sniffed_packet(psock, direction, from))
+		return STATUS_ERR;
+
+	DEBUGP("sniffed packet from ring sent at %u.%09u = %lld\n",
+	       frame->tp_sec, frame->tp_nsec, packet->time_usecs);
+
+	return STATUS_OK;
+}
+
+/* Hand every block the kernel has already retired back to it. */
+static int rx_ring_drain(struct packet_socket *psock)
+{
+	int packets = psock->frames_left;
+
+	if (psock->next_frame != NULL)
+		rx_ring_release_block(psock);
+	while (rx_ring_block(psock)->hdr.bh1.block_status & TP_STATUS_USER) {
+		__sync_synchronize();
+		packets += rx_ring_block(psock)->hdr.bh1.num_pkts;
+		rx_ring_release_block(psock);
+	}
+	return packets;
+}
+
+int packet_socket_drain(struct packet_socket *psock)
+{
+	char buf[1];
+	int packets = 0;
+
+	if (psock->mode != PACKET_SOCKET_RECVFROM)
+		return rx_ring_drain(psock);
+
+	for (;;) {
+		if (recv(psock->packet_fd, buf, sizeof(buf),
+			 MSG_DONTWAIT | MSG_TRUNC) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			die_perror("packet socket recv()");
+		}
+		++packets;
+	}
+	return packets;
+}
+
+/* Get the time at which the kernel sniffed the last frame we read. */
+static void get_sniff_time(struct packet_socket *psock, struct packet *packet)
+{
 	struct timeval tv;
+
 	if (ioctl(psock->packet_fd, SIOCGSTAMP, &tv) < 0)
 		die_perror("SIOCGSTAMP");
 	packet->time_usecs = timeval_to_usecs(&tv);
-	DEBUGP("sniffed packet sent at %u.%u = %lld\n",
-	       (u32)tv.tv_sec, (u32)tv.tv_usec,
-	       packet->time_usecs);
+	packet->time_source = TIME_SOURCE_SOFTWARE;
+}
+
+/* Read the next sniffed frame along with the SCM_TIMESTAMPING message
+ * that SO_TIMESTAMPING attaches to it, and fill in the best of its
+ * timestamps. Returns what recvmsg() returns.
+ */
+static int receive_timestamped(struct packet_socket *psock,
+			       struct packet *packet,
+			       struct sockaddr_ll *from)
+{
+	char control[256];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg = NULL;
+	int bytes = 0;
+
+	iov.iov_base = packet->buffer;
+	iov.iov_len = packet->buffer_bytes;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = sizeof(*from);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	bytes = recvmsg(psock->packet_fd, &msg, 0);
+	if (bytes < 0)
+		return bytes;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPING)
+			best_timestamp(psock,
+				       (const struct scm_timestamping *)
+				       CMSG_DATA(cmsg),
+				       &packet->time_usecs,
+				       &packet->time_source);
+	}
+	return bytes;
+}
+
+int packet_socket_receive(struct packet_socket *psock,
+			  enum direction_t direction,
+			  struct packet *packet, int *in_bytes)
+{
+	struct sockaddr_ll from;
+
+	if (psock->mode != PACKET_SOCKET_RECVFROM)
+		return rx_ring_receive(psock, direction, packet, in_bytes);
+
+	memset(&from, 0, sizeof(from));
+	socklen_t from_len = sizeof(from);
+
+	/* Read the packet out of our kernel packet socket buffer, with
+	 * its timestamps if we asked for them.
+	 */
+	packet->time_usecs = 0;
+	if (psock->timestamps != PACKET_TIMESTAMPS_OFF)
+		*in_bytes = receive_timestamped(psock, packet, &from);
+	else
+		*in_bytes = recvfrom(psock->packet_fd,
+				     packet->buffer, packet->buffer_bytes, 0,
+				     (struct sockaddr *)&from, &from_len);
+	assert(*in_bytes <= packet->buffer_bytes);
+	if (*in_bytes < 0) {
+		if (errno == EINTR) {
+			DEBUGP("EINTR\n");
+			return STATUS_ERR;
+		} else {
+			die_perror("packet socket recvfrom()");
+		}
+	}
+
+	if (check_sniffed_packet(psock, direction, &from))
+		return STATUS_ERR;
+
+	/* Get the time at which the kernel sniffed the packet, if it
+	 * didn't come with the frame.
+	 */
+	if (packet->time_usecs == 0)
+		get_sniff_time(psock, packet);
+	DEBUGP("sniffed packet sent at %lld (source %d)\n",
+	       packet->time_usecs, packet->time_source);
 
 	return STATUS_OK;
 }
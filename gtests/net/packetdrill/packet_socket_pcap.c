@@ -50,6 +50,8 @@ struct packet_socket {
 	pcap_t *pcap;	/* handle for sending, sniffing timestamped packets */
 	char pcap_error[PCAP_ERRBUF_SIZE];	/* for libpcap errors */
 	int pcap_offset;  /* offset of packet data in pcap buffer */
+
+	int tx_frames;	/* frames we have sent */
 };
 
 #if defined(__OpenBSD__)
@@ -160,10 +162,46 @@ void packet_socket_set_filter(struct packet_socket *psock,
 	free(filter_str);
 }
 
-struct packet_socket *packet_socket_new(const char *device_name)
+/* Add a filter so we only sniff outbound packets we want. */
+void packet_socket_set_outbound_filter(struct packet_socket *psock,
+				       const struct ip_address *local_ip,
+				       const struct ip_prefix *remote_prefix)
+{
+	struct bpf_program bpf_code;
+	char *filter_str = NULL;
+	char local_ip_string[ADDR_STR_LEN];
+	char remote_ip_string[ADDR_STR_LEN];
+	const char *ip = local_ip->address_family == AF_INET6 ? "ip6" : "ip";
+
+	ip_to_string(local_ip, local_ip_string);
+	ip_to_string(&remote_prefix->ip, remote_ip_string);
+
+	asprintf(&filter_str,
+		 "%s src %s and %s dst net %s/%d and (tcp or udp)",
+		 ip, local_ip_string,
+		 ip, remote_ip_string, remote_prefix->prefix_len);
+
+	DEBUGP("setting BPF filter: %s\n", filter_str);
+
+	if (pcap_compile(psock->pcap, &bpf_code, filter_str, 1, 0) != 0)
+		die_pcap_perror(psock->pcap, "pcap_compile");
+
+	if (pcap_setfilter(psock->pcap, &bpf_code) != 0)
+		die_pcap_perror(psock->pcap, "pcap_setfilter");
+
+	pcap_freecode(&bpf_code);
+	free(filter_str);
+}
+
+struct packet_socket *packet_socket_new(const char *device_name,
+				       enum packet_socket_mode_t mode)
 {
 	struct packet_socket *psock = calloc(1, sizeof(struct packet_socket));
 
+	/* libpcap picks its own capture mechanism for the platform. */
+	if (mode != PACKET_SOCKET_RECVFROM)
+		DEBUGP("ignoring ring mode request for pcap capture\n");
+
 	psock->name = strdup(device_name);
 
 	packet_socket_setup(psock);
@@ -211,9 +249,67 @@ int packet_socket_writev(struct packet_socket *psock,
 		die_pcap_perror(psock->pcap, "pcap_inject");
 
 	free(buf);
+	++psock->tx_frames;
+	return STATUS_OK;
+}
+
+/* The pcap API has no way to batch sends, so we send right away. */
+int packet_socket_queue(struct packet_socket *psock,
+			const struct iovec *iov, int iovcnt)
+{
+	return packet_socket_writev(psock, iov, iovcnt);
+}
+
+int packet_socket_flush(struct packet_socket *psock)
+{
 	return STATUS_OK;
 }
 
+/* We only get the timestamps libpcap takes itself. */
+enum packet_timestamps_t packet_socket_enable_timestamps(
+	struct packet_socket *psock, enum packet_timestamps_t timestamps)
+{
+	if (timestamps != PACKET_TIMESTAMPS_OFF)
+		fprintf(stderr, "%s: timestamps not supported with pcap; "
+			"using pcap timestamps\n", psock->name);
+	return PACKET_TIMESTAMPS_OFF;
+}
+
+enum packet_time_source_t packet_socket_tx_times(
+	struct packet_socket *psock, s64 *tx_usecs, int num_frames)
+{
+	return TIME_SOURCE_USER;
+}
+
+void packet_socket_get_stats(struct packet_socket *psock,
+			     struct packet_socket_stats *stats)
+{
+	struct pcap_stat pcap_stats;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->tx_frames = psock->tx_frames;
+	stats->tx_batches = psock->tx_frames;
+
+	if (pcap_stats(psock->pcap, &pcap_stats) == 0) {
+		stats->rx_frames = pcap_stats.ps_recv;
+		stats->rx_drops = pcap_stats.ps_drop;
+	}
+}
+
+int packet_socket_drain(struct packet_socket *psock)
+{
+	struct pcap_pkthdr *pkt_header = NULL;
+	const u8 *pkt_data = NULL;
+	int packets = 0;
+
+	/* As in packet_socket_receive(), pcap_next_ex() returns 0 when
+	 * there is no packet waiting.
+	 */
+	while (pcap_next_ex(psock->pcap, &pkt_header, &pkt_data) == 1)
+		++packets;
+	return packets;
+}
+
 int packet_socket_receive(struct packet_socket *psock,
 			  enum direction_t direction,
 			  struct packet *packet, int *in_bytes)
@@ -260,6 +356,8 @@ int packet_socket_receive(struct packet_socket *psock,
 	packet->time_usecs = implement_me("implement me for your platform");
 #endif  /* defined(__OpenBSD__) */
 
+	packet->time_source = TIME_SOURCE_SOFTWARE;
+
 	DEBUGP("time_usecs= %llu\n", packet->time_usecs);
 
 	DEBUGP("pcap_next_ex: caplen:%u len:%u offset:%d\n",
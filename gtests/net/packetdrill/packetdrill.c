@@ -31,10 +31,17 @@
 #else
 #include "getopt.h"
 #endif
+#ifdef linux
+#include <sched.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "config.h"
+#include "logging.h"
+#include "net_utils.h"
 #include "parse.h"
 #include "run.h"
 #include "script.h"
@@ -67,6 +74,146 @@ static void run_init_scripts(struct config *config)
 	free(scripts);
 }
 
+/* Exit status of a --jobs worker whose script passed with warnings. */
+#define WORKER_EXIT_WARN	2
+
+/* A --jobs worker process running one script. */
+struct worker {
+	pid_t pid;			/* worker process, or 0 if slot is free */
+	const char *script_path;	/* script the worker is running */
+};
+
+/* Tally of script outcomes for --jobs mode. */
+struct job_results {
+	int passed;
+	int warned;
+	int failed;
+};
+
+/* Body of a --jobs worker process. Run the given script in a private
+ * network namespace, so that it gets its own tun device, addresses and
+ * routes, and sees none of the packets from scripts in other workers.
+ */
+static void run_script_worker(int argc, char *argv[],
+                              struct config *config,
+                              const char *script_path)
+{
+	struct script script;
+	int result = STATUS_OK;
+
+#ifdef linux
+	if (unshare(CLONE_NEWNET) < 0)
+		die_perror("unshare(CLONE_NEWNET)");
+	net_bring_up_dev("lo");
+#endif
+
+	if (parse_script_and_set_config(argc, argv, config, &script,
+	                                script_path, NULL))
+		exit(EXIT_FAILURE);
+
+	run_init_scripts(config);
+	result = run_script(config, &script);
+	exit(result == STATUS_WARN ? WORKER_EXIT_WARN : EXIT_SUCCESS);
+}
+
+/* Wait for any worker to finish and record the outcome of its script. */
+static void reap_worker(struct worker *workers, int num_workers,
+                        struct job_results *results)
+{
+	int i = num_workers, status = 0;
+
+	while (i == num_workers)
+	{
+		pid_t pid = wait(&status);
+		if (pid < 0)
+			die_perror("wait");
+
+		for (i = 0; i < num_workers; ++i)
+		{
+			if (workers[i].pid == pid)
+				break;
+		}
+	}
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+	{
+		++results->passed;
+	}
+	else if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_EXIT_WARN)
+	{
+		++results->warned;
+	}
+	else
+	{
+		++results->failed;
+		fprintf(stderr, "%s: FAILED\n", workers[i].script_path);
+	}
+	workers[i].pid = 0;
+}
+
+/* Run each script in its own worker process, with at most config->jobs
+ * workers at a time. Return the exit status for packetdrill.
+ */
+static int run_scripts_in_parallel(int argc, char *argv[],
+                                   struct config *config, char **arg)
+{
+	struct job_results results;
+	struct worker *workers = NULL;
+	int i, running = 0;
+
+#ifndef linux
+	die("--jobs requires network namespaces, which need Linux\n");
+#endif
+	if (config->is_wire_client)
+		die("--jobs is not supported with --wire_client\n");
+
+	memset(&results, 0, sizeof(results));
+	workers = calloc(config->jobs, sizeof(struct worker));
+
+	for (; *arg != NULL; ++arg)
+	{
+		pid_t pid = 0;
+
+		if (running == config->jobs)
+		{
+			reap_worker(workers, config->jobs, &results);
+			--running;
+		}
+		for (i = 0; i < config->jobs; ++i)
+		{
+			if (workers[i].pid == 0)
+				break;
+		}
+		assert(i < config->jobs);
+
+		/* Don't let the worker re-flush our buffered output. */
+		fflush(stdout);
+		fflush(stderr);
+
+		pid = fork();
+		if (pid < 0)
+			die_perror("fork");
+		if (pid == 0)
+			run_script_worker(argc, argv, config, *arg);
+
+		workers[i].pid = pid;
+		workers[i].script_path = *arg;
+		++running;
+	}
+
+	while (running > 0)
+	{
+		reap_worker(workers, config->jobs, &results);
+		--running;
+	}
+	free(workers);
+
+	printf("%d passed, %d passed with warnings, %d failed\n",
+	       results.passed, results.warned, results.failed);
+
+	return results.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
 	struct config config;
@@ -101,6 +248,10 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* Run scripts concurrently in separate processes if asked. */
+	if (config.jobs > 1 && !config.dry_run)
+		return run_scripts_in_parallel(argc, argv, &config, arg);
+
 	/* Parse and run each script on the command line. */
 	for (; *arg != NULL; ++arg)
 	{
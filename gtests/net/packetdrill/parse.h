@@ -50,7 +50,9 @@ extern void read_script(const char *script_path,
  *
  * Returns STATUS_OK on success; on failure returns STATUS_ERR. The
  * implementation for this function is in the bison parser file
- * parser.y.
+ * parser.y. The parser is reentrant, so different threads may parse
+ * different scripts at the same time; the option parsing it calls back
+ * into serializes itself.
  */
 extern int parse_script(const struct config *config,
 			struct script *script,
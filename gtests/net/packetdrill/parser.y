@@ -83,7 +83,6 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -119,40 +118,49 @@
 extern int yydebug;
 #endif
 
-extern FILE *yyin;
-extern int yylineno;
-extern char *yytext;
-extern int yylex(void);
-extern int yyparse(void);
-extern int yywrap(void);
-
-/* This mutex guards all parser global variables declared in this file. */
-pthread_mutex_t parser_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-/* The input to the parser: the path name of the script file to parse. */
-static const char* current_script_path = NULL;
-
-/* The starting line number of the input script statement that we're
- * currently parsing. This may be different than yylineno if bison had
- * to look ahead and lexically scan a token on the following line to
- * decide that the current statement is done.
+/* The interface to the reentrant flex-generated scanner. Each parse
+ * gets its own scanner, so nothing here is shared between threads.
  */
-static int current_script_line = -1;
-
-/*
- * We uses this object to look up configuration info needed during
- * parsing (such as whether packets are IPv4 or IPv6).
+typedef void *yyscan_t;
+extern int yylex_init(yyscan_t *scanner);
+extern int yylex_destroy(yyscan_t scanner);
+extern void yyset_in(FILE *in, yyscan_t scanner);
+extern char *yyget_text(yyscan_t scanner);
+extern int yyget_lineno(yyscan_t scanner);
+extern void yyset_lineno(int line, yyscan_t scanner);
+extern int yylex(YYSTYPE *lvalp, YYLTYPE *llocp, yyscan_t scanner);
+
+/* All the state for one parse of one script. The parser is reentrant,
+ * so several threads (e.g. wire server sessions) can parse at once.
  */
-static const struct config *in_config = NULL;
+struct parse_context {
+	/* The input to the parser: the path name of the script file. */
+	const char *script_path;
+
+	/* The starting line number of the input script statement
+	 * that we're currently parsing. This may be different than
+	 * the scanner line number if bison had to look ahead and
+	 * lexically scan a token on the following line to decide
+	 * that the current statement is done.
+	 */
+	int script_line;
 
-/* The output of the parser: an output script containing
- * 1) a linked list of options
- * 2) a linked list of events
- */
-static struct script *out_script = NULL;
+	/* We use this object to look up configuration info needed
+	 * during parsing (such as whether packets are IPv4 or IPv6).
+	 */
+	const struct config *config;
+
+	/* The output of the parser: an output script containing
+	 * 1) a linked list of options
+	 * 2) a linked list of events
+	 */
+	struct script *script;
 
-/* The test invocation to pass back to parse_and_finalize_config(). */
-struct invocation *invocation;
+	/* The test invocation to pass back to
+	 * parse_and_finalize_config().
+	 */
+	struct invocation *invocation;
+};
 
 /* Copy the script contents into our single linear buffer. */
 void copy_script(const char *script_buffer, struct script *script)
@@ -227,15 +235,16 @@ int parse_script(const struct config *config,
 			 struct script *script,
 			 struct invocation *callback_invocation)
 {
-	/* This bison-generated parser is not multi-thread safe, so we
-	 * have a lock to prevent more than one thread using the
-	 * parser at the same time. This is useful in the wire server
-	 * context, where in general we may have more than one test
-	 * thread running at the same time.
+	struct parse_context context;
+	yyscan_t scanner;
+	FILE *in = NULL;
+
+	/* The parser and scanner keep all their state in 'context' and
+	 * 'scanner', so unlike in the past there is no lock here and
+	 * wire server sessions can parse their scripts concurrently.
+	 * The one shared piece, getopt_long() re-parsing the command
+	 * line in parse_and_finalize_config(), takes its own lock.
 	 */
-	if (pthread_mutex_lock(&parser_mutex) != 0)
-		die_perror("pthread_mutex_lock");
-
 #if YYDEBUG
 	yydebug = 1;
 #endif
@@ -246,42 +255,42 @@ int parse_script(const struct config *config,
 		if (script->length == 0)
 		{
 			errno = EINVAL;
-			yyin = NULL;
+			in = NULL;
 		}
 		else
 		{
-			yyin = fopen(get_available_file_name(), "r");
+			in = fopen(get_available_file_name(), "r");
 		}
 	}
 #else
-	yyin = fmemopen(script->buffer, script->length, "r");
+	in = fmemopen(script->buffer, script->length, "r");
 #endif
-	if (yyin == NULL)
+	if (in == NULL)
 		die_perror("fmemopen: parse error opening script buffer");
 
 #ifdef ECOS
- 	fprintf(yyin, "%s", script->buffer);
+ 	fprintf(in, "%s", script->buffer);
 #endif
 
-	current_script_path = config->script_path;
-	in_config = config;
-	out_script = script;
-	invocation = callback_invocation;
+	memset(&context, 0, sizeof(context));
+	context.script_path = config->script_path;
+	context.script_line = -1;
+	context.config = config;
+	context.script = script;
+	context.invocation = callback_invocation;
 
-	/* We have to reset the line number here since the wire server
-	 * can do more than one yyparse().
-	 */
-	yylineno = 1;
+	if (yylex_init(&scanner) != 0)
+		die_perror("yylex_init");
+	yyset_in(in, scanner);
+	yyset_lineno(1, scanner);
 
-	int result = yyparse();		/* invoke bison-generated parser */
-	current_script_path = NULL;
+	/* invoke bison-generated parser */
+	int result = yyparse(&context, scanner);
 
-	if (fclose(yyin))
-		die_perror("fclose: error closing script buffer");
+	yylex_destroy(scanner);
 
-	/* Unlock parser. */
-	if (pthread_mutex_unlock(&parser_mutex) != 0)
-		die_perror("pthread_mutex_unlock");
+	if (fclose(in))
+		die_perror("fclose: error closing script buffer");
 
 	return result ? STATUS_ERR : STATUS_OK;
 }
@@ -289,29 +298,24 @@ int parse_script(const struct config *config,
 /* Bison emits code to call this method when there's a parse-time error.
  * We print the line number and the error message.
  */
-static void yyerror(const char *message)
+static void yyerror(YYLTYPE *llocp, struct parse_context *context,
+		    yyscan_t scanner, const char *message)
 {
 	fprintf(stderr, "%s:%d: parse error at '%s': %s\n",
-		current_script_path, yylineno, yytext, message);
+		context->script_path, yyget_lineno(scanner),
+		yyget_text(scanner), message);
 }
 
 /* After we finish parsing each line of a script, we analyze the
  * semantics of the line. If we encounter an error then we print the
  * error message to stderr and exit with an error.
  */
-static void semantic_error(const char* message)
+static void semantic_error(struct parse_context *context,
+			   const char *message)
 {
-	assert(current_script_line >= 0);
+	assert(context->script_line >= 0);
 	die("%s:%d: semantic error: %s\n",
-	    current_script_path, current_script_line, message);
-}
-
-/* This standard callback is invoked by flex when it encounters
- * the end of a file. We return 1 to tell flex to return EOF.
- */
-int yywrap(void)
-{
-	return 1;
+	    context->script_path, context->script_line, message);
 }
 
 /* Create and initalize a new expression. */
@@ -473,6 +477,15 @@ static struct tcp_option *new_tcp_fast_open_option(const char *cookie_string,
 %}
 
 %locations
+%define api.pure
+%parse-param {struct parse_context *context}
+%parse-param {void *scanner}
+%lex-param {void *scanner}
+
+/* Declarations needed by the bison-generated .h file. */
+%code requires {
+struct parse_context;
+}
 %expect 1  /* we expect a shift/reduce conflict for the | binary expression */
 /* The %union section specifies the set of possible types for values
  * for all nonterminal and terminal symbols in the grammar.
@@ -560,24 +573,24 @@ static struct tcp_option *new_tcp_fast_open_option(const char *cookie_string,
 
 script
 : opt_options opt_init_command events {
-	$$ = NULL;		/* The parser output is in out_script */
+	$$ = NULL;		/* The parser output is in context->script */
 }
 ;
 
 opt_options
 :		{
 	$$ = NULL;
-	parse_and_finalize_config(invocation);
+	parse_and_finalize_config(context->invocation);
 }
 | options	{
 	$$ = $1;
-	parse_and_finalize_config(invocation);
+	parse_and_finalize_config(context->invocation);
 }
 ;
 
 options
 : option		{
-	out_script->option_list = $1;
+	context->script->option_list = $1;
 	$$ = $1;		/* return the tail so we can append to it */
 }
 | options option	{
@@ -596,7 +609,7 @@ option_flag
 ;
 
 option_value
-: INTEGER	{ $$ = strdup(yytext); }
+: INTEGER	{ $$ = strdup(yyget_text(scanner)); }
 | WORD		{ $$ = $1; }
 | STRING	{ $$ = $1; }
 | IPV4_ADDR	{ $$ = $1; }
@@ -611,12 +624,12 @@ opt_init_command
 ;
 
 init_command
-: command_spec  { out_script->init_command = $1; }
+: command_spec  { context->script->init_command = $1; }
 ;
 
 events
 : event        {
-	out_script->event_list = $1;  /* save pointer to event list as output
+	context->script->event_list = $1;  /* save pointer to event list as output
 				       * of parser */
 	$$ = $1;          /* return the tail so that we can append to it */
 }
@@ -636,19 +649,19 @@ event
 
 	if ($$->time_usecs_end != NO_TIME_RANGE) {
 		if ($$->time_usecs_end < $$->time_usecs)
-			semantic_error("time range is backwards");
+			semantic_error(context, "time range is backwards");
 	}
 	if ($$->time_type == ANY_TIME &&  ($$->type != PACKET_EVENT ||
 	    packet_direction($$->event.packet) != DIRECTION_OUTBOUND)) {
-		yylineno = $$->line_number;
-		semantic_error("event time <star> can only be used with "
+		yyset_lineno($$->line_number, scanner);
+		semantic_error(context, "event time <star> can only be used with "
 			       "outbound packets");
 	} else if (($$->time_type == ABSOLUTE_RANGE_TIME ||
 		    $$->time_type == RELATIVE_RANGE_TIME) &&
 	           ($$->type != PACKET_EVENT ||
 		    packet_direction($$->event.packet) != DIRECTION_OUTBOUND)) {
-		yylineno = $$->line_number;
-		semantic_error("event time range can only be used with "
+		yyset_lineno($$->line_number, scanner);
+		semantic_error(context, "event time range can only be used with "
 			       "outbound packets");
 	}
 	free($1);
@@ -692,13 +705,13 @@ event_time
 time
 : FLOAT        {
 	if ($1 < 0) {
-		semantic_error("negative time");
+		semantic_error(context, "negative time");
 	}
 	$$ = (s64)($1 * 1.0e6); /* convert float secs to s64 microseconds */
 }
 | INTEGER	{
 	if ($1 < 0) {
-		semantic_error("negative time");
+		semantic_error(context, "negative time");
 	}
 	$$ = (s64)($1 * 1000000); /* convert int secs to s64 microseconds */
 }
@@ -724,12 +737,12 @@ tcp_packet_spec
 	enum direction_t direction = outer->direction;
 
 	if (($7 == NULL) && (direction != DIRECTION_OUTBOUND)) {
-		yylineno = @7.first_line;
-		semantic_error("<...> for TCP options can only be used with "
+		yyset_lineno(@7.first_line, scanner);
+		semantic_error(context, "<...> for TCP options can only be used with "
 			       "outbound packets");
 	}
 
-	inner = new_tcp_packet(in_config->wire_protocol,
+	inner = new_tcp_packet(context->config->wire_protocol,
 			       direction, $2, $3,
 			       $4.start_sequence, $4.payload_bytes,
 			       $5, $6, $7, &error);
@@ -737,7 +750,7 @@ tcp_packet_spec
 	free($7);
 	if (inner == NULL) {
 		assert(error != NULL);
-		semantic_error(error);
+		semantic_error(context, error);
 		free(error);
 	}
 
@@ -752,13 +765,13 @@ udp_packet_spec
 	enum direction_t direction = outer->direction;
 
 	if (!is_valid_u16($4)) {
-		semantic_error("UDP payload size out of range");
+		semantic_error(context, "UDP payload size out of range");
 	}
 
-	inner = new_udp_packet(in_config->wire_protocol, direction, $4, &error);
+	inner = new_udp_packet(context->config->wire_protocol, direction, $4, &error);
 	if (inner == NULL) {
 		assert(error != NULL);
-		semantic_error(error);
+		semantic_error(context, error);
 		free(error);
 	}
 
@@ -772,13 +785,13 @@ icmp_packet_spec
 	struct packet *outer = $1, *inner = NULL;
 	enum direction_t direction = outer->direction;
 
-	inner = new_icmp_packet(in_config->wire_protocol, direction, $4, $5,
+	inner = new_icmp_packet(context->config->wire_protocol, direction, $4, $5,
 				$2.protocol, $2.start_sequence,
 				$2.payload_bytes, $6, &error);
 	free($4);
 	free($5);
 	if (inner == NULL) {
-		semantic_error(error);
+		semantic_error(context, error);
 		free(error);
 	}
 
@@ -798,7 +811,7 @@ packet_prefix
 	char *ip_src = $3;
 	char *ip_dst = $5;
 	if (ipv4_header_append(packet, ip_src, ip_dst, &error))
-		semantic_error(error);
+		semantic_error(context, error);
 	free(ip_src);
 	free(ip_dst);
 	$$ = packet;
@@ -809,7 +822,7 @@ packet_prefix
 	char *ip_src = $3;
 	char *ip_dst = $5;
 	if (ipv6_header_append(packet, ip_src, ip_dst, &error))
-		semantic_error(error);
+		semantic_error(context, error);
 	free(ip_src);
 	free(ip_dst);
 	$$ = packet;
@@ -818,7 +831,7 @@ packet_prefix
 	char *error = NULL;
 	struct packet *packet = $1;
 	if (gre_header_append(packet, &error))
-		semantic_error(error);
+		semantic_error(context, error);
 	$$ = packet;
 }
 | packet_prefix MPLS mpls_stack ':' {
@@ -827,7 +840,7 @@ packet_prefix
 	struct mpls_stack *mpls_stack = $3;
 
 	if (mpls_header_append(packet, mpls_stack, &error))
-		semantic_error(error);
+		semantic_error(context, error);
 	free(mpls_stack);
 	$$ = packet;
 }
@@ -839,7 +852,7 @@ mpls_stack
 }
 | mpls_stack mpls_stack_entry	{
 	if (mpls_stack_append($1, $2))
-		semantic_error("too many MPLS labels");
+		semantic_error(context, "too many MPLS labels");
 	$$ = $1;
 }
 ;
@@ -856,7 +869,7 @@ mpls_stack_entry
 
 	if (new_mpls_stack_entry(label, traffic_class, is_stack_bottom, ttl,
 				 &mpls, &error))
-		semantic_error(error);
+		semantic_error(context, error);
 	$$ = mpls;
 }
 ;
@@ -865,7 +878,7 @@ opt_mpls_stack_bottom
 :			{ $$ = 0; }
 | '[' WORD ']' ','	{
 	if (strcmp($2, "S") != 0)
-		semantic_error("expected [S] for MPLS label stack bottom");
+		semantic_error(context, "expected [S] for MPLS label stack bottom");
 	free($2);
 	$$ = 1;
 }
@@ -903,8 +916,14 @@ opt_icmp_mtu
 ;
 
 direction
-: '<'          { $$ = DIRECTION_INBOUND;  current_script_line = yylineno; }
-| '>'          { $$ = DIRECTION_OUTBOUND; current_script_line = yylineno; }
+: '<'          {
+	$$ = DIRECTION_INBOUND;
+	context->script_line = yyget_lineno(scanner);
+}
+| '>'          {
+	$$ = DIRECTION_OUTBOUND;
+	context->script_line = yyget_lineno(scanner);
+}
 ;
 
 opt_ip_info
@@ -938,16 +957,16 @@ free($1); }
 seq
 : INTEGER ':' INTEGER '(' INTEGER ')' {
 	if (!is_valid_u32($1)) {
-		semantic_error("TCP start sequence number out of range");
+		semantic_error(context, "TCP start sequence number out of range");
 	}
 	if (!is_valid_u32($3)) {
-		semantic_error("TCP end sequence number out of range");
+		semantic_error(context, "TCP end sequence number out of range");
 	}
 	if (!is_valid_u16($5)) {
-		semantic_error("TCP payload size out of range");
+		semantic_error(context, "TCP payload size out of range");
 	}
 	if ($3 != ($1 +$5)) {
-		semantic_error("inconsistent TCP sequence numbers and "
+		semantic_error(context, "inconsistent TCP sequence numbers and "
 			       "payload size");
 	}
 	$$.start_sequence = $1;
@@ -960,7 +979,7 @@ opt_ack
 :              { $$ = 0; }
 | ACK INTEGER  {
 	if (!is_valid_u32($2)) {
-		semantic_error("TCP ack sequence number out of range");
+		semantic_error(context, "TCP ack sequence number out of range");
 	}
 	$$ = $2;
 }
@@ -970,7 +989,7 @@ opt_window
 :		{ $$ = -1; }
 | WIN INTEGER	{
 	if (!is_valid_u16($2)) {
-		semantic_error("TCP window value out of range");
+		semantic_error(context, "TCP window value out of range");
 	}
 	$$ = $2;
 }
@@ -986,13 +1005,13 @@ tcp_option_list
 : tcp_option                       {
 	$$ = tcp_options_new();
 	if (tcp_options_append($$, $1)) {
-		semantic_error("TCP option list too long");
+		semantic_error(context, "TCP option list too long");
 	}
 }
 | tcp_option_list ',' tcp_option   {
 	$$ = $1;
 	if (tcp_options_append($$, $3)) {
-		semantic_error("TCP option list too long");
+		semantic_error(context, "TCP option list too long");
 	}
 }
 ;
@@ -1003,8 +1022,8 @@ opt_tcp_fast_open_cookie
 ;
 
 tcp_fast_open_cookie
-: WORD    { $$ = strdup(yytext); }
-| INTEGER { $$ = strdup(yytext); }
+: WORD    { $$ = strdup(yyget_text(scanner)); }
+| INTEGER { $$ = strdup(yyget_text(scanner)); }
 ;
 
 tcp_option
@@ -1013,14 +1032,14 @@ tcp_option
 | MSS INTEGER      {
 	$$ = tcp_option_new(TCPOPT_MAXSEG, TCPOLEN_MAXSEG);
 	if (!is_valid_u16($2)) {
-		semantic_error("mss value out of range");
+		semantic_error(context, "mss value out of range");
 	}
 	$$->data.mss.bytes = htons($2);
 }
 | WSCALE INTEGER   {
 	$$ = tcp_option_new(TCPOPT_WINDOW, TCPOLEN_WINDOW);
 	if (!is_valid_u8($2)) {
-		semantic_error("window scale shift count out of range");
+		semantic_error(context, "window scale shift count out of range");
 	}
 	$$->data.window_scale.shift_count = $2;
 }
@@ -1035,10 +1054,10 @@ tcp_option
 	u32 val, ecr;
 	$$ = tcp_option_new(TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP);
 	if (!is_valid_u32($3)) {
-		semantic_error("ts val out of range");
+		semantic_error(context, "ts val out of range");
 	}
 	if (!is_valid_u32($5)) {
-		semantic_error("ecr val out of range");
+		semantic_error(context, "ecr val out of range");
 	}
 	val = $3;
 	ecr = $5;
@@ -1051,7 +1070,7 @@ tcp_option
 	free($2);
 	if ($$ == NULL) {
 		assert(error != NULL);
-		semantic_error(error);
+		semantic_error(context, error);
 		free(error);
 	}
 }
@@ -1077,10 +1096,10 @@ sack_block
 : INTEGER ':' INTEGER {
 	$$ = tcp_option_new(TCPOPT_SACK, 2 + sizeof(struct sack_block));
 	if (!is_valid_u32($1)) {
-		semantic_error("TCP SACK left sequence number out of range");
+		semantic_error(context, "TCP SACK left sequence number out of range");
 	}
 	if (!is_valid_u32($3)) {
-		semantic_error("TCP SACK right sequence number out of range");
+		semantic_error(context, "TCP SACK right sequence number out of range");
 	}
 	$$->data.sack.block[0].left = htonl($1);
 	$$->data.sack.block[0].right = htonl($3);
@@ -1106,7 +1125,10 @@ opt_end_time
 ;
 
 function_name
-: WORD                    { $$ = $1; current_script_line = yylineno; }
+: WORD                    {
+	$$ = $1;
+	context->script_line = yyget_lineno(scanner);
+}
 ;
 
 function_arguments
@@ -1226,7 +1248,7 @@ sockaddr
 			$$->value.socket_address_ipv4 = ipv4;
 		} else {
 			free(ipv4);
-			semantic_error("invalid IPv4 address");
+			semantic_error(context, "invalid IPv4 address");
 		}
 	} else if (strcmp($4, "AF_INET6") == 0) {
 		struct sockaddr_in6 *ipv6 = malloc(sizeof(struct sockaddr_in6));
@@ -1243,7 +1265,7 @@ sockaddr
 			$$->value.socket_address_ipv6 = ipv6;
 		} else {
 			free(ipv6);
-			semantic_error("invalid IPv6 address");
+			semantic_error(context, "invalid IPv6 address");
 		}
 	}
 }
@@ -1334,7 +1356,7 @@ command_spec
 : BACK_QUOTED       {
 	$$ = malloc(sizeof(struct command_spec));
 	$$->command_line = $1;
-	current_script_line = yylineno;
+	context->script_line = yyget_lineno(scanner);
 }
 ;
 
@@ -1342,7 +1364,7 @@ code_spec
 : CODE              {
 	$$ = calloc(1, sizeof(struct code_spec));
 	$$->text = $1;
-	current_script_line = yylineno;
+	context->script_line = yyget_lineno(scanner);
  }
 ;
 
@@ -36,7 +36,9 @@
 #endif
 #include <sys/socket.h>
 #include <sys/times.h>
+#include <time.h>
 #include <unistd.h>
+#include "histogram.h"
 #include "ip.h"
 #include "logging.h"
 #include "netdev.h"
@@ -46,25 +48,19 @@
 #include "run_packet.h"
 #include "run_system_call.h"
 #include "script.h"
+#include "script_cache.h"
 #include "socket.h"
 #include "system.h"
 #include "tcp.h"
 #include "tcp_options.h"
 
-/* MAX_SPIN_USECS is the maximum amount of time (in microseconds) to
- * spin waiting for an event. We sleep up until this many microseconds
- * before a script event. We get the best results on tickless
- * (CONFIG_NO_HZ=y) kernels when we try to sleep until the exact jiffy
- * of a script event; this reduces the staleness/noise we see in
- * jiffies values on tickless kernels, since the kernel updates the
- * jiffies value at the time we wake, and then we execute the test
- * event shortly thereafter. The value below was chosen experimentally
- * based on experiences on a 2.2GHz machine for which there was a
- * measured overhead of roughly 15 usec for the unlock/usleep/lock
- * sequence that wait_for_event() must execute while waiting
- * for the next event.
+/* With --spin_usecs=auto we time this many short sleeps at start-up
+ * and spin for roughly the worst wakeup lateness we saw.
  */
-const int MAX_SPIN_USECS = 20;
+static const int SPIN_CALIBRATION_SLEEPS = 50;
+static const int SPIN_CALIBRATION_SLEEP_USECS = 200;
+
+static int get_spin_usecs(struct config *config);
 
 struct state *state_new(struct config *config,
                         struct script *script,
@@ -84,6 +80,13 @@ struct state *state_new(struct config *config,
 	state->syscalls = syscalls_new(state);
 	state->code = code_new(config);
 	state->sockets = NULL;
+	state->live_socket_index = socket_index_new(1);
+	state->script_socket_index = socket_index_new(1);
+	state->spin_usecs = get_spin_usecs(config);
+	histogram_reset(&state->sched_lateness);
+	timing_report_reset(&state->timing_report);
+	histogram_reset(&state->inbound_batch_gaps);
+	histogram_reset(&state->syscall_block_detect);
 	return state;
 }
 
@@ -131,6 +134,8 @@ void state_free(struct state *state)
 	 * per-connection kernel state.
 	 */
 	close_all_sockets(state);
+	socket_index_free(state->live_socket_index);
+	socket_index_free(state->script_socket_index);
 
 	netdev_free(state->netdev);
 	packets_free(state->packets);
@@ -144,14 +149,6 @@ void state_free(struct state *state)
 	free(state);
 }
 
-s64 now_usecs(void)
-{
-	struct timeval tv;
-	if (gettimeofday(&tv, NULL) < 0)
-		die_perror("gettimeofday");
-	return timeval_to_usecs(&tv);
-}
-
 /*
  * Verify that something happened at the expected time.
  * WARNING: verify_time() should not be looking at state->event
@@ -161,6 +158,7 @@ s64 now_usecs(void)
  * checking.
  */
 int verify_time(struct state *state, enum event_time_t time_type,
+                enum timing_event_t timing_event,
                 s64 script_usecs, s64 script_usecs_end,
                 s64 live_usecs, const char *description, char **error)
 {
@@ -181,6 +179,9 @@ int verify_time(struct state *state, enum event_time_t time_type,
 	{
 		DEBUGP("expected_usecs_end %.3f\n",
 		       usecs_to_secs(script_usecs_end));
+		timing_report_add(&state->timing_report, timing_event,
+		                  expected_usecs, expected_usecs_end,
+		                  actual_usecs);
 		if (actual_usecs < (expected_usecs - tolerance_usecs) ||
 		        actual_usecs > (expected_usecs_end + tolerance_usecs))
 		{
@@ -245,6 +246,9 @@ int verify_time(struct state *state, enum event_time_t time_type,
 		}
 	}
 
+	timing_report_add(&state->timing_report, timing_event,
+	                  expected_usecs, expected_usecs, actual_usecs);
+
 	if ((actual_usecs < (expected_usecs - tolerance_usecs)) ||
 	        (actual_usecs > (expected_usecs + tolerance_usecs)))
 	{
@@ -308,12 +312,38 @@ static const char *event_description(struct event *event)
 	return "invalid event";
 }
 
+/* Return the kind of event, for grouping timing statistics. */
+static enum timing_event_t event_timing_type(struct event *event)
+{
+	switch (event->type)
+	{
+	case PACKET_EVENT:
+		if (packet_direction(event->event.packet) ==
+		        DIRECTION_OUTBOUND)
+			return TIMING_OUTBOUND_PACKET;
+		return TIMING_INBOUND_PACKET;
+	case SYSCALL_EVENT:
+		return TIMING_SYSCALL;
+	case COMMAND_EVENT:
+		return TIMING_COMMAND;
+	case CODE_EVENT:
+		return TIMING_CODE;
+	case INVALID_EVENT:
+	case NUM_EVENT_TYPES:
+		break;
+		/* We omit default case so compiler catches missing values. */
+	}
+	assert(!"bad event type");
+	return TIMING_CODE;
+}
+
 void check_event_time(struct state *state, s64 live_usecs)
 {
 	char *error = NULL;
 	const char *description = event_description(state->event);
 	if (verify_time(state,
 	                state->event->time_type,
+	                event_timing_type(state->event),
 	                state->event->time_usecs,
 	                state->event->time_usecs_end, live_usecs,
 	                description, &error))
@@ -325,10 +355,32 @@ void check_event_time(struct state *state, s64 live_usecs)
 	}
 }
 
+void check_event_not_late(struct state *state, s64 live_usecs)
+{
+	const struct event *event = state->event;
+	s64 latest_usecs = event->time_usecs;
+
+	if (event->time_type == ANY_TIME)
+		return;
+	if (event->time_type == ABSOLUTE_RANGE_TIME ||
+	        event->time_type == RELATIVE_RANGE_TIME)
+		latest_usecs = event->time_usecs_end;
+
+	if (live_time_to_script_time_usecs(state, live_usecs) >
+	        latest_usecs + state->config->tolerance_usecs)
+		check_event_time(state, live_usecs);
+}
+
 /* Set the start (and end time, if applicable) for the event if it
  * uses wildcard or relative timing.
  */
 void adjust_relative_event_times(struct state *state, struct event *event)
+{
+	adjust_relative_event_times_from(state, event, now_usecs());
+}
+
+void adjust_relative_event_times_from(struct state *state,
+                                      struct event *event, s64 base_usecs)
 {
 	s64 offset_usecs;
 
@@ -337,7 +389,7 @@ void adjust_relative_event_times(struct state *state, struct event *event)
 	        event->time_type != RELATIVE_RANGE_TIME)
 		return;
 
-	offset_usecs = now_usecs() - state->live_start_time_usecs;
+	offset_usecs = base_usecs - state->live_start_time_usecs;
 	event->offset_usecs = offset_usecs;
 
 	event->time_usecs += offset_usecs;
@@ -353,47 +405,101 @@ void adjust_relative_event_times(struct state *state, struct event *event)
 	}
 }
 
+/* Sleep until the given absolute now_usecs() time, or return early if
+ * a signal interrupts us. On other platforms we do not know how
+ * fine-grained sleeps are, so we return right away and let the caller
+ * spin.
+ */
+static void sleep_until_usecs(s64 deadline_usecs)
+{
+#ifdef linux
+	struct timespec deadline;
+
+	deadline.tv_sec = deadline_usecs / 1000000LL;
+	deadline.tv_nsec = (deadline_usecs % 1000000LL) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+#endif
+}
+
+/* Measure how late we wake up from short sleeps on this machine, and
+ * return how long we should spin before each event to hide that.
+ */
+static int calibrate_spin_usecs(void)
+{
+	struct histogram lateness;
+	int i;
+
+	histogram_reset(&lateness);
+	for (i = 0; i < SPIN_CALIBRATION_SLEEPS; ++i)
+	{
+		s64 deadline_usecs = now_usecs() +
+				     SPIN_CALIBRATION_SLEEP_USECS;
+		sleep_until_usecs(deadline_usecs);
+		histogram_add(&lateness, now_usecs() - deadline_usecs);
+	}
+	DEBUGP("spin calibration: p50 %lld p99 %lld max %lld usecs\n",
+	       histogram_percentile(&lateness, 50),
+	       histogram_percentile(&lateness, 99), lateness.max);
+
+	return histogram_percentile(&lateness, 99);
+}
+
+/* Return how many microseconds to spin before each event, calibrating
+ * the first time through if the user asked for that.
+ */
+static int get_spin_usecs(struct config *config)
+{
+	static int calibrated_spin_usecs = -1;
+
+	if (config->spin_usecs != SPIN_USECS_AUTO)
+		return config->spin_usecs;
+
+	if (calibrated_spin_usecs < 0)
+		calibrated_spin_usecs = calibrate_spin_usecs();
+	return calibrated_spin_usecs;
+}
+
 void wait_for_event(struct state *state)
+{
+	check_event_time(state, sleep_until_event(state));
+}
+
+s64 sleep_until_event(struct state *state)
 {
 	s64 event_usecs =
 	    script_time_to_live_time_usecs(
 	        state, state->event->time_usecs);
+	s64 now = now_usecs();
+
 	DEBUGP("waiting until %lld -- now is %lld\n",
-	       event_usecs, now_usecs());
-	while (1)
+	       event_usecs, now);
+
+	/* Since the scheduler may not wake us up precisely when we
+	 * tell it to, sleep until just before the event we're waiting
+	 * for and then spin. Sleeping until an absolute deadline means
+	 * the time we spend getting to sleep does not push us later.
+	 */
+	if (event_usecs - now > state->spin_usecs)
 	{
-		const s64 wait_usecs = event_usecs - now_usecs();
-		if (wait_usecs <= 0)
-			break;
+		run_unlock(state);
+		sleep_until_usecs(event_usecs - state->spin_usecs);
+		run_lock(state);
+	}
 
-		/* If we're waiting a long time, and we are on an OS
-		 * that we know has a fine-grained usleep(), then
-		 * usleep() instead of spinning on the CPU.
-		 */
-#ifdef linux
-		/* Since the scheduler may not wake us up precisely
-		 * when we tell it to, sleep until just before the
-		 * event we're waiting for and then spin.
-		 */
-		if (wait_usecs > MAX_SPIN_USECS)
-		{
-			run_unlock(state);
-			usleep(wait_usecs - MAX_SPIN_USECS);
-			run_lock(state);
-		}
-#endif
+	/* At this point we should only have a few microseconds to
+	 * wait, so we spin.
+	 */
+	while ((now = now_usecs()) < event_usecs)
+		;
 
-		/* At this point we should only have a millisecond or
-		 * two to wait, so we spin.
-		 */
-	}
+	histogram_add(&state->sched_lateness, now - event_usecs);
 
-	check_event_time(state, now_usecs());
+	return now;
 }
 
 int get_next_event(struct state *state, char **error)
 {
-	DEBUGP("gettimeofday: %.6f\n", now_usecs() / 1000000.0);
+	DEBUGP("now: %.6f\n", now_usecs() / 1000000.0);
 
 	if (state->event == NULL)
 	{
@@ -466,9 +572,14 @@ static void run_local_packet_event(struct state *state, struct event *event,
 	char *error = NULL;
 	int result = STATUS_OK;
 
-	result = run_packet_event(state, event, packet, &error);
+	if (state->config->inbound_batch &&
+	        inbound_packet_batch_length(event) > 1)
+		result = run_inbound_packet_batch(state, &error);
+	else
+		result = run_packet_event(state, event, packet, &error);
 	if (result == STATUS_WARN)
 	{
+		++state->num_warnings;
 		fprintf(stderr, "%s", error);
 		free(error);
 	}
@@ -573,8 +684,102 @@ static s64 schedule_start_time_usecs(void)
 #endif
 }
 
-void run_script(struct config *config, struct script *script)
+/* For verbose runs, summarize how late we woke up for events. */
+static void print_sched_lateness(struct state *state)
+{
+	const struct histogram *lateness = &state->sched_lateness;
+
+	if (!state->config->verbose || lateness->num_samples == 0)
+		return;
+
+	printf("scheduling lateness (usecs): events: %llu spin: %d "
+	       "mean: %.1f p50: %lld p90: %lld p99: %lld max: %lld\n",
+	       lateness->num_samples, state->spin_usecs,
+	       histogram_mean(lateness),
+	       histogram_percentile(lateness, 50),
+	       histogram_percentile(lateness, 90),
+	       histogram_percentile(lateness, 99),
+	       lateness->max);
+}
+
+/* For verbose runs, summarize the spacing of batched inbound packets. */
+static void print_inbound_batch_gaps(struct state *state)
+{
+	const struct histogram *gaps = &state->inbound_batch_gaps;
+
+	if (!state->config->verbose || gaps->num_samples == 0)
+		return;
+
+	printf("inbound batch spacing (usecs): gaps: %llu "
+	       "mean: %.1f p50: %lld p99: %lld max: %lld\n",
+	       gaps->num_samples, histogram_mean(gaps),
+	       histogram_percentile(gaps, 50),
+	       histogram_percentile(gaps, 99),
+	       gaps->max);
+}
+
+/* For verbose runs, summarize how long it took to see each blocking
+ * system call block (or return) before moving on to the next event.
+ */
+static void print_syscall_block_detect(struct state *state)
+{
+	const struct histogram *detect = &state->syscall_block_detect;
+
+	if (!state->config->verbose || detect->num_samples == 0)
+		return;
+
+	printf("blocking syscall detection (usecs): calls: %llu "
+	       "mean: %.1f p50: %lld p99: %lld max: %lld\n",
+	       detect->num_samples, histogram_mean(detect),
+	       histogram_percentile(detect, 50),
+	       histogram_percentile(detect, 99),
+	       detect->max);
+}
+
+/* For verbose runs, show how much allocator traffic the packet pool saved. */
+static void print_packet_pool_stats(struct config *config)
+{
+	struct packet_pool_stats stats;
+
+	if (!config->verbose)
+		return;
+
+	packet_pool_get_stats(&stats);
+	printf("packet pool: hits: %llu misses: %llu "
+	       "in use: %d high water: %d free: %d\n",
+	       stats.hits, stats.misses,
+	       stats.in_use, stats.high_water, stats.free);
+}
+
+/* Print the end-of-run statistics and timing report for the script. */
+static void print_run_reports(struct state *state)
+{
+	struct config *config = state->config;
+
+	print_sched_lateness(state);
+	print_inbound_batch_gaps(state);
+	print_syscall_block_detect(state);
+	timing_report_print(&state->timing_report, config->timing_report,
+	                    config->script_path, config->tolerance_usecs,
+	                    stdout);
+}
+
+/* The script we're running, if any, so that if it fails with die() we
+ * can still report how well we kept to its timing, which is when those
+ * numbers matter most.
+ */
+static struct state *running_state;
+
+static void print_run_reports_at_exit(void)
 {
+	if (running_state != NULL)
+		print_run_reports(running_state);
+}
+
+int run_script(struct config *config, struct script *script)
+{
+	static bool registered_at_exit = false;
+	int result = STATUS_OK;
 	char *error = NULL;
 	struct state *state = NULL;
 	struct netdev *netdev = NULL;
@@ -598,6 +803,14 @@ void run_script(struct config *config, struct script *script)
 
 	state = state_new(config, script, netdev);
 
+	running_state = state;
+	if (!registered_at_exit)
+	{
+		if (atexit(print_run_reports_at_exit) != 0)
+			die("atexit failed\n");
+		registered_at_exit = true;
+	}
+
 	if (config->is_wire_client)
 	{
 		state->wire_client = wire_client_new();
@@ -621,7 +834,8 @@ void run_script(struct config *config, struct script *script)
 	       state->live_start_time_usecs);
 
 	if (state->wire_client != NULL)
-		wire_client_send_client_starting(state->wire_client);
+		wire_client_send_client_starting(state->wire_client,
+		                                 state->live_start_time_usecs);
 
 	while (1)
 	{
@@ -631,14 +845,16 @@ void run_script(struct config *config, struct script *script)
 		if (event == NULL)
 			break;
 
-		if (state->wire_client != NULL)
-			wire_client_next_event(state->wire_client, event);
-
 		/* In wire mode, we adjust relative times after
 		 * getting notification that previous packet events
-		 * have completed, if any.
+		 * have completed, if any, and from the time they did.
 		 */
-		adjust_relative_event_times(state, event);
+		if (state->wire_client != NULL)
+			adjust_relative_event_times_from(
+			    state, event,
+			    wire_client_next_event(state->wire_client, event));
+		else
+			adjust_relative_event_times(state, event);
 
 		switch (event->type)
 		{
@@ -681,9 +897,19 @@ void run_script(struct config *config, struct script *script)
 		free(error);
 	}
 
+	if (state->num_warnings > 0)
+		result = STATUS_WARN;
+
+	running_state = NULL;
+	print_run_reports(state);
+
 	state_free(state);
 
+	print_packet_pool_stats(config);
+
 	DEBUGP("run_script: done running\n");
+
+	return result;
 }
 
 int parse_script_and_set_config(int argc, char *argv[],
@@ -713,5 +939,20 @@ int parse_script_and_set_config(int argc, char *argv[],
 	else
 		read_script(script_path, script);
 
-	return parse_script(config, script, &invocation);
+	/* If we have parsed this exact script and command line before,
+	 * reuse that work and just apply the options again. Concurrent
+	 * wire server sessions may get here at once, but the getopt
+	 * re-parse inside takes the same lock as it does from the parser.
+	 */
+	if (script_cache_lookup(argc, argv, script))
+	{
+		parse_and_finalize_config(&invocation);
+		return STATUS_OK;
+	}
+
+	if (parse_script(config, script, &invocation))
+		return STATUS_ERR;
+
+	script_cache_insert(argc, argv, script);
+	return STATUS_OK;
 }
@@ -62,16 +62,22 @@
 #include <sys/socket.h>
 #include "code.h"
 #include "config.h"
+#include "histogram.h"
 #include "netdev.h"
 #include "run_packet.h"
 #include "run_system_call.h"
 #include "script.h"
 #include "socket.h"
+#include "socket_index.h"
+#include "timing_report.h"
 #include "wire_client.h"
 
-/* Public top-level entry point for executing a test script */
-extern void run_script(struct config *config,
-		       struct script *script);
+/* Public top-level entry point for executing a test script. Exits on
+ * errors. Returns STATUS_WARN if the script ran to completion but hit
+ * non-fatal problems along the way, or else STATUS_OK.
+ */
+extern int run_script(struct config *config,
+		      struct script *script);
 
 /* Public entry-point to parse a script and finalize config. If the
  * script_buffer is provided, parse that. Otherwise, read the file
@@ -94,6 +100,8 @@ struct state {
 	struct syscalls *syscalls;	/* for running system calls */
 	struct socket *sockets;		/* list of all live sockets */
 	struct socket *socket_under_test;	/* socket handling packets */
+	struct socket_index *live_socket_index;	/* sockets by live tuple */
+	struct socket_index *script_socket_index; /* ... by script tuple */
 	struct script *script;			/* script we're running */
 	struct event *event;			/* the current event */
 	struct event *last_event;		/* previous event */
@@ -102,6 +110,16 @@ struct state {
 	s64 script_start_time_usecs;	/* time of first event in script */
 	s64 script_last_time_usecs;	/* time of previous event in script */
 	s64 live_start_time_usecs;	/* time of first event in live test */
+	int num_warnings;		/* non-fatal problems so far */
+	int spin_usecs;			/* usecs to spin before each event */
+	struct histogram sched_lateness;	/* usecs late waking for events */
+	struct timing_report timing_report;	/* timing errors by event */
+	struct histogram inbound_batch_gaps;	/* usecs between batched
+						 * inbound packets
+						 */
+	struct histogram syscall_block_detect;	/* usecs to see a blocking
+						 * syscall block or finish
+						 */
 };
 
 /* Allocate all run-time state for executing a test script. */
@@ -126,10 +144,7 @@ static inline void run_unlock(struct state *state)
 		die_perror("pthread_mutex_unlock");
 }
 
-/* Get the wall clock time of day in microseconds. */
-extern s64 now_usecs(void);
-
-/* Convert script time to live wall clock time. */
+/* Convert script time to live time. */
 static inline s64 script_time_to_live_time_usecs(struct state *state,
 						 s64 script_time_usecs)
 {
@@ -138,7 +153,7 @@ static inline s64 script_time_to_live_time_usecs(struct state *state,
 	return live_time_usecs;
 }
 
-/* Convert live wall clock time to script time. */
+/* Convert live time to script time. */
 static inline s64 live_time_to_script_time_usecs(struct state *state,
 						 s64 live_time_usecs)
 {
@@ -157,24 +172,48 @@ static inline s64 live_time_to_script_time_usecs(struct state *state,
  * for the common case: it looks at the current event and on failure
  * it prints the error message to stderr and exits with an error
  * status.  For time ranges the end time is specified in script_usecs_end.
+ * Every checked time is also recorded in the state's timing report
+ * under the given kind of event.
  */
 extern int verify_time(struct state *state, enum event_time_t time_type,
+		       enum timing_event_t timing_event,
 		       s64 script_usecs, s64 script_usecs_end,
 		       s64 live_usecs, const char *description, char **error);
 extern void check_event_time(struct state *state, s64 live_usecs);
 
+/* Like check_event_time(), but only fail if 'live_usecs' is already
+ * past the latest time the current event may happen, and record
+ * nothing in the timing report otherwise. For checking the time we
+ * woke up before acting on an event whose actual time we check later.
+ */
+extern void check_event_not_late(struct state *state, s64 live_usecs);
+
 /* Set the start (and end time, if applicable) for the event if it
  * uses wildcard or relative timing.
  */
 extern void adjust_relative_event_times(struct state *state,
 					struct event *event);
 
+/* Like adjust_relative_event_times(), but measure relative times from
+ * 'base_usecs' (a now_usecs() time at which the previous event
+ * finished) rather than from the current time.
+ */
+extern void adjust_relative_event_times_from(struct state *state,
+					     struct event *event,
+					     s64 base_usecs);
+
 /*
  * Sleep and/or spin until the time at which we want the current event
  * to happen.
  */
 extern void wait_for_event(struct state *state);
 
+/* Like wait_for_event(), but return the now_usecs() time at which we
+ * woke up rather than checking it, for callers that check the time at
+ * which the event actually happened themselves.
+ */
+extern s64 sleep_until_event(struct state *state);
+
 /* Advance the interpreter state to the next event. */
 extern int get_next_event(struct state *state, char **error);
 
@@ -26,6 +26,7 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -39,6 +40,7 @@
 #include "packet_to_string.h"
 #include "run.h"
 #include "script.h"
+#include "socket_index.h"
 #include "tcp_options_iterator.h"
 #include "tcp_options_to_string.h"
 #include "tcp_packet.h"
@@ -110,19 +112,23 @@ static void add_packet_dump(char **error, const char *type,
 	{
 		char *old_error = *error;
 		char *dump = NULL, *dump_error = NULL;
+		const char *source =
+		    packet_time_source_label(packet->time_source);
 
 		packet_to_string(packet, format,
 		                 &dump, &dump_error);
 #ifdef ECOS
-		int len = 24 + strlen(old_error) + strlen(type) + strlen(dump) + (dump_error ? (1 + strlen(dump_error)) : 0);
+		int len = 24 + strlen(old_error) + strlen(type) + strlen(dump) + strlen(source) + (dump_error ? (1 + strlen(dump_error)) : 0);
 		*error = malloc(len);
-		snprintf(*error, len, "%s\n%s packet: %9.6f %s%s%s",
-		         old_error, type, usecs_to_secs(time_usecs), dump,
+		snprintf(*error, len, "%s\n%s packet: %9.6f%s %s%s%s",
+		         old_error, type, usecs_to_secs(time_usecs), source,
+		         dump,
 		         dump_error ? "\n" : "",
 		         dump_error ? dump_error : "");
 #else
-		asprintf(error, "%s\n%s packet: %9.6f %s%s%s",
-		         old_error, type, usecs_to_secs(time_usecs), dump,
+		asprintf(error, "%s\n%s packet: %9.6f%s %s%s%s",
+		         old_error, type, usecs_to_secs(time_usecs), source,
+		         dump,
 		         dump_error ? "\n" : "",
 		         dump_error ? dump_error : "");
 #endif
@@ -143,8 +149,10 @@ static void verbose_packet_dump(struct state *state, const char *type,
 		packet_to_string(live_packet, DUMP_SHORT,
 		                 &dump, &dump_error);
 
-		printf("%s packet: %9.6f %s%s%s\n",
-		       type, usecs_to_secs(time_usecs), dump,
+		printf("%s packet: %9.6f%s %s%s%s\n",
+		       type, usecs_to_secs(time_usecs),
+		       packet_time_source_label(live_packet->time_source),
+		       dump,
 		       dump_error ? "\n" : "",
 		       dump_error ? dump_error : "");
 
@@ -153,17 +161,80 @@ static void verbose_packet_dump(struct state *state, const char *type,
 	}
 }
 
-/* See if the live packet matches the live 4-tuple of the socket under test. */
+void index_socket(struct state *state, struct socket *socket)
+{
+	struct tuple tuple;
+
+	if (socket->script.local.port != 0 && socket->script.remote.port != 0)
+	{
+		socket_get_outbound(&socket->script, &tuple);
+		socket_index_set(state->script_socket_index, &tuple, socket);
+	}
+	if (socket->live.local.port != 0 && socket->live.remote.port != 0)
+	{
+		socket_get_outbound(&socket->live, &tuple);
+		socket_index_set(state->live_socket_index, &tuple, socket);
+	}
+}
+
+void unindex_socket(struct state *state, struct socket *socket)
+{
+	struct tuple tuple;
+
+	if (socket->script.local.port != 0 && socket->script.remote.port != 0)
+	{
+		socket_get_outbound(&socket->script, &tuple);
+		socket_index_remove(state->script_socket_index, &tuple, socket);
+	}
+	if (socket->live.local.port != 0 && socket->live.remote.port != 0)
+	{
+		socket_get_outbound(&socket->live, &tuple);
+		socket_index_remove(state->live_socket_index, &tuple, socket);
+	}
+}
+
+/* Look up the socket whose outbound packets carry the given 4-tuple,
+ * or whose inbound packets do, in the given index.
+ */
+static struct socket *find_socket_in_index(
+    const struct socket_index *index, const struct tuple *packet_tuple,
+    enum direction_t *direction)
+{
+	struct socket *socket = NULL;
+	struct tuple reversed;
+
+	socket = socket_index_get(index, packet_tuple);
+	if (socket != NULL)
+	{
+		*direction = DIRECTION_OUTBOUND;
+		return socket;
+	}
+
+	memset(&reversed, 0, sizeof(reversed));
+	reverse_tuple(packet_tuple, &reversed);
+	socket = socket_index_get(index, &reversed);
+	if (socket != NULL)
+	{
+		*direction = DIRECTION_INBOUND;
+		return socket;
+	}
+	return NULL;
+}
+
+/* See if the live packet matches the live 4-tuple of a socket we know
+ * about, checking the socket under test first.
+ */
 static struct socket *find_socket_for_live_packet(
     struct state *state, const struct packet *packet,
     enum direction_t *direction)
 {
 	struct socket *socket = state->socket_under_test;	/* shortcut */
-	if (socket == NULL)
-		return NULL;
-
 	struct tuple packet_tuple, live_outbound, live_inbound;
+
 	get_packet_tuple(packet, &packet_tuple);
+	if (socket == NULL)
+		return find_socket_in_index(state->live_socket_index,
+		                            &packet_tuple, direction);
 
 	/* Is packet inbound to the socket under test? */
 	socket_get_inbound(&socket->live, &live_inbound);
@@ -183,7 +254,8 @@ static struct socket *find_socket_for_live_packet(
 		       socket->state);
 		return socket;
 	}
-	return NULL;
+	return find_socket_in_index(state->live_socket_index,
+	                            &packet_tuple, direction);
 }
 
 /* See if the socket under test is listening and is willing to receive
@@ -266,6 +338,7 @@ static struct socket *handle_listen_for_script_packet(
 		DEBUGP("live: ISN: %u\n", socket->live.remote_isn);
 	}
 
+	index_socket(state, socket);
 	return socket;
 }
 
@@ -329,11 +402,13 @@ static struct socket *handle_connect_for_script_packet(
 	/* Fill in the new info about this connection. */
 	struct tuple tuple;
 	get_packet_tuple(packet, &tuple);
+	unindex_socket(state, socket);
 	socket->state			= SOCKET_ACTIVE_SYN_SENT;
 	socket->script.remote		= tuple.dst;
 	socket->script.local		= tuple.src;
 	socket->script.local_isn	= ntohl(packet->tcp->seq);
 
+	index_socket(state, socket);
 	return socket;
 }
 
@@ -370,12 +445,14 @@ static struct socket *find_connect_for_live_packet(
 	 * new details we've learned about this actively initiated
 	 * connection (for which we've seen a connect() call).
 	 */
+	unindex_socket(state, socket);
 	socket->live.local.ip	= tuple.src.ip;
 	socket->live.local.port	= tuple.src.port;
 
 	if (packet->tcp)
 		socket->live.local_isn	= ntohl(packet->tcp->seq);
 
+	index_socket(state, socket);
 	return socket;
 }
 
@@ -569,60 +646,61 @@ static int map_inbound_packet(
 	return STATUS_OK;
 }
 
-/* Transforms values in the 'actual_packet' by mapping outbound packet
- * values in the sniffed 'live_packet' (address 4-tuple, sequence
- * number in seq, timestamp value) from live values to script values
- * in the space of 'script_packet'. This will allow us to compare a
- * packet sent by the kernel to the packet expected by the script.
+/* Offsets that map values in an outbound live packet into script
+ * space. The verifiers apply these to each live value as they compare
+ * it, so the sniffed packet is never copied or rewritten.
+ */
+struct outbound_mapping
+{
+	u32 seq_offset;		/* live-to-script offset for TCP seq */
+	u32 ack_offset;		/* live-to-script offset for ACK and SACKs */
+	u32 ts_val_offset;	/* live-to-script offset for TCP TS val */
+};
+
+/* Work out how to map outbound packet values in the sniffed
+ * 'live_packet' (sequence number in seq, ACK and SACK blocks, timestamp
+ * value) from live values to script values in the space of
+ * 'script_packet', and remember the script->live TS val mapping for
+ * later inbound packets. This will allow us to compare a packet sent
+ * by the kernel to the packet expected by the script.
  */
 static int map_outbound_live_packet(
     struct socket *socket,
     struct packet *live_packet,
-    struct packet *actual_packet,
     struct packet *script_packet,
+    struct outbound_mapping *mapping,
     char **error)
 {
 	DEBUGP("map_outbound_live_packet\n");
 
-	struct tuple live_packet_tuple, live_outbound, script_outbound;
+	struct tuple live_packet_tuple, live_outbound;
+
+	memset(mapping, 0, sizeof(*mapping));
 
 	/* Verify packet addresses are outbound and live for this socket. */
 	get_packet_tuple(live_packet, &live_packet_tuple);
 	socket_get_outbound(&socket->live, &live_outbound);
 	assert(is_equal_tuple(&live_packet_tuple, &live_outbound));
 
-	/* Rewrite 4-tuple to be outbound script values. */
-	socket_get_outbound(&socket->script, &script_outbound);
-	set_packet_tuple(actual_packet, &script_outbound);
-
-	/* If no TCP headers to rewrite, then we're done. */
+	/* If no TCP headers to map, then we're done. */
 	if (live_packet->tcp == NULL)
 		return STATUS_OK;
 
-	/* Rewrite TCP sequence number from live to script space. */
+	/* Map TCP sequence numbers, ACKs, and SACKs to script space. */
 	const bool is_syn = live_packet->tcp->syn;
-	const u32 seq_offset = local_seq_live_to_script_offset(socket, is_syn);
-	actual_packet->tcp->seq =
-	    htonl(ntohl(live_packet->tcp->seq) + seq_offset);
+	mapping->seq_offset = local_seq_live_to_script_offset(socket, is_syn);
+	mapping->ack_offset = remote_seq_live_to_script_offset(socket, is_syn);
 
-	/* Rewrite ACKs and SACKs from live to script space. */
-	const u32 ack_offset = remote_seq_live_to_script_offset(socket, is_syn);
-	if (actual_packet->tcp->ack)
-		actual_packet->tcp->ack_seq =
-		    htonl(ntohl(live_packet->tcp->ack_seq) + ack_offset);
-	if (offset_sack_blocks(actual_packet, ack_offset, error))
-		return STATUS_ERR;
-
-	/* Extract location of script and actual TCP timestamp values. */
+	/* Extract location of script and live TCP timestamp values. */
 	if (find_tcp_timestamp(script_packet, error))
 		return STATUS_ERR;
-	if (find_tcp_timestamp(actual_packet, error))
+	if (find_tcp_timestamp(live_packet, error))
 		return STATUS_ERR;
 	if ((script_packet->tcp_ts_val != NULL) &&
-	        (actual_packet->tcp_ts_val != NULL))
+	        (live_packet->tcp_ts_val != NULL))
 	{
 		u32 script_ts_val = packet_tcp_ts_val(script_packet);
-		u32 actual_ts_val = packet_tcp_ts_val(actual_packet);
+		u32 actual_ts_val = packet_tcp_ts_val(live_packet);
 
 		/* Remember script->actual TS val mapping for later. */
 		set_outbound_ts_val_mapping(socket,
@@ -637,19 +715,56 @@ static int map_outbound_live_packet(
 			socket->first_actual_ts_val = actual_ts_val;
 		}
 
-		/* Rewrite TCP timestamp value to script space, so we
-		 * can compare the script and actual outbound TCP
-		 * timestamp val.
+		/* Map TCP timestamp value to script space, so we can
+		 * compare the script and actual outbound TCP timestamp val.
 		 */
-		packet_set_tcp_ts_val(actual_packet,
-		                      socket->first_script_ts_val +
-		                      (actual_ts_val -
-		                       socket->first_actual_ts_val));
+		mapping->ts_val_offset = (socket->first_script_ts_val -
+		                          socket->first_actual_ts_val);
 	}
 
 	return STATUS_OK;
 }
 
+/* Build the 'actual' packet for error messages: a copy of the
+ * sniffed 'live_packet' with the values from 'mapping' and the
+ * script's outbound 4-tuple written into it. Only failure paths pay
+ * for this copy.
+ */
+static struct packet *outbound_actual_packet(
+    struct socket *socket,
+    struct packet *live_packet,
+    struct packet *script_packet,
+    const struct outbound_mapping *mapping)
+{
+	struct packet *actual_packet = packet_copy(live_packet);
+	struct tuple script_outbound;
+	char *error = NULL;
+
+	/* Rewrite 4-tuple to be outbound script values. */
+	socket_get_outbound(&socket->script, &script_outbound);
+	set_packet_tuple(actual_packet, &script_outbound);
+
+	/* If no TCP headers to rewrite, then we're done. */
+	if (actual_packet->tcp == NULL)
+		return actual_packet;
+
+	actual_packet->tcp->seq =
+	    htonl(ntohl(live_packet->tcp->seq) + mapping->seq_offset);
+	if (actual_packet->tcp->ack)
+		actual_packet->tcp->ack_seq =
+		    htonl(ntohl(live_packet->tcp->ack_seq) +
+		          mapping->ack_offset);
+	if (offset_sack_blocks(actual_packet, mapping->ack_offset, &error))
+		free(error);
+	else if ((script_packet->tcp_ts_val != NULL) &&
+	         (actual_packet->tcp_ts_val != NULL))
+		packet_set_tcp_ts_val(actual_packet,
+		                      packet_tcp_ts_val(live_packet) +
+		                      mapping->ts_val_offset);
+
+	return actual_packet;
+}
+
 /* Verify IP and TCP checksums on an outbound live packet. */
 static int verify_outbound_live_checksums(struct packet *live_packet,
                                           char **error)
@@ -823,6 +938,7 @@ static int verify_ipv6(
 static int verify_tcp(
     const struct packet *actual_packet,
     const struct packet *script_packet,
+    const struct outbound_mapping *mapping,
     int layer, char **error)
 {
 	const struct tcp *actual_tcp = actual_packet->headers[layer].h.tcp;
@@ -862,10 +978,13 @@ static int verify_tcp(
 	                    actual_tcp->res1, error) ||
 	        check_field("tcp_seq",
 	                    ntohl(script_tcp->seq),
-	                    ntohl(actual_tcp->seq), error) ||
+	                    ntohl(actual_tcp->seq) + mapping->seq_offset,
+	                    error) ||
 	        check_field("tcp_ack_seq",
 	                    ntohl(script_tcp->ack_seq),
-	                    ntohl(actual_tcp->ack_seq), error) ||
+	                    (ntohl(actual_tcp->ack_seq) +
+	                     (actual_tcp->ack ? mapping->ack_offset : 0)),
+	                    error) ||
 	        (script_packet->flags & FLAG_WIN_NOCHECK ? STATUS_OK :
 	         check_field("tcp_window",
 	                     ntohs(script_tcp->window),
@@ -965,6 +1084,7 @@ typedef int (*verifier_func)(
 static int verify_header(
     const struct packet *actual_packet,
     const struct packet *script_packet,
+    const struct outbound_mapping *mapping,
     int layer, char **error)
 {
 	verifier_func verifiers[HEADER_NUM_TYPES] =
@@ -973,7 +1093,6 @@ static int verify_header(
 		[HEADER_IPV6]	= verify_ipv6,
 		[HEADER_GRE]	= verify_gre,
 		[HEADER_MPLS]	= verify_mpls,
-		[HEADER_TCP]	= verify_tcp,
 		[HEADER_UDP]	= verify_udp,
 	};
 	verifier_func verifier = NULL;
@@ -1003,6 +1122,14 @@ static int verify_header(
 
 	assert(type > HEADER_NONE);
 	assert(type < HEADER_NUM_TYPES);
+
+	/* Only TCP has fields that live in a different sequence or
+	 * timestamp space in the script.
+	 */
+	if (type == HEADER_TCP)
+		return verify_tcp(actual_packet, script_packet, mapping,
+		                  layer, error);
+
 	verifier = verifiers[type];
 	assert(verifier != NULL);
 	return verifier(actual_packet, script_packet, layer, error);
@@ -1011,7 +1138,8 @@ static int verify_header(
 /* Verify that required actual header fields are as the script expected. */
 static int verify_outbound_live_headers(
     const struct packet *actual_packet,
-    const struct packet *script_packet, char **error)
+    const struct packet *script_packet,
+    const struct outbound_mapping *mapping, char **error)
 {
 	const int actual_headers = packet_header_count(actual_packet);
 	const int script_headers = packet_header_count(script_packet);
@@ -1042,44 +1170,153 @@ static int verify_outbound_live_headers(
 		if (script_packet->headers[i].type == HEADER_NONE)
 			break;
 
-		if (verify_header(actual_packet, script_packet, i, error))
+		if (verify_header(actual_packet, script_packet, mapping,
+		                  i, error))
 			return STATUS_ERR;
 	}
 
 	return STATUS_OK;
 }
 
-/* Return true iff the TCP options for the packets are bytewise identical. */
-static bool same_tcp_options(struct packet *packet_a,
-                             struct packet *packet_b)
+/* Return true iff the live and script TCP option bytes from
+ * *compared up to 'end' are identical, and advance *compared to 'end'.
+ */
+static bool same_option_bytes(const u8 *live, const u8 *script,
+                              int *compared, int end)
+{
+	const int start = *compared;
+
+	*compared = end;
+	return memcmp(live + start, script + start, end - start) == 0;
+}
+
+/* Return true iff the option bytes up to the 32-bit field at 'offset'
+ * are identical and the live field, mapped to script space by adding
+ * 'live_to_script', matches the script field.
+ */
+static bool same_option_u32(const u8 *live, const u8 *script,
+                            int *compared, int offset, u32 live_to_script)
 {
-	return ((packet_tcp_options_len(packet_a) ==
-	         packet_tcp_options_len(packet_b)) &&
-	        (memcmp(packet_tcp_options(packet_a),
-	                packet_tcp_options(packet_b),
-	                packet_tcp_options_len(packet_a)) == 0));
+	__be32 live_value, script_value;
+
+	if (!same_option_bytes(live, script, compared, offset))
+		return false;
+	memcpy(&live_value, live + offset, sizeof(live_value));
+	memcpy(&script_value, script + offset, sizeof(script_value));
+	*compared = offset + sizeof(u32);
+	return ntohl(live_value) + live_to_script == ntohl(script_value);
+}
+
+/* Return true iff the TCP options of the live packet, with SACK
+ * blocks and TS val mapped into script space, are bytewise identical
+ * to those of the script packet. If 'skip_ts_val' is set, the TS val
+ * is not compared at all. The live packet is compared in place.
+ */
+static bool same_mapped_tcp_options(struct packet *live_packet,
+                                    struct packet *script_packet,
+                                    const struct outbound_mapping *mapping,
+                                    bool skip_ts_val)
+{
+	const u8 *live = packet_tcp_options(live_packet);
+	const u8 *script = packet_tcp_options(script_packet);
+	const int len = packet_tcp_options_len(script_packet);
+	struct tcp_options_iterator iter;
+	struct tcp_option *option = NULL;
+	char *error = NULL;
+	int compared = 0;
+	int offset = 0;
+	int i = 0;
+
+	if (packet_tcp_options_len(live_packet) != len)
+		return false;
+
+	/* We work out where the fields are with offsetof() rather than
+	 * by taking their addresses, since struct tcp_option is packed.
+	 */
+
+	/* Walk the script options to find the fields that need mapping;
+	 * everything in between must match byte for byte.
+	 */
+	for (option = tcp_options_begin(script_packet, &iter); option != NULL;
+	        option = tcp_options_next(&iter, &error))
+	{
+		if (option->kind == TCPOPT_SACK)
+		{
+			int num_blocks = 0;
+			if (num_sack_blocks(option->length, &num_blocks, &error))
+				break;
+			for (i = 0; i < num_blocks; ++i)
+			{
+				const int block_offset =
+				    ((u8 *)option - script) +
+				    offsetof(struct tcp_option,
+				             data.sack.block) +
+				    i * sizeof(struct sack_block);
+
+				offset = block_offset +
+				         offsetof(struct sack_block, left);
+				if (!same_option_u32(live, script, &compared,
+				                     offset, mapping->ack_offset))
+					return false;
+				offset = block_offset +
+				         offsetof(struct sack_block, right);
+				if (!same_option_u32(live, script, &compared,
+				                     offset, mapping->ack_offset))
+					return false;
+			}
+		}
+		else if (option->kind == TCPOPT_TIMESTAMP)
+		{
+			offset = ((u8 *)option - script) +
+			         offsetof(struct tcp_option,
+			                  data.time_stamp.val);
+			if (skip_ts_val)
+			{
+				if (!same_option_bytes(live, script,
+				                       &compared, offset))
+					return false;
+				compared = offset + sizeof(u32);
+			}
+			else if (!same_option_u32(live, script, &compared,
+			                          offset,
+			                          mapping->ts_val_offset))
+			{
+				return false;
+			}
+		}
+	}
+	if (error != NULL)
+	{
+		free(error);
+		return false;
+	}
+
+	return same_option_bytes(live, script, &compared, len);
 }
 
 /* Verify that the TCP option values matched expected values. */
 static int verify_outbound_live_tcp_options(
     struct config *config,
-    struct packet *actual_packet,
-    struct packet *script_packet, char **error)
+    struct packet *live_packet,
+    struct packet *script_packet,
+    const struct outbound_mapping *mapping, char **error)
 {
 	/* See if we should validate TCP options at all. */
 	if (script_packet->flags & FLAG_OPTIONS_NOCHECK)
 		return STATUS_OK;
 
 	/* Simplest case: see if full options are bytewise identical. */
-	if (same_tcp_options(actual_packet, script_packet))
+	if (same_mapped_tcp_options(live_packet, script_packet,
+	                            mapping, false))
 		return STATUS_OK;
 
 	/* Otherwise, see if we just have a slight difference in TS val. */
 	if (script_packet->tcp_ts_val != NULL &&
-	        actual_packet->tcp_ts_val != NULL)
+	        live_packet->tcp_ts_val != NULL)
 	{
 		u32 script_ts_val = packet_tcp_ts_val(script_packet);
-		u32 actual_ts_val = packet_tcp_ts_val(actual_packet);
+		u32 actual_ts_val = (packet_tcp_ts_val(live_packet) +
+		                     mapping->ts_val_offset);
 
 		/* See if the deviation from the script TS val is
 		 * within our configured tolerance.
@@ -1100,14 +1337,10 @@ static int verify_outbound_live_tcp_options(
 		}
 
 		/* Now see if the rest of the TCP options outside the
-		 * TS val match: temporarily re-write the actual TS
-		 * val to the script TS val and then see if the full
-		 * options are now bytewise identical.
+		 * TS val match.
 		 */
-		packet_set_tcp_ts_val(actual_packet, script_ts_val);
-		bool is_same = same_tcp_options(actual_packet, script_packet);
-		packet_set_tcp_ts_val(actual_packet, actual_ts_val);
-		if (is_same)
+		if (same_mapped_tcp_options(live_packet, script_packet,
+		                            mapping, true))
 			return STATUS_OK;
 	}
 #ifdef ECOS
@@ -1166,24 +1399,28 @@ static int verify_outbound_live_packet(
 	s64 script_usecs = state->event->time_usecs;
 	s64 script_usecs_end = state->event->time_usecs_end;
 
-	/* The "actual" packet will be the live packet with values
-	 * mapped into script space.
+	/* Values in the live packet are mapped into script space as they
+	 * are compared; the "actual" packet, a rewritten copy of the live
+	 * one, is only built if we need to print it.
 	 */
-	struct packet *actual_packet = packet_copy(live_packet);
+	struct outbound_mapping mapping;
 	s64 actual_usecs = live_time_to_script_time_usecs(
 	                       state, live_packet->time_usecs);
 
+	memset(&mapping, 0, sizeof(mapping));
+
 	/* Before mapping, see if the live outgoing checksums are correct. */
 	if (verify_outbound_live_checksums(live_packet, error))
 		goto out;
 
-	/* Map live packet values into script space for easy comparison. */
+	/* Find how to map live packet values into script space. */
 	if (map_outbound_live_packet(
-	            socket, live_packet, actual_packet, script_packet, error))
+	            socket, live_packet, script_packet, &mapping, error))
 		goto out;
 
 	/* Verify actual IP, TCP/UDP header values matched expected ones. */
-	if (verify_outbound_live_headers(actual_packet, script_packet, error))
+	if (verify_outbound_live_headers(live_packet, script_packet,
+	                                 &mapping, error))
 	{
 		non_fatal = true;
 		goto out;
@@ -1193,8 +1430,8 @@ static int verify_outbound_live_packet(
 	{
 		/* Verify TCP options matched expected values. */
 		if (verify_outbound_live_tcp_options(
-		            state->config, actual_packet, script_packet,
-		            error))
+		            state->config, live_packet, script_packet,
+		            &mapping, error))
 		{
 			non_fatal = true;
 			goto out;
@@ -1202,7 +1439,7 @@ static int verify_outbound_live_packet(
 	}
 
 	/* Verify TCP/UDP payload matches expected value. */
-	if (verify_outbound_live_payload(actual_packet, script_packet, error))
+	if (verify_outbound_live_payload(live_packet, script_packet, error))
 	{
 		non_fatal = true;
 		goto out;
@@ -1210,7 +1447,7 @@ static int verify_outbound_live_packet(
 
 	/* Verify that kernel sent packet at the time the script expected. */
 	DEBUGP("packet time_usecs: %lld\n", live_packet->time_usecs);
-	if (verify_time(state, time_type, script_usecs,
+	if (verify_time(state, time_type, TIMING_OUTBOUND_PACKET, script_usecs,
 	                script_usecs_end, live_packet->time_usecs,
 	                "outbound packet", error))
 	{
@@ -1221,10 +1458,13 @@ static int verify_outbound_live_packet(
 	result = STATUS_OK;
 
 out:
-	add_packet_dump(error, "script", script_packet, script_usecs,
-	                DUMP_SHORT);
-	if (actual_packet != NULL)
+	if (result != STATUS_OK)
 	{
+		struct packet *actual_packet = outbound_actual_packet(
+		        socket, live_packet, script_packet, &mapping);
+
+		add_packet_dump(error, "script", script_packet, script_usecs,
+		                DUMP_SHORT);
 		add_packet_dump(error, "actual", actual_packet, actual_usecs,
 		                DUMP_SHORT);
 		packet_free(actual_packet);
@@ -1251,10 +1491,19 @@ static int sniff_outbound_live_packet(
 	{
 		if (netdev_receive(state->netdev, packet, error))
 			return STATUS_ERR;
-		/* See if the packet matches an existing, known socket. */
+		/* The kernel stamps sniffed packets with wall clock time. */
+		(*packet)->time_usecs =
+			wall_time_to_now_usecs((*packet)->time_usecs);
+		/* See if the packet matches an existing, known socket.
+		 * Packets from sockets other than the socket under test
+		 * or the one we expect, such as retransmits from
+		 * earlier connections, are skipped.
+		 */
 		socket = find_socket_for_live_packet(state, *packet,
 		                                     &direction);
-		if ((socket != NULL) && (direction == DIRECTION_OUTBOUND))
+		if ((socket != NULL) && (direction == DIRECTION_OUTBOUND) &&
+		        ((socket == state->socket_under_test) ||
+		         (socket == expected_socket)))
 			break;
 		/* See if the packet matches a recent connect() call. */
 		socket = find_connect_for_live_packet(state, *packet,
@@ -1326,7 +1575,25 @@ static int find_or_create_socket_for_script_packet(
 		if (*socket != NULL)
 			return STATUS_OK;
 	}
-	/* See if there is an existing connection to handle this packet. */
+	/* See if the packet belongs to one of the connections the script
+	 * has set up, so scripts can interleave packets for many flows.
+	 */
+	if (packet->tcp != NULL || packet->udp != NULL)
+	{
+		enum direction_t socket_direction = DIRECTION_INVALID;
+		struct tuple tuple;
+
+		get_packet_tuple(packet, &tuple);
+		*socket = find_socket_in_index(state->script_socket_index,
+		                               &tuple, &socket_direction);
+		if (*socket != NULL && socket_direction == direction &&
+		        is_script_packet_match_for_socket(state, packet,
+		                                          *socket))
+			return STATUS_OK;
+		*socket = NULL;
+	}
+
+	/* Otherwise the socket under test handles this packet. */
 	if (state->socket_under_test != NULL &&
 	        is_script_packet_match_for_socket(state, packet,
 	                                          state->socket_under_test))
@@ -1419,20 +1686,22 @@ static int send_live_ip_packet(struct netdev *netdev,
 	/* We only do TCP, UDP, and ICMP */
 	assert(packet->tcp || packet->udp || packet->icmpv4 || packet->icmpv6);
 
-	/* Fill in layer 3 and layer 4 checksums */
-	checksum_packet(packet);
+	/* Fill in layer 3 and layer 4 checksums, unless already done. */
+	if (!(packet->flags & FLAG_CHECKSUMS_VALID))
+		checksum_packet(packet);
 
-	return netdev_send(netdev, packet);
+	/* This also notes when the packet left, as best the device can. */
+	return netdev_send_batch(netdev, &packet, 1);
 }
 
-/* Perform the action implied by an inbound packet in a script */
-static int do_inbound_script_packet(
+/* Update the socket state for an inbound packet in a script, and
+ * build the live packet to inject in *live_packet. The caller must
+ * free *live_packet with packet_free(), even on failure.
+ */
+static int prepare_inbound_script_packet(
     struct state *state, struct packet *packet,
-    struct socket *socket,	char **error)
+    struct socket *socket, struct packet **live_packet, char **error)
 {
-	DEBUGP("do_inbound_script_packet\n");
-	int result = STATUS_ERR;	/* return value */
-
 	if ((socket->state == SOCKET_PASSIVE_SYNACK_SENT) &&
 	        packet->tcp && packet->tcp->ack)
 	{
@@ -1448,32 +1717,209 @@ static int do_inbound_script_packet(
 		socket->live.remote_isn		= ntohl(packet->tcp->seq);
 	}
 
+	/* Checksum the script packet once, so that each live copy only
+	 * has to fold in the header fields that mapping rewrites.
+	 */
+	if (!(packet->flags & FLAG_CHECKSUMS_VALID))
+	{
+		checksum_packet(packet);
+		packet->flags |= FLAG_CHECKSUMS_VALID;
+	}
+
 	/* Start with a bit-for-bit copy of the packet from the script. */
-	struct packet *live_packet = packet_copy(packet);
+	*live_packet = packet_copy(packet);
 	/* Map packet fields from script values to live values. */
-	if (map_inbound_packet(socket, live_packet, error))
-		goto out;
-
-	verbose_packet_dump(state, "inbound injected", live_packet,
-	                    live_time_to_script_time_usecs(
-	                        state, now_usecs()));
+	if (map_inbound_packet(socket, *live_packet, error))
+		return STATUS_ERR;
+	checksum_packet_update(*live_packet, packet);
 
-	if (live_packet->tcp)
+	if ((*live_packet)->tcp)
 	{
 		/* Save the TCP header so we can reset the connection later. */
-		socket->last_injected_tcp_header = *(live_packet->tcp);
+		socket->last_injected_tcp_header = *((*live_packet)->tcp);
 		socket->last_injected_tcp_payload_len =
-		    packet_payload_len(live_packet);
+		    packet_payload_len(*live_packet);
 	}
 
+	return STATUS_OK;
+}
+
+/* Perform the action implied by an inbound packet in a script */
+static int do_inbound_script_packet(
+    struct state *state, struct packet *packet,
+    struct socket *socket,	char **error)
+{
+	DEBUGP("do_inbound_script_packet\n");
+	int result = STATUS_ERR;	/* return value */
+	struct packet *live_packet = NULL;
+
+	if (prepare_inbound_script_packet(state, packet, socket,
+	                                  &live_packet, error))
+		goto out;
+
+	/* Don't inject the packet at all if we woke up too late. */
+	check_event_not_late(state, sleep_until_event(state));
+
 	/* Inject live packet into kernel. */
 	result = send_live_ip_packet(state->netdev, live_packet);
+	if (result != STATUS_OK)
+		goto out;
+
+	/* Check and report the time the packet went out, which with
+	 * kernel or NIC timestamps is the time it actually went over
+	 * the wire.
+	 */
+	check_event_time(state, live_packet->time_usecs);
+	verbose_packet_dump(state, "inbound injected", live_packet,
+	                    live_time_to_script_time_usecs(
+	                        state, live_packet->time_usecs));
 
 out:
 	packet_free(live_packet);
 	return result;
 }
 
+/* Return true if 'event' is an inbound packet that the script wants
+ * injected at the same time as the inbound packet event 'prev' just
+ * before it: either at the same absolute time, or at "+0".
+ */
+static bool is_inbound_batch_event(const struct event *prev,
+                                   const struct event *event)
+{
+	if (event->type != PACKET_EVENT ||
+	        packet_direction(event->event.packet) != DIRECTION_INBOUND)
+		return false;
+
+	if (event->time_type == RELATIVE_TIME)
+		return event->time_usecs == 0;
+
+	return (event->time_type == ABSOLUTE_TIME &&
+	        prev->time_type == ABSOLUTE_TIME &&
+	        event->time_usecs == prev->time_usecs);
+}
+
+int inbound_packet_batch_length(const struct event *event)
+{
+	int length = 1;
+
+	if (event->type != PACKET_EVENT ||
+	        packet_direction(event->event.packet) != DIRECTION_INBOUND)
+		return 0;
+
+	while (event->next != NULL &&
+	        is_inbound_batch_event(event, event->next) &&
+	        length < MAX_INBOUND_BATCH_PACKETS)
+	{
+		event = event->next;
+		++length;
+	}
+	return length;
+}
+
+/* Format a complete error message for a failure handling the packet in
+ * the given event.
+ */
+static void packet_event_error(struct state *state, struct event *event,
+                               int result, char *err, char **error)
+{
+#ifdef ECOS
+	{
+		int len = 8 + strlen("::  handling packet: \n") + strlen(state->config->script_path) + strlen(err) + 7;
+		*error = malloc(len);
+		snprintf(*error, len, "too many headers");
+	}
+#else
+	asprintf(error, "%s:%d: %s handling packet: %s\n",
+	         state->config->script_path, event->line_number,
+	         result == STATUS_ERR ? "error" : "warning", err);
+#endif
+	free(err);
+}
+
+int run_inbound_packet_batch(struct state *state, char **error)
+{
+	struct event *event = state->event;
+	const int num_packets = inbound_packet_batch_length(event);
+	struct packet *live_packets[MAX_INBOUND_BATCH_PACKETS];
+	struct socket *socket = NULL;
+	char *err = NULL;
+	int result = STATUS_ERR;
+	int i;
+
+	DEBUGP("%d: batch of %d inbound packets\n",
+	       event->line_number, num_packets);
+	assert(num_packets >= 1);
+	memset(live_packets, 0, sizeof(live_packets));
+
+	/* Do all the per-packet work up front, so that when the time
+	 * comes all we have left to do is hand the packets to the
+	 * kernel, one right after the other.
+	 */
+	for (i = 0; i < num_packets; ++i, event = event->next)
+	{
+		struct packet *packet = event->event.packet;
+
+		if (find_or_create_socket_for_script_packet(
+		            state, packet, DIRECTION_INBOUND, &socket, &err))
+			goto out;
+		if (prepare_inbound_script_packet(state, packet, socket,
+		                                  &live_packets[i], &err))
+			goto out;
+	}
+	event = state->event;
+
+	/* Don't inject any of the packets if we woke up too late. */
+	check_event_not_late(state, sleep_until_event(state));
+
+	/* The tun device takes exactly one packet per write(), so there
+	 * the writes go back to back; a device with a transmit ring
+	 * sends the whole batch with one system call. Either way each
+	 * live packet comes back stamped with the time it was sent.
+	 */
+	if (netdev_send_batch(state->netdev, live_packets, num_packets))
+		goto out;
+
+	/* Now catch up with the bookkeeping for each event. */
+	for (i = 0; i < num_packets; ++i)
+	{
+		const s64 sent_usecs = live_packets[i]->time_usecs;
+
+		if (i > 0)
+		{
+			if (get_next_event(state, &err))
+				goto out;
+			event = state->event;
+			adjust_relative_event_times(state, event);
+			histogram_add(&state->inbound_batch_gaps,
+			              sent_usecs - live_packets[i - 1]->time_usecs);
+		}
+		check_event_time(state, sent_usecs);
+		verbose_packet_dump(state, "inbound injected",
+		                    live_packets[i],
+		                    live_time_to_script_time_usecs(
+		                        state, sent_usecs));
+	}
+
+	if (state->config->verbose)
+	{
+		printf("inbound batch: %d packets in %lld usecs\n",
+		       num_packets,
+		       live_packets[num_packets - 1]->time_usecs -
+		       live_packets[0]->time_usecs);
+	}
+	result = STATUS_OK;
+
+out:
+	for (i = 0; i < num_packets; ++i)
+	{
+		if (live_packets[i] != NULL)
+			packet_free(live_packets[i]);
+	}
+	if (result != STATUS_OK)
+		packet_event_error(state, event, result, err, error);
+	return result;
+}
+
 int run_packet_event(
     struct state *state, struct event *event, struct packet *packet,
     char **error)
@@ -1507,7 +1953,6 @@ int run_packet_event(
 	}
 	else if (direction == DIRECTION_INBOUND)
 	{
-		wait_for_event(state);
 		if (do_inbound_script_packet(state, packet, socket, &err))
 			goto out;
 	}
@@ -1520,18 +1965,7 @@ int run_packet_event(
 
 out:
 	/* Format a more complete error message and return that. */
-#ifdef ECOS
-	{
-		int len = 8 + strlen("::  handling packet: \n") + strlen(state->config->script_path) + strlen(err) + 7;
-		*error = malloc(len);
-		snprintf(*error, len, "too many headers");
-	}
-#else
-	asprintf(error, "%s:%d: %s handling packet: %s\n",
-	         state->config->script_path, event->line_number,
-	         result == STATUS_ERR ? "error" : "warning", err);
-#endif
-	free(err);
+	packet_event_error(state, event, result, err, error);
 	return result;
 }
 
@@ -54,6 +54,35 @@ extern int run_packet_event(struct state *state,
 			    struct packet *packet,
 			    char **error);
 
+/* The most inbound packets we inject in one batch. */
+#define MAX_INBOUND_BATCH_PACKETS	64
+
+/* Return how many inbound packet events, starting with the given one,
+ * the script wants injected at the same moment: the given event plus
+ * any directly following inbound packet events at the same absolute
+ * time or at "+0". Returns 0 if the event is not an inbound packet.
+ */
+extern int inbound_packet_batch_length(const struct event *event);
+
+/* Execute the inbound packet event state->event together with the
+ * rest of its batch (see inbound_packet_batch_length()). All packets
+ * are mapped and checksummed before we wait for the event time, and
+ * then injected back to back. On return state->event is the last
+ * event of the batch. On success, return STATUS_OK; on error return
+ * STATUS_ERR and fill in a malloc-allocated error message in *error.
+ */
+extern int run_inbound_packet_batch(struct state *state, char **error);
+
+/* Once both ends of a socket's script and/or live 4-tuples are known,
+ * add the socket to the corresponding index so packets can find it.
+ */
+extern void index_socket(struct state *state, struct socket *socket);
+
+/* Remove the socket from the indexes, before its 4-tuples change or
+ * once it is closed, so packets with its old tuples no longer find it.
+ */
+extern void unindex_socket(struct state *state, struct socket *socket);
+
 /* Inject a TCP RST packet to clear the connection state out of the kernel. */
 extern int reset_connection(struct state *state,
 			    struct socket *socket);
@@ -72,57 +72,53 @@ static pid_t gettid(void)
 #endif /* defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)*/
 }
 
-/* Read a whole file into the given buffer of the given length. */
-static void read_whole_file(const char *path, char *buffer, int max_bytes)
+/* Open the /proc stat file of the given thread. We keep this open for
+ * the life of the thread, so that checking its scheduler state while
+ * a blocking system call is pending takes a single pread() instead of
+ * an open(), read() and close() plus heap allocations every time.
+ */
+static int open_thread_stat(pid_t process_id, pid_t thread_id)
 {
-	int fd = open(path, O_RDONLY);
+	char proc_path[64];
+	int fd;
+
+	snprintf(proc_path, sizeof(proc_path), "/proc/%d/task/%d/stat",
+	         process_id, thread_id);
+	fd = open(proc_path, O_RDONLY);
 	if (fd < 0)
 		die_perror("open");
-
-	int bytes = read(fd, buffer, max_bytes);
-	if (bytes < 0)
-		die_perror("read");
-	else if (bytes == max_bytes)
-		die("%s file too large to read\n", path);
-
-	if (close(fd) < 0)
-		die_perror("close");
+	return fd;
 }
 
-/* Return true iff the given thread is sleeping. */
-static bool is_thread_sleeping(pid_t process_id, pid_t thread_id)
+/* Return true iff the thread whose stat file is open as stat_fd is
+ * sleeping. Reading from offset 0 makes the kernel render the file
+ * afresh, so one fd serves every check.
+ */
+static bool is_thread_sleeping(int stat_fd)
 {
-	/* Read the entire thread state file, using the buffer size ps uses. */
-	char *proc_path = NULL;
+	/* The state follows "<pid> (<comm>) ", and comm is at most
+	 * 16 bytes, so the start of the file is all we need.
+	 */
+	char stat[64];
 #ifdef ECOS
-	int len = strlen("/proc//task//stat") + 16;
-	proc_path = malloc(len);
-	snprintf(proc_path, len, "/proc/%d/task/%d/stat", process_id, thread_id);
+	int bytes = -1;
+	if (lseek(stat_fd, 0, SEEK_SET) == 0)
+		bytes = read(stat_fd, stat, sizeof(stat) - 1);
 #else
-	asprintf(&proc_path, "/proc/%d/task/%d/stat", process_id, thread_id);
+	int bytes = pread(stat_fd, stat, sizeof(stat) - 1, 0);
 #endif
-	const int STATE_BUFFER_BYTES = 1023;
-	char *state = calloc(STATE_BUFFER_BYTES, 1);
-	read_whole_file(proc_path, state, STATE_BUFFER_BYTES - 1);
-	state[STATE_BUFFER_BYTES - 1] = '\0';
-
-	/* Parse the thread state from the third space-delimited field. */
-	const int THREAD_STATE_INDEX = 3;
-	const char *field = state;
-	int i = 0;
-	for (i = 0; i < THREAD_STATE_INDEX - 1; i++)
-	{
-		field = strchr(field, ' ');
-		if (field == NULL)
-			die("unable to parse %s\n", proc_path);
-		++field;
-	}
-	bool is_sleeping = (field[0] == 'S');
+	if (bytes < 0)
+		die_perror("read");
+	stat[bytes] = '\0';
 
-	free(proc_path);
-	free(state);
+	/* The command name may itself contain spaces or parentheses, so
+	 * find the state after the last closing parenthesis.
+	 */
+	const char *field = strrchr(stat, ')');
+	if (field == NULL || field[1] != ' ')
+		die("unable to parse thread stat: '%s'\n", stat);
 
-	return is_sleeping;
+	return field[2] == 'S';
 }
 
 /* Returns number of expressions in the list. */
@@ -577,6 +573,82 @@ static int pollfds_check(struct expression *fds_expression,
 	return STATUS_OK;
 }
 
+/* Return the syscall thread we are running on. Only valid when called
+ * from a syscall thread.
+ */
+static struct syscall_thread *current_syscall_thread(struct state *state)
+{
+	struct syscalls *syscalls = state->syscalls;
+	pthread_t self = pthread_self();
+	int i;
+
+	for (i = 0; i < syscalls->num_threads; ++i)
+	{
+		if (pthread_equal(syscalls->threads[i].thread, self))
+			return &syscalls->threads[i];
+	}
+	assert(!"not called on a syscall thread");
+	return NULL;
+}
+
+/* The kinds of data buffer a system call may need. */
+enum syscall_buffer_t
+{
+	BUFFER_NONE,		/* no data buffer */
+	BUFFER_READ,		/* scratch space to receive data */
+	BUFFER_WRITE,		/* zeroed data to send */
+};
+
+/* Return the calling thread's data buffers: blocking calls run on a
+ * syscall thread and all others on the main thread.
+ */
+static struct syscall_buffers *thread_buffers(struct state *state,
+                                              struct syscall_spec *syscall)
+{
+	if (is_blocking_syscall(syscall))
+		return &current_syscall_thread(state)->buffers;
+	return &state->syscalls->main_buffers;
+}
+
+/* Return a data buffer of the given type holding at least count bytes,
+ * growing the calling thread's buffer if need be.
+ */
+static char *syscall_buffer(struct state *state, struct syscall_spec *syscall,
+                            enum syscall_buffer_t type, int count)
+{
+	struct syscall_buffers *buffers = thread_buffers(state, syscall);
+
+	assert(count >= 0);
+	if (type == BUFFER_READ)
+	{
+		if (count > buffers->read_bytes)
+		{
+			free(buffers->read_buf);
+			buffers->read_buf = malloc(count);
+			assert(buffers->read_buf != NULL);
+			buffers->read_bytes = count;
+		}
+		return buffers->read_buf;
+	}
+
+	assert(type == BUFFER_WRITE);
+	if (count > buffers->zero_bytes)
+	{
+		free(buffers->zero_buf);
+		buffers->zero_buf = calloc(count, 1);
+		assert(buffers->zero_buf != NULL);
+		buffers->zero_bytes = count;
+	}
+	return buffers->zero_buf;
+}
+
+static void free_syscall_buffers(struct syscall_buffers *buffers)
+{
+	free(buffers->read_buf);
+	free(buffers->zero_buf);
+	memset(buffers, 0, sizeof(*buffers));
+}
+
 /* For blocking system calls, give up the global lock and wake the
  * main thread so it can continue test execution. Callers should call
  * this function immediately before calling a system call in order to
@@ -587,12 +659,14 @@ static void begin_syscall(struct state *state, struct syscall_spec *syscall)
 {
 	if (is_blocking_syscall(syscall))
 	{
-		assert(state->syscalls->state == SYSCALL_ENQUEUED);
-		state->syscalls->state = SYSCALL_RUNNING;
+		struct syscall_thread *thread = current_syscall_thread(state);
+
+		assert(thread->state == SYSCALL_ENQUEUED);
+		thread->state = SYSCALL_RUNNING;
 		run_unlock(state);
 		DEBUGP("syscall thread: begin_syscall signals dequeued\n");
-		if (pthread_cond_signal(&state->syscalls->dequeued) != 0)
-			die_perror("pthread_cond_signal");
+		if (pthread_cond_broadcast(&state->syscalls->dequeued) != 0)
+			die_perror("pthread_cond_broadcast");
 	}
 }
 
@@ -619,9 +693,10 @@ static int end_syscall(struct state *state, struct syscall_spec *syscall,
 		s64 live_end_usecs = now_usecs();
 		DEBUGP("syscall thread: end_syscall grabs lock\n");
 		run_lock(state);
-		state->syscalls->live_end_usecs = live_end_usecs;
-		assert(state->syscalls->state == SYSCALL_RUNNING);
-		state->syscalls->state = SYSCALL_DONE;
+		struct syscall_thread *thread = current_syscall_thread(state);
+		thread->live_end_usecs = live_end_usecs;
+		assert(thread->state == SYSCALL_RUNNING);
+		thread->state = SYSCALL_DONE;
 	}
 
 	/* Compare actual vs expected return value */
@@ -868,6 +943,10 @@ static int run_syscall_close(struct state *state, int script_fd,
 	if ((socket == NULL) || (socket->live.fd != live_fd))
 		goto error_out;
 
+	/* Packets the kernel still sends for this flow are left to the
+	 * socket under test, as they were before sockets were indexed.
+	 */
+	unindex_socket(state, socket);
 	socket->is_closed = true;
 	return STATUS_OK;
 
@@ -1277,17 +1356,13 @@ static int syscall_read(struct state *state, struct syscall_spec *syscall,
 		return STATUS_ERR;
 	if (s32_arg(args, 2, &count, error))
 		return STATUS_ERR;
-	buf = malloc(count);
-	assert(buf != NULL);
+	buf = syscall_buffer(state, syscall, BUFFER_READ, count);
 
 	begin_syscall(state, syscall);
 
 	result = read(live_fd, buf, count);
 
-	int status = end_syscall(state, syscall, CHECK_EXACT, result, error);
-
-	free(buf);
-	return status;
+	return end_syscall(state, syscall, CHECK_EXACT, result, error);
 }
 
 static int syscall_readv(struct state *state, struct syscall_spec *syscall,
@@ -1359,17 +1434,13 @@ static int syscall_recv(struct state *state, struct syscall_spec *syscall,
 		return STATUS_ERR;
 	if (s32_arg(args, 3, &flags, error))
 		return STATUS_ERR;
-	buf = malloc(count);
-	assert(buf != NULL);
+	buf = syscall_buffer(state, syscall, BUFFER_READ, count);
 
 	begin_syscall(state, syscall);
 
 	result = recv(live_fd, buf, count, flags);
 
-	int status = end_syscall(state, syscall, CHECK_EXACT, result, error);
-
-	free(buf);
-	return status;
+	return end_syscall(state, syscall, CHECK_EXACT, result, error);
 }
 
 static int syscall_recvfrom(struct state *state, struct syscall_spec *syscall,
@@ -1395,18 +1466,14 @@ static int syscall_recvfrom(struct state *state, struct syscall_spec *syscall,
 		return STATUS_ERR;
 	if (ellipsis_arg(args, 5, error))
 		return STATUS_ERR;
-	buf = malloc(count);
-	assert(buf != NULL);
+	buf = syscall_buffer(state, syscall, BUFFER_READ, count);
 
 	begin_syscall(state, syscall);
 
 	result = recvfrom(live_fd, buf, count, flags,
 	                  (struct sockaddr *)&live_addr, &live_addrlen);
 
-	int status = end_syscall(state, syscall, CHECK_EXACT, result, error);
-
-	free(buf);
-	return status;
+	return end_syscall(state, syscall, CHECK_EXACT, result, error);
 }
 
 static int syscall_recvmsg(struct state *state, struct syscall_spec *syscall,
@@ -1480,17 +1547,13 @@ static int syscall_write(struct state *state, struct syscall_spec *syscall,
 		return STATUS_ERR;
 	if (s32_arg(args, 2, &count, error))
 		return STATUS_ERR;
-	buf = calloc(count, 1);
-	assert(buf != NULL);
+	buf = syscall_buffer(state, syscall, BUFFER_WRITE, count);
 
 	begin_syscall(state, syscall);
 
 	result = write(live_fd, buf, count);
 
-	int status = end_syscall(state, syscall, CHECK_EXACT, result, error);
-
-	free(buf);
-	return status;
+	return end_syscall(state, syscall, CHECK_EXACT, result, error);
 }
 
 static int syscall_writev(struct state *state, struct syscall_spec *syscall,
@@ -1562,17 +1625,13 @@ static int syscall_send(struct state *state, struct syscall_spec *syscall,
 		return STATUS_ERR;
 	if (s32_arg(args, 3, &flags, error))
 		return STATUS_ERR;
-	buf = calloc(count, 1);
-	assert(buf != NULL);
+	buf = syscall_buffer(state, syscall, BUFFER_WRITE, count);
 
 	begin_syscall(state, syscall);
 
 	result = send(live_fd, buf, count, flags);
 
-	int status = end_syscall(state, syscall, CHECK_EXACT, result, error);
-
-	free(buf);
-	return status;
+	return end_syscall(state, syscall, CHECK_EXACT, result, error);
 }
 
 static int syscall_sendto(struct state *state, struct syscall_spec *syscall,
@@ -1604,18 +1663,14 @@ static int syscall_sendto(struct state *state, struct syscall_spec *syscall,
 	            (struct sockaddr *)&live_addr, &live_addrlen, error))
 		return STATUS_ERR;
 
-	buf = calloc(count, 1);
-	assert(buf != NULL);
+	buf = syscall_buffer(state, syscall, BUFFER_WRITE, count);
 
 	begin_syscall(state, syscall);
 
 	result = sendto(live_fd, buf, count, flags,
 	                (struct sockaddr *)&live_addr, live_addrlen);
 
-	int status = end_syscall(state, syscall, CHECK_EXACT, result, error);
-
-	free(buf);
-	return status;
+	return end_syscall(state, syscall, CHECK_EXACT, result, error);
 }
 
 static int syscall_sendmsg(struct state *state, struct syscall_spec *syscall,
@@ -2115,6 +2170,7 @@ struct system_call_entry
 	                 struct syscall_spec *syscall,
 	                 struct expression_list *args,
 	                 char **error);
+	enum syscall_buffer_t buffer;	/* data buffer sized by arg 2 */
 };
 struct system_call_entry system_call_table[] =
 {
@@ -2123,15 +2179,15 @@ struct system_call_entry system_call_table[] =
 	{"listen",     syscall_listen},
 	{"accept",     syscall_accept},
 	{"connect",    syscall_connect},
-	{"read",       syscall_read},
+	{"read",       syscall_read, BUFFER_READ},
 	{"readv",      syscall_readv},
-	{"recv",       syscall_recv},
-	{"recvfrom",   syscall_recvfrom},
+	{"recv",       syscall_recv, BUFFER_READ},
+	{"recvfrom",   syscall_recvfrom, BUFFER_READ},
 	{"recvmsg",    syscall_recvmsg},
-	{"write",      syscall_write},
+	{"write",      syscall_write, BUFFER_WRITE},
 	{"writev",     syscall_writev},
-	{"send",       syscall_send},
-	{"sendto",     syscall_sendto},
+	{"send",       syscall_send, BUFFER_WRITE},
+	{"sendto",     syscall_sendto, BUFFER_WRITE},
 	{"sendmsg",    syscall_sendmsg},
 	{"fcntl",      syscall_fcntl},
 	{"ioctl",      syscall_ioctl},
@@ -2155,11 +2211,13 @@ static void invoke_system_call(
 	struct expression_list *args = NULL;
 	int i = 0;
 	int result = 0;
+	s32 count = 0;
 
-	/* Wait for the right time before firing off this event. */
-	wait_for_event(state);
-
-	/* Find and invoke the handler for this system call. */
+	/* Find the handler, evaluate the script's symbolic expressions
+	 * to get live numeric args, and size the call's data buffer, all
+	 * before waiting for the event's time, so that none of this work
+	 * delays the system call itself.
+	 */
 	for (i = 0; i < ARRAY_SIZE(system_call_table); ++i)
 		if (strcmp(name, system_call_table[i].name) == 0)
 			break;
@@ -2175,12 +2233,22 @@ static void invoke_system_call(
 		goto error_out;
 	}
 
-	/* Evaluate script symbolic expressions to get live numeric args for
-	 * system calls.
-	 */
 	if (evaluate_expression_list(syscall->arguments, &args, &error))
 		goto error_out;
 
+	/* If the count is bad, the handler will report it. */
+	if (system_call_table[i].buffer != BUFFER_NONE &&
+	        s32_arg(args, 2, &count, &error) == STATUS_OK && count >= 0)
+	{
+		syscall_buffer(state, syscall, system_call_table[i].buffer,
+		               count);
+	}
+	free(error);
+	error = NULL;
+
+	/* Wait for the right time before firing off this event. */
+	wait_for_event(state);
+
 	/* Run the system call. */
 	result = system_call_table[i].function(state, syscall, args, &error);
 
@@ -2197,32 +2265,101 @@ error_out:
 	free(error);
 }
 
-/* Wait for the system call thread to go idle. To avoid mystifying
- * hangs when scripts specify overlapping time ranges for blocking
- * system calls, we limit the duration of our waiting to 1 second.
+/* Wait for a syscall thread to signal that it went idle, or for the
+ * given deadline to pass, computing the deadline on the first call.
+ * Returns STATUS_ERR if the deadline passed.
  */
-static int await_idle_thread(struct state *state)
+static int await_idle_signal(struct state *state, struct timespec *end_time)
 {
-	struct timespec end_time = { .tv_sec = 0, .tv_nsec = 0 };
 	const int MAX_WAIT_SECS = 1;
-	while (state->syscalls->state != SYSCALL_IDLE)
+
+	/* On the first time through the loop, calculate end time. */
+	if (end_time->tv_sec == 0)
 	{
-		/* On the first time through the loop, calculate end time. */
-		if (end_time.tv_sec == 0)
+		if (clock_gettime(CLOCK_REALTIME, end_time) != 0)
+			die_perror("clock_gettime");
+		end_time->tv_sec += MAX_WAIT_SECS;
+	}
+	/* Wait for a signal or our timeout end_time to arrive. */
+	int status = pthread_cond_timedwait(&state->syscalls->idle,
+	                                    &state->mutex, end_time);
+	if (status == ETIMEDOUT)
+		return STATUS_ERR;
+	else if (status != 0)
+		die_perror("pthread_cond_timedwait");
+	return STATUS_OK;
+}
+
+static void start_syscall_thread(struct state *state,
+                                 struct syscall_thread *thread);
+
+/* Return an idle syscall thread, starting a new one if all the
+ * existing ones are busy and the pool has room, or NULL if there is
+ * no idle thread.
+ */
+static struct syscall_thread *find_idle_thread(struct state *state)
+{
+	struct syscalls *syscalls = state->syscalls;
+	struct syscall_thread *thread = NULL;
+	int i;
+
+	for (i = 0; i < syscalls->num_threads; ++i)
+	{
+		if (syscalls->threads[i].state == SYSCALL_IDLE)
+			return &syscalls->threads[i];
+	}
+
+	if (syscalls->num_threads == MAX_SYSCALL_THREADS)
+		return NULL;
+
+	thread = &syscalls->threads[syscalls->num_threads++];
+	start_syscall_thread(state, thread);
+	return thread;
+}
+
+/* Wait for a syscall thread to be available for a new blocking call.
+ * To avoid mystifying hangs when scripts specify overlapping time
+ * ranges for more blocking system calls than we have threads, we
+ * limit the duration of our waiting to 1 second.
+ */
+static int await_idle_thread(struct state *state,
+                             struct syscall_thread **thread)
+{
+	struct timespec end_time = { .tv_sec = 0, .tv_nsec = 0 };
+
+	while ((*thread = find_idle_thread(state)) == NULL)
+	{
+		DEBUGP("main thread: awaiting idle syscall thread\n");
+		if (await_idle_signal(state, &end_time))
+			return STATUS_ERR;
+	}
+	return STATUS_OK;
+}
+
+/* Wait, for at most 1 second, for all syscall threads to go idle. On
+ * timeout, returns STATUS_ERR and sets *busy to a thread that is
+ * still running a blocking call.
+ */
+static int await_all_threads_idle(struct state *state,
+                                  struct syscall_thread **busy)
+{
+	struct syscalls *syscalls = state->syscalls;
+	struct timespec end_time = { .tv_sec = 0, .tv_nsec = 0 };
+	int i = 0;
+
+	while (i < syscalls->num_threads)
+	{
+		*busy = &syscalls->threads[i];
+		if ((*busy)->state == SYSCALL_IDLE)
 		{
-			if (clock_gettime(CLOCK_REALTIME, &end_time) != 0)
-				die_perror("clock_gettime");
-			end_time.tv_sec += MAX_WAIT_SECS;
+			++i;
+			continue;
 		}
-		/* Wait for a signal or our timeout end_time to arrive. */
-		DEBUGP("main thread: awaiting idle syscall thread\n");
-		int status = pthread_cond_timedwait(&state->syscalls->idle,
-		                                    &state->mutex, &end_time);
-		if (status == ETIMEDOUT)
+		DEBUGP("main thread: awaiting idle syscall thread %d\n", i);
+		if (await_idle_signal(state, &end_time))
 			return STATUS_ERR;
-		else if (status != 0)
-			die_perror("pthread_cond_timedwait");
 	}
+	*busy = NULL;
 	return STATUS_OK;
 }
 
@@ -2241,40 +2378,46 @@ static int yield(void)
 #endif  /* defined(__NetBSD__) */
 }
 
-/* Enqueue the system call for the syscall thread and wake up the thread. */
+/* Enqueue the system call for an idle syscall thread and wake up the
+ * thread.
+ */
 static void enqueue_system_call(
     struct state *state, struct event *event, struct syscall_spec *syscall)
 {
+	struct syscall_thread *thread = NULL;
 	char *error = NULL;
 	bool done = false;
 
-	/* Wait if there are back-to-back blocking system calls. */
-	if (await_idle_thread(state))
+	/* Wait if all syscall threads are busy with blocking calls. */
+	if (await_idle_thread(state, &thread))
 	{
 
 #ifdef ECOS
-		int len = strlen("blocking system call while another blocking ") + strlen("system call is already in progress");
+		int len = strlen("blocking system call while  other blocking ") + strlen("system calls are already in progress") + 8;
 		error = malloc(len);
-		snprintf(error, len, "blocking system call while another blocking "
-		         "system call is already in progress");
+		snprintf(error, len, "blocking system call while %d other blocking "
+		         "system calls are already in progress",
+		         MAX_SYSCALL_THREADS);
 #else
-		asprintf(&error, "blocking system call while another blocking "
-		         "system call is already in progress");
+		asprintf(&error, "blocking system call while %d other blocking "
+		         "system calls are already in progress",
+		         MAX_SYSCALL_THREADS);
 #endif
 		goto error_out;
 	}
 
 	/* Enqueue the system call info and wake up the syscall thread. */
 	DEBUGP("main thread: signal enqueued\n");
-	state->syscalls->state = SYSCALL_ENQUEUED;
-	if (pthread_cond_signal(&state->syscalls->enqueued) != 0)
+	thread->event = event;
+	thread->state = SYSCALL_ENQUEUED;
+	if (pthread_cond_signal(&thread->enqueued) != 0)
 		die_perror("pthread_cond_signal");
 
 	/* Wait for the syscall thread to dequeue and start the system call. */
-	while (state->syscalls->state == SYSCALL_ENQUEUED)
+	while (thread->state == SYSCALL_ENQUEUED)
 	{
 		DEBUGP("main thread: waiting for dequeued signal; "
-		       "state: %d\n", state->syscalls->state);
+		       "state: %d\n", thread->state);
 		if (pthread_cond_wait(&state->syscalls->dequeued,
 		                      &state->mutex) != 0)
 		{
@@ -2283,27 +2426,30 @@ static void enqueue_system_call(
 	}
 
 	/* Wait for the syscall thread to block or finish the call. */
+	s64 dequeued_usecs = now_usecs();
 	while (!done)
 	{
 		/* Unlock and yield so the system call thread can make
 		 * the system call in a timely fashion.
 		 */
 		DEBUGP("main thread: unlocking and yielding\n");
-		pid_t thread_id = state->syscalls->thread_id;
+		int stat_fd = thread->thread_stat_fd;
 		run_unlock(state);
 		if (yield() != 0)
 			die_perror("yield");
 
 		DEBUGP("main thread: checking syscall thread state\n");
-		if (is_thread_sleeping(getpid(), thread_id))
+		if (is_thread_sleeping(stat_fd))
 			done = true;
 
 		/* Grab the lock again and see if the thread is idle. */
 		DEBUGP("main thread: locking and reading state\n");
 		run_lock(state);
-		if (state->syscalls->state == SYSCALL_IDLE)
+		if (thread->state == SYSCALL_IDLE)
 			done = true;
 	}
+	histogram_add(&state->syscall_block_detect,
+	              now_usecs() - dequeued_usecs);
 	DEBUGP("main thread: continuing after syscall\n");
 	return;
 
@@ -2325,12 +2471,13 @@ void run_system_call_event(
 		invoke_system_call(state, event, syscall);
 }
 
-/* The code executed by our system call thread, which executes
+/* The code executed by each of our system call threads, which execute
  * blocking system calls.
  */
 static void *system_call_thread(void *arg)
 {
-	struct state *state = (struct state *)arg;
+	struct syscall_thread *thread = (struct syscall_thread *)arg;
+	struct state *state = thread->run_state;
 	char *error = NULL;
 	struct event *event = NULL;
 	struct syscall_spec *syscall = NULL;
@@ -2339,20 +2486,20 @@ static void *system_call_thread(void *arg)
 	DEBUGP("syscall thread: starting and locking\n");
 	run_lock(state);
 
-	state->syscalls->thread_id = gettid();
-	if (state->syscalls->thread_id < 0)
+	thread->thread_id = gettid();
+	if (thread->thread_id < 0)
 		die_perror("gettid");
+	thread->thread_stat_fd = open_thread_stat(getpid(), thread->thread_id);
 
 	while (!done)
 	{
-		DEBUGP("syscall thread: in state %d\n",
-		       state->syscalls->state);
+		DEBUGP("syscall thread: in state %d\n", thread->state);
 
-		switch (state->syscalls->state)
+		switch (thread->state)
 		{
 		case SYSCALL_IDLE:
 			DEBUGP("syscall thread: waiting\n");
-			if (pthread_cond_wait(&state->syscalls->enqueued,
+			if (pthread_cond_wait(&thread->enqueued,
 			                      &state->mutex))
 			{
 				die_perror("pthread_cond_wait");
@@ -2366,15 +2513,14 @@ static void *system_call_thread(void *arg)
 
 		case SYSCALL_ENQUEUED:
 			DEBUGP("syscall thread: invoking syscall\n");
-			/* Remember the syscall event, since below we
-			 * release the global lock and the main thread
-			 * will move on to other, later events.
+			/* The main thread handed us the syscall event,
+			 * since below we release the global lock and the
+			 * main thread will move on to other, later events.
 			 */
-			event = state->event;
+			event = thread->event;
 			syscall = event->event.syscall;
 			assert(event->type == SYSCALL_EVENT);
-			state->syscalls->event = event;
-			state->syscalls->live_end_usecs = -1;
+			thread->live_end_usecs = -1;
 
 			/* Make the system call. Note that our callees
 			 * here will release the global lock before
@@ -2385,11 +2531,12 @@ static void *system_call_thread(void *arg)
 			invoke_system_call(state, event, syscall);
 
 			/* Check end time for the blocking system call. */
-			assert(state->syscalls->live_end_usecs >= 0);
+			assert(thread->live_end_usecs >= 0);
 			if (verify_time(state,
 			                event->time_type,
+			                TIMING_SYSCALL_RETURN,
 			                syscall->end_usecs, 0,
-			                state->syscalls->live_end_usecs,
+			                thread->live_end_usecs,
 			                "system call return", &error))
 			{
 				die("%s:%d: %s\n",
@@ -2402,13 +2549,13 @@ static void *system_call_thread(void *arg)
 			 * thread if it's waiting for this call to
 			 * finish.
 			 */
-			assert(state->syscalls->state == SYSCALL_DONE);
-			state->syscalls->state = SYSCALL_IDLE;
-			state->syscalls->event = NULL;
-			state->syscalls->live_end_usecs = -1;
+			assert(thread->state == SYSCALL_DONE);
+			thread->state = SYSCALL_IDLE;
+			thread->event = NULL;
+			thread->live_end_usecs = -1;
 			DEBUGP("syscall thread: now idle\n");
-			if (pthread_cond_signal(&state->syscalls->idle) != 0)
-				die_perror("pthread_cond_signal");
+			if (pthread_cond_broadcast(&state->syscalls->idle) != 0)
+				die_perror("pthread_cond_broadcast");
 			break;
 
 		case SYSCALL_EXITING:
@@ -2423,56 +2570,93 @@ static void *system_call_thread(void *arg)
 	return NULL;
 }
 
-struct syscalls *syscalls_new(struct state *state)
+/* Start the given syscall thread. Called with the global lock held. */
+static void start_syscall_thread(struct state *state,
+                                 struct syscall_thread *thread)
 {
-	struct syscalls *syscalls = calloc(1, sizeof(struct syscalls));
+	thread->run_state = state;
+	thread->state = SYSCALL_IDLE;
+	thread->thread_stat_fd = -1;
 
-	syscalls->state = SYSCALL_IDLE;
+	if (pthread_cond_init(&thread->enqueued, NULL) != 0)
+		die_perror("pthread_cond_init");
 
-	if (pthread_create(&syscalls->thread, NULL, system_call_thread,
-	                   state) != 0)
+	if (pthread_create(&thread->thread, NULL, system_call_thread,
+	                   thread) != 0)
 	{
 		die_perror("pthread_create");
 	}
+}
+
+struct syscalls *syscalls_new(struct state *state)
+{
+	struct syscalls *syscalls = calloc(1, sizeof(struct syscalls));
 
 	if ((pthread_cond_init(&syscalls->idle, NULL) != 0) ||
-	        (pthread_cond_init(&syscalls->enqueued, NULL) != 0) ||
 	        (pthread_cond_init(&syscalls->dequeued, NULL) != 0))
 	{
 		die_perror("pthread_cond_init");
 	}
 
+	/* Start one thread up front, so that the first blocking call
+	 * does not pay for creating it. The rest start on demand.
+	 */
+	syscalls->num_threads = 1;
+	start_syscall_thread(state, &syscalls->threads[0]);
+
 	return syscalls;
 }
 
 void syscalls_free(struct state *state, struct syscalls *syscalls)
 {
-	/* Wait a bit for the thread to go idle. */
-	if (await_idle_thread(state))
+	struct syscall_thread *busy = NULL;
+	int i;
+
+	/* Wait a bit for the threads to go idle. */
+	if (await_all_threads_idle(state, &busy))
 	{
 		die("%s:%d: runtime error: exiting while "
 		    "a blocking system call is in progress\n",
 		    state->config->script_path,
-		    syscalls->event->line_number);
+		    busy->event->line_number);
 	}
 
-	/* Send a request to terminate the thread. */
-	DEBUGP("main thread: signaling syscall thread to exit\n");
-	syscalls->state = SYSCALL_EXITING;
-	if (pthread_cond_signal(&syscalls->enqueued) != 0)
-		die_perror("pthread_cond_signal");
+	/* Send a request to terminate each thread. */
+	DEBUGP("main thread: signaling syscall threads to exit\n");
+	for (i = 0; i < syscalls->num_threads; ++i)
+	{
+		syscalls->threads[i].state = SYSCALL_EXITING;
+		if (pthread_cond_signal(&syscalls->threads[i].enqueued) != 0)
+			die_perror("pthread_cond_signal");
+	}
 
-	/* Release the lock briefly and wait for syscall thread to finish. */
+	/* Release the lock briefly and wait for syscall threads to finish. */
 	run_unlock(state);
 	DEBUGP("main thread: unlocking, waiting for syscall thread exit\n");
-	void *thread_result = NULL;
-	if (pthread_join(syscalls->thread, &thread_result) != 0)
-		die_perror("pthread_cancel");
-	DEBUGP("main thread: joined syscall thread; relocking\n");
+	for (i = 0; i < syscalls->num_threads; ++i)
+	{
+		void *thread_result = NULL;
+		if (pthread_join(syscalls->threads[i].thread,
+		                 &thread_result) != 0)
+			die_perror("pthread_join");
+	}
+	DEBUGP("main thread: joined syscall threads; relocking\n");
 	run_lock(state);
 
+	for (i = 0; i < syscalls->num_threads; ++i)
+	{
+		struct syscall_thread *thread = &syscalls->threads[i];
+
+		if (thread->thread_stat_fd >= 0 &&
+		        close(thread->thread_stat_fd) < 0)
+			die_perror("close");
+		if (pthread_cond_destroy(&thread->enqueued) != 0)
+			die_perror("pthread_cond_destroy");
+		free_syscall_buffers(&thread->buffers);
+	}
+	free_syscall_buffers(&syscalls->main_buffers);
+
 	if ((pthread_cond_destroy(&syscalls->idle) != 0) ||
-	        (pthread_cond_destroy(&syscalls->enqueued) != 0) ||
 	        (pthread_cond_destroy(&syscalls->dequeued) != 0))
 	{
 		die_perror("pthread_cond_destroy");
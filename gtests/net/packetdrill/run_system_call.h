@@ -32,7 +32,12 @@
 
 struct state;
 
-/* States in which the system call thread can be. */
+/* Maximum number of blocking system calls that may be in progress at
+ * once; each one runs on its own syscall thread.
+ */
+#define MAX_SYSCALL_THREADS 16
+
+/* States in which a system call thread can be. */
 enum syscall_state_t {
 	SYSCALL_IDLE,		/* system call thread is idle */
 	SYSCALL_ENQUEUED,	/* blocking system call is ready to execute */
@@ -41,37 +46,63 @@ enum syscall_state_t {
 	SYSCALL_EXITING,	/* process is exiting */
 };
 
-/* Internal state for the system call module, including the "syscall
- * thread", which handles blocking system calls.
+/* Data buffers for read-like and write-like system calls, owned by the
+ * thread making the calls. They only grow, so once they are big enough
+ * no allocation happens between a call's scheduled time and the call.
  */
-struct syscalls {
+struct syscall_buffers {
+	char *read_buf;			/* scratch space to read into */
+	int read_bytes;			/* allocated size of read_buf */
+	char *zero_buf;			/* all-zero data to write */
+	int zero_bytes;			/* allocated size of zero_buf */
+};
+
+/* A "syscall thread", which executes one blocking system call at a
+ * time on behalf of the main thread.
+ */
+struct syscall_thread {
+	struct state *run_state;	/* global state, for the thread */
 	enum syscall_state_t state;	/* current state of syscall thread */
 	struct event *event;		/* current system call it's running */
 	s64 live_end_usecs;		/* time of last system call return */
 
-	/* Handles for the syscall thread, for blocking system calls. */
+	/* Handles for the syscall thread. */
 	pthread_t thread;		/* pthread thread handle */
 	pid_t thread_id;		/* kernel thread ID  */
-
-	/* The main thread waits on this condition variable. The
-	 * system call thread signals this when it has finished
-	 * executing a blocking system call and is now idle and ready
-	 * to execute another blocking system call.
-	 */
-	pthread_cond_t idle;
+	int thread_stat_fd;		/* its /proc/.../stat file, or -1 */
+	struct syscall_buffers buffers;	/* for its blocking calls */
 
 	/* The system call thread waits on this condition
 	 * variable. The main thread signals this when it has enqueued
-	 * a blocking system call to execute, and thus the system call
-	 * thread should wake up and execute that system call. The
-	 * main thread also signals this when it's time to exit.
+	 * a blocking system call for this thread to execute, and thus
+	 * the system call thread should wake up and execute that
+	 * system call. The main thread also signals this when it's
+	 * time to exit.
 	 */
 	pthread_cond_t enqueued;
+};
+
+/* Internal state for the system call module, including the pool of
+ * syscall threads, which handle blocking system calls. Threads are
+ * started on demand, when a blocking call finds all existing threads
+ * busy with earlier blocking calls.
+ */
+struct syscalls {
+	struct syscall_thread threads[MAX_SYSCALL_THREADS];
+	int num_threads;		/* number of threads started */
+	struct syscall_buffers main_buffers;	/* for non-blocking calls */
+
+	/* The main thread waits on this condition variable. A system
+	 * call thread signals this when it has finished executing a
+	 * blocking system call and is now idle and ready to execute
+	 * another blocking system call.
+	 */
+	pthread_cond_t idle;
 
-	/* The main thread waits on this condition variable. The
-	 * system call thread signals this after it has dequeued the
-	 * system call and just before it invokes the system call, at
-	 * which point the main thread should wake up to continue test
+	/* The main thread waits on this condition variable. A system
+	 * call thread signals this after it has dequeued the system
+	 * call and just before it invokes the system call, at which
+	 * point the main thread should wake up to continue test
 	 * execution.
 	 */
 	pthread_cond_t dequeued;
@@ -86,10 +117,11 @@ extern void syscalls_free(struct state *state,
 
 /* Execute the given system call event. The system call may be
  * expected to block for a while, or it may be expected to return
- * immediately. To keep things simple, currently we only support
- * at most one blocking system call at a time; if a script attempts to
- * start a second blocking call before the first blocking call has
- * returned then this second call raises a runtime error.
+ * immediately. Up to MAX_SYSCALL_THREADS blocking calls may be in
+ * progress at once, and each one's return time is checked against
+ * its own expected end time. If a script attempts to start another
+ * blocking call while all of those are still in progress then this
+ * call raises a runtime error.
  */
 void run_system_call_event(struct state *state,
 			   struct event *event,
@@ -25,12 +25,15 @@
 #include "script.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #ifdef ECOS
 #include "patch_for_ecos.h"
 #else
 #include <poll.h>
 #endif
+#include "hash.h"
 #include "symbols.h"
 
 
@@ -113,31 +116,90 @@ struct int_symbol cross_platform_symbols[] =
 	{ 0, NULL },
 };
 
-/* Do a symbol->int lookup, and return true iff we found the symbol. */
-static bool lookup_int_symbol(const char *input_symbol, s64 *output_integer,
-                              struct int_symbol *symbols)
+/* An open-addressing hash index over the cross-platform and platform
+ * symbol tables, built on first use. Lookups while evaluating system
+ * call arguments are then a hash and (almost always) one strcmp(),
+ * instead of a strcmp() against each of several hundred names.
+ */
+static struct int_symbol **symbol_index;	/* NULL marks empty slots */
+static u32 symbol_index_mask;			/* number of slots - 1 */
+static pthread_once_t symbol_index_once = PTHREAD_ONCE_INIT;
+
+static u32 symbol_hash(const char *name)
+{
+	u32 hash = 0;
+	MurmurHash3_x86_32(name, strlen(name), 0, &hash);
+	return hash;
+}
+
+/* Return the index slot holding the given name, or the empty slot
+ * where it would go.
+ */
+static struct int_symbol **symbol_index_slot(const char *name)
+{
+	u32 i = symbol_hash(name) & symbol_index_mask;
+
+	while (symbol_index[i] != NULL &&
+	        strcmp(symbol_index[i]->name, name) != 0)
+		i = (i + 1) & symbol_index_mask;
+	return &symbol_index[i];
+}
+
+/* Add the symbols in the given table, except any names already indexed,
+ * which keeps the first-match semantics of a linear scan.
+ */
+static void symbol_index_add(struct int_symbol *symbols)
 {
 	int i;
-	for (i = 0; symbols[i].name != NULL ; ++i)
+	for (i = 0; symbols[i].name != NULL; ++i)
 	{
-		if (strcmp(input_symbol, symbols[i].name) == 0)
-		{
-			*output_integer = symbols[i].value;
-			return true;
-		}
+		struct int_symbol **slot = symbol_index_slot(symbols[i].name);
+		if (*slot == NULL)
+			*slot = &symbols[i];
 	}
-	return false;
+}
+
+static int count_int_symbols(struct int_symbol *symbols)
+{
+	int count = 0;
+	while (symbols[count].name != NULL)
+		++count;
+	return count;
+}
+
+static void build_symbol_index(void)
+{
+	int num_symbols = count_int_symbols(cross_platform_symbols) +
+	                  count_int_symbols(platform_symbols());
+	u32 num_slots = 1;
+
+	/* Keep the load factor at or below 1/2 so probes stay short. */
+	while (num_slots < 2 * num_symbols)
+		num_slots <<= 1;
+	symbol_index = calloc(num_slots, sizeof(*symbol_index));
+	symbol_index_mask = num_slots - 1;
+
+	symbol_index_add(cross_platform_symbols);
+	symbol_index_add(platform_symbols());
+}
+
+/* Do a symbol->int lookup, and return true iff we found the symbol. */
+static bool lookup_int_symbol(const char *input_symbol, s64 *output_integer)
+{
+	struct int_symbol *symbol = NULL;
+
+	pthread_once(&symbol_index_once, build_symbol_index);
+	symbol = *symbol_index_slot(input_symbol);
+	if (symbol == NULL)
+		return false;
+	*output_integer = symbol->value;
+	return true;
 }
 
 int symbol_to_int(const char *input_symbol, s64 *output_integer,
                   char **error)
 {
-	if (lookup_int_symbol(input_symbol, output_integer,
-	                      cross_platform_symbols))
-		return STATUS_OK;
-
-	if (lookup_int_symbol(input_symbol, output_integer,
-	                      platform_symbols()))
+	if (lookup_int_symbol(input_symbol, output_integer))
 		return STATUS_OK;
 
 	{
@@ -382,6 +444,118 @@ void free_expression_list(struct expression_list *list)
 	}
 }
 
+/* Return a malloc-allocated copy of the given bytes. */
+static void *copy_bytes(const void *bytes, size_t length)
+{
+	void *copy = malloc(length);
+	assert(copy != NULL);
+	memcpy(copy, bytes, length);
+	return copy;
+}
+
+struct expression *copy_expression(const struct expression *expression)
+{
+	struct expression *copy = NULL;
+
+	if (expression == NULL)
+		return NULL;
+	if ((expression->type <= EXPR_NONE) ||
+	        (expression->type >= NUM_EXPR_TYPES))
+		assert(!"bad expression type");
+
+	copy = copy_bytes(expression, sizeof(*expression));
+	switch (expression->type)
+	{
+	case EXPR_ELLIPSIS:
+	case EXPR_INTEGER:
+	case EXPR_LINGER:
+		break;
+	case EXPR_WORD:
+	case EXPR_STRING:
+		assert(expression->value.string);
+		copy->value.string = strdup(expression->value.string);
+		break;
+	case EXPR_SOCKET_ADDRESS_IPV4:
+		assert(expression->value.socket_address_ipv4);
+		copy->value.socket_address_ipv4 =
+			copy_bytes(expression->value.socket_address_ipv4,
+				   sizeof(struct sockaddr_in));
+		break;
+	case EXPR_SOCKET_ADDRESS_IPV6:
+		assert(expression->value.socket_address_ipv6);
+		copy->value.socket_address_ipv6 =
+			copy_bytes(expression->value.socket_address_ipv6,
+				   sizeof(struct sockaddr_in6));
+		break;
+	case EXPR_BINARY:
+		assert(expression->value.binary);
+		copy->value.binary =
+			copy_bytes(expression->value.binary,
+				   sizeof(struct binary_expression));
+		copy->value.binary->op = strdup(expression->value.binary->op);
+		copy->value.binary->lhs =
+			copy_expression(expression->value.binary->lhs);
+		copy->value.binary->rhs =
+			copy_expression(expression->value.binary->rhs);
+		break;
+	case EXPR_LIST:
+		copy->value.list = copy_expression_list(expression->value.list);
+		break;
+	case EXPR_IOVEC:
+		assert(expression->value.iovec);
+		copy->value.iovec = calloc(1, sizeof(struct iovec_expr));
+		copy->value.iovec->iov_base =
+			copy_expression(expression->value.iovec->iov_base);
+		copy->value.iovec->iov_len =
+			copy_expression(expression->value.iovec->iov_len);
+		break;
+	case EXPR_MSGHDR:
+		assert(expression->value.msghdr);
+		copy->value.msghdr = calloc(1, sizeof(struct msghdr_expr));
+		copy->value.msghdr->msg_name =
+			copy_expression(expression->value.msghdr->msg_name);
+		copy->value.msghdr->msg_namelen =
+			copy_expression(expression->value.msghdr->msg_namelen);
+		copy->value.msghdr->msg_iov =
+			copy_expression(expression->value.msghdr->msg_iov);
+		copy->value.msghdr->msg_iovlen =
+			copy_expression(expression->value.msghdr->msg_iovlen);
+		copy->value.msghdr->msg_flags =
+			copy_expression(expression->value.msghdr->msg_flags);
+		break;
+	case EXPR_POLLFD:
+		assert(expression->value.pollfd);
+		copy->value.pollfd = calloc(1, sizeof(struct pollfd_expr));
+		copy->value.pollfd->fd =
+			copy_expression(expression->value.pollfd->fd);
+		copy->value.pollfd->events =
+			copy_expression(expression->value.pollfd->events);
+		copy->value.pollfd->revents =
+			copy_expression(expression->value.pollfd->revents);
+		break;
+	case EXPR_NONE:
+	case NUM_EXPR_TYPES:
+		break;
+		/* missing default case so compiler catches missing cases */
+	}
+	return copy;
+}
+
+struct expression_list *copy_expression_list(
+	const struct expression_list *list)
+{
+	struct expression_list *head = NULL;
+	struct expression_list **tail = &head;
+
+	for (; list != NULL; list = list->next)
+	{
+		*tail = calloc(1, sizeof(struct expression_list));
+		(*tail)->expression = copy_expression(list->expression);
+		tail = &(*tail)->next;
+	}
+	return head;
+}
+
 static int evaluate_binary_expression(struct expression *in,
                                       struct expression *out, char **error)
 {
@@ -244,6 +244,17 @@ extern void free_expression(struct expression *expression);
  */
 extern void free_expression_list(struct expression_list *list);
 
+/* Return a deep copy of the given heap-allocated expression, which the
+ * caller owns and should free with free_expression().
+ */
+extern struct expression *copy_expression(const struct expression *expression);
+
+/* Return a deep copy of the given heap-allocated expression list,
+ * which the caller owns and should free with free_expression_list().
+ */
+extern struct expression_list *copy_expression_list(
+	const struct expression_list *list);
+
 /* Return a copy of the given expression list with each expression
  * evaluated (e.g. symbols resolved to ints). On success, returns
  * STATUS_OK. On error return STATUS_ERR and fill in *error.
@@ -0,0 +1,401 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Implementation of the in-memory cache of parsed scripts.
+ */
+
+#include "script_cache.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+#include "logging.h"
+#include "packet.h"
+
+/* A parsed script, kept pristine so each lookup gets its own copy. */
+struct script_cache_entry {
+	u64 hash[2];		/* MurmurHash3 of the key, for quick checks */
+	char *key;		/* script text followed by the argv strings */
+	int key_length;		/* number of bytes in key */
+	int text_length;	/* number of bytes of script text in key */
+	u8 digest[SCRIPT_DIGEST_BYTES];	/* script_digest() of the text */
+	struct script script;	/* parsed options, init command and events */
+	struct script_cache_entry *next;	/* next most recently used */
+};
+
+/* This mutex guards the cache list. Entries are only read while it is
+ * held, so an entry can't be evicted while we are copying it.
+ */
+static pthread_mutex_t script_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct script_cache_entry *script_cache = NULL;
+static int script_cache_entries = 0;
+
+/* Build the cache key for the given script text and command line:
+ * the text followed by each argument, all NUL-terminated.
+ */
+static char *script_cache_key(int argc, char *argv[],
+			      const struct script *script, int *length)
+{
+	char *key = NULL, *p = NULL;
+	int i;
+
+	*length = script->length + 1;
+	for (i = 0; i < argc; ++i)
+		*length += strlen(argv[i]) + 1;
+
+	key = malloc(*length);
+	assert(key != NULL);
+
+	p = key;
+	memcpy(p, script->buffer, script->length);
+	p += script->length;
+	*p++ = '\0';
+	for (i = 0; i < argc; ++i) {
+		int len = strlen(argv[i]) + 1;
+		memcpy(p, argv[i], len);
+		p += len;
+	}
+	return key;
+}
+
+/* Return true iff the argv strings at the end of the given entry's key
+ * match the given command line.
+ */
+static bool script_cache_same_argv(const struct script_cache_entry *entry,
+				   int argc, char *argv[])
+{
+	const char *p = entry->key + entry->text_length + 1;
+	const char *end = entry->key + entry->key_length;
+	int i;
+
+	for (i = 0; i < argc; ++i) {
+		int len = strlen(argv[i]) + 1;
+		if (end - p < len || memcmp(p, argv[i], len) != 0)
+			return false;
+		p += len;
+	}
+	return p == end;
+}
+
+void script_digest(const char *buffer, int length,
+		   u8 digest[SCRIPT_DIGEST_BYTES])
+{
+	u64 hash[2];
+	int i;
+
+	MurmurHash3_x64_128(buffer, length, 0, hash);
+	for (i = 0; i < 8; ++i) {
+		digest[i] = hash[0] >> (56 - 8 * i);
+		digest[8 + i] = hash[1] >> (56 - 8 * i);
+	}
+}
+
+static char *copy_string(const char *s)
+{
+	return (s == NULL) ? NULL : strdup(s);
+}
+
+static struct option_list *copy_option_list(const struct option_list *list)
+{
+	struct option_list *head = NULL;
+	struct option_list **tail = &head;
+
+	for (; list != NULL; list = list->next) {
+		*tail = calloc(1, sizeof(struct option_list));
+		(*tail)->name = copy_string(list->name);
+		(*tail)->value = copy_string(list->value);
+		tail = &(*tail)->next;
+	}
+	return head;
+}
+
+static struct command_spec *copy_command_spec(const struct command_spec *cmd)
+{
+	struct command_spec *copy = NULL;
+
+	if (cmd == NULL)
+		return NULL;
+	copy = calloc(1, sizeof(struct command_spec));
+	copy->command_line = copy_string(cmd->command_line);
+	return copy;
+}
+
+static struct syscall_spec *copy_syscall_spec(
+	const struct syscall_spec *syscall)
+{
+	struct syscall_spec *copy = calloc(1, sizeof(struct syscall_spec));
+
+	copy->name = copy_string(syscall->name);
+	copy->arguments = copy_expression_list(syscall->arguments);
+	copy->result = copy_expression(syscall->result);
+	if (syscall->error != NULL) {
+		copy->error = calloc(1, sizeof(struct errno_spec));
+		copy->error->errno_macro =
+			copy_string(syscall->error->errno_macro);
+		copy->error->strerror = copy_string(syscall->error->strerror);
+	}
+	copy->note = copy_string(syscall->note);
+	copy->end_usecs = syscall->end_usecs;
+	return copy;
+}
+
+/* Return a deep copy of the given event, with no successor. Running a
+ * script updates its events and packets in place, so sharing any of
+ * them between runs is not safe.
+ */
+static struct event *copy_event(const struct event *event)
+{
+	struct event *copy = malloc(sizeof(struct event));
+
+	assert(copy != NULL);
+	*copy = *event;
+	copy->next = NULL;
+
+	switch (event->type) {
+	case PACKET_EVENT:
+		copy->event.packet = packet_copy_unpooled(event->event.packet);
+		break;
+	case SYSCALL_EVENT:
+		copy->event.syscall = copy_syscall_spec(event->event.syscall);
+		break;
+	case COMMAND_EVENT:
+		copy->event.command = copy_command_spec(event->event.command);
+		break;
+	case CODE_EVENT:
+		copy->event.code = calloc(1, sizeof(struct code_spec));
+		copy->event.code->text = copy_string(event->event.code->text);
+		break;
+	case INVALID_EVENT:
+	case NUM_EVENT_TYPES:
+		assert(!"bad event type");
+		break;
+	/* We omit default case so compiler catches missing values. */
+	}
+	return copy;
+}
+
+/* Fill in the parsed parts of 'to' with a deep copy of those of 'from'. */
+static void copy_parsed_script(const struct script *from, struct script *to)
+{
+	const struct event *event = NULL;
+	struct event **tail = &to->event_list;
+
+	to->option_list = copy_option_list(from->option_list);
+	to->init_command = copy_command_spec(from->init_command);
+	to->event_list = NULL;
+	for (event = from->event_list; event != NULL; event = event->next) {
+		*tail = copy_event(event);
+		tail = &(*tail)->next;
+	}
+}
+
+static void free_option_list(struct option_list *list)
+{
+	while (list != NULL) {
+		struct option_list *dead = list;
+
+		list = list->next;
+		free(dead->name);
+		free(dead->value);
+		free(dead);
+	}
+}
+
+static void free_command_spec(struct command_spec *cmd)
+{
+	if (cmd == NULL)
+		return;
+	free((char *)cmd->command_line);
+	free(cmd);
+}
+
+static void free_syscall_spec(struct syscall_spec *syscall)
+{
+	free((char *)syscall->name);
+	free_expression_list(syscall->arguments);
+	free_expression(syscall->result);
+	if (syscall->error != NULL) {
+		free((char *)syscall->error->errno_macro);
+		free((char *)syscall->error->strerror);
+		free(syscall->error);
+	}
+	free(syscall->note);
+	free(syscall);
+}
+
+/* Free an event made by copy_event(). */
+static void free_event(struct event *event)
+{
+	switch (event->type) {
+	case PACKET_EVENT:
+		packet_free(event->event.packet);
+		break;
+	case SYSCALL_EVENT:
+		free_syscall_spec(event->event.syscall);
+		break;
+	case COMMAND_EVENT:
+		free_command_spec(event->event.command);
+		break;
+	case CODE_EVENT:
+		free((char *)event->event.code->text);
+		free(event->event.code);
+		break;
+	case INVALID_EVENT:
+	case NUM_EVENT_TYPES:
+		assert(!"bad event type");
+		break;
+	/* We omit default case so compiler catches missing values. */
+	}
+	free(event);
+}
+
+/* Free the parsed parts of a script filled in by copy_parsed_script(). */
+static void free_parsed_script(struct script *script)
+{
+	struct event *event = script->event_list;
+
+	while (event != NULL) {
+		struct event *dead = event;
+
+		event = event->next;
+		free_event(dead);
+	}
+	free_option_list(script->option_list);
+	free_command_spec(script->init_command);
+	script->event_list = NULL;
+	script->option_list = NULL;
+	script->init_command = NULL;
+}
+
+/* Free a cache entry and everything it owns. */
+static void script_cache_entry_free(struct script_cache_entry *entry)
+{
+	free_parsed_script(&entry->script);
+	free(entry->key);
+	memset(entry, 0, sizeof(*entry));	/* paranoia to help catch bugs */
+	free(entry);
+}
+
+bool script_cache_lookup(int argc, char *argv[], struct script *script)
+{
+	struct script_cache_entry *entry = NULL, **prev = NULL;
+	int key_length = 0;
+	char *key = script_cache_key(argc, argv, script, &key_length);
+	u64 hash[2];
+	bool found = false;
+
+	MurmurHash3_x64_128(key, key_length, 0, hash);
+
+	if (pthread_mutex_lock(&script_cache_mutex) != 0)
+		die_perror("pthread_mutex_lock");
+
+	for (prev = &script_cache; *prev != NULL; prev = &(*prev)->next) {
+		entry = *prev;
+		if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1] &&
+		    entry->key_length == key_length &&
+		    memcmp(entry->key, key, key_length) == 0) {
+			found = true;
+			break;
+		}
+	}
+
+	if (found) {
+		copy_parsed_script(&entry->script, script);
+
+		/* Move the entry to the front of the list. */
+		*prev = entry->next;
+		entry->next = script_cache;
+		script_cache = entry;
+	}
+
+	if (pthread_mutex_unlock(&script_cache_mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+
+	DEBUGP("script_cache_lookup: %s\n", found ? "hit" : "miss");
+	free(key);
+	return found;
+}
+
+char *script_cache_find_text(int argc, char *argv[],
+			     const u8 digest[SCRIPT_DIGEST_BYTES],
+			     int *length)
+{
+	struct script_cache_entry *entry = NULL;
+	char *text = NULL;
+
+	if (pthread_mutex_lock(&script_cache_mutex) != 0)
+		die_perror("pthread_mutex_lock");
+
+	for (entry = script_cache; entry != NULL; entry = entry->next) {
+		if (memcmp(entry->digest, digest, SCRIPT_DIGEST_BYTES) == 0 &&
+		    script_cache_same_argv(entry, argc, argv)) {
+			text = malloc(entry->text_length + 1);
+			memcpy(text, entry->key, entry->text_length + 1);
+			*length = entry->text_length;
+			break;
+		}
+	}
+
+	if (pthread_mutex_unlock(&script_cache_mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+
+	DEBUGP("script_cache_find_text: %s\n", text ? "hit" : "miss");
+	return text;
+}
+
+void script_cache_insert(int argc, char *argv[], const struct script *script)
+{
+	struct script_cache_entry *entry = NULL, **prev = NULL;
+	struct script_cache_entry *evicted = NULL;
+
+	entry = calloc(1, sizeof(struct script_cache_entry));
+	entry->key = script_cache_key(argc, argv, script, &entry->key_length);
+	MurmurHash3_x64_128(entry->key, entry->key_length, 0, entry->hash);
+	entry->text_length = script->length;
+	script_digest(script->buffer, script->length, entry->digest);
+	init_script(&entry->script);
+	copy_parsed_script(script, &entry->script);
+
+	if (pthread_mutex_lock(&script_cache_mutex) != 0)
+		die_perror("pthread_mutex_lock");
+
+	entry->next = script_cache;
+	script_cache = entry;
+	++script_cache_entries;
+
+	/* Forget the least recently used entry if we have too many.
+	 * Lookups hand out deep copies, so nobody else points into it.
+	 */
+	if (script_cache_entries > SCRIPT_CACHE_MAX_ENTRIES) {
+		for (prev = &script_cache; (*prev)->next != NULL;
+		     prev = &(*prev)->next)
+			;
+		evicted = *prev;
+		*prev = NULL;
+		--script_cache_entries;
+	}
+
+	if (pthread_mutex_unlock(&script_cache_mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+
+	if (evicted != NULL)
+		script_cache_entry_free(evicted);
+}
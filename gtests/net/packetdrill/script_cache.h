@@ -0,0 +1,77 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * An in-memory cache of parsed scripts, so that running the same
+ * script again in the same process (as the wire server does for each
+ * client session, or a soak run listing a script many times) can skip
+ * the lexer and parser and the work of building every script packet.
+ *
+ * Entries are keyed by the full script text and command line, since
+ * those together determine everything the parser produces. A script
+ * file that changed on disk therefore simply misses the cache.
+ *
+ * Each entry also records a digest of its script text, so that a wire
+ * client can ask whether the server already has a script before
+ * sending it.
+ */
+
+#ifndef __SCRIPT_CACHE_H__
+#define __SCRIPT_CACHE_H__
+
+#include "types.h"
+
+#include "script.h"
+
+/* Maximum number of parsed scripts we keep around. */
+#define SCRIPT_CACHE_MAX_ENTRIES	32
+
+/* Number of bytes in a script digest. */
+#define SCRIPT_DIGEST_BYTES		16
+
+/* Compute the digest of the given script text: its 128-bit
+ * MurmurHash3, in big-endian byte order so that hosts of either
+ * endianness agree on it.
+ */
+extern void script_digest(const char *buffer, int length,
+			  u8 digest[SCRIPT_DIGEST_BYTES]);
+
+/* If we have already parsed a script whose text has the given digest
+ * under the same command line, return a malloc-allocated copy of its
+ * text and store the length in *length. Otherwise return NULL.
+ */
+extern char *script_cache_find_text(int argc, char *argv[],
+				    const u8 digest[SCRIPT_DIGEST_BYTES],
+				    int *length);
+
+/* If we have already parsed a script whose text matches script->buffer
+ * under the same command line, fill in the options, init command and
+ * events of the given script with a fresh deep copy of the parsed
+ * representation and return true. Otherwise return false and leave
+ * the script untouched.
+ */
+extern bool script_cache_lookup(int argc, char *argv[],
+				struct script *script);
+
+/* Remember a deep copy of the given freshly parsed script, so later
+ * lookups with the same text and command line can skip parsing.
+ */
+extern void script_cache_insert(int argc, char *argv[],
+				const struct script *script);
+
+#endif /* __SCRIPT_CACHE_H__ */
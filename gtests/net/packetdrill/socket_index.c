@@ -0,0 +1,180 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Implementation for a hash index of sockets keyed by 4-tuple, using
+ * a chained hash table with a power-of-2 number of buckets.
+ */
+
+#include "socket_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+static const size_t MAX_BUCKETS = 1ULL << 30;	/* max 1B buckets */
+
+/* Hash a tuple. We use the fast, public-domain MurmurHash3.*/
+static inline size_t hash_tuple(const struct tuple *tuple)
+{
+	u32 hash;
+	MurmurHash3_x86_32(tuple, sizeof(*tuple), 0, &hash);
+	return hash;
+}
+
+/* Find the bucket number for a tuple. */
+static inline size_t socket_index_bucket_num(const struct socket_index *index,
+					     const struct tuple *tuple)
+{
+	return hash_tuple(tuple) & index->bucket_mask;
+}
+
+/* Try to find the smallest bucket count that is a power of 2 and is
+ * greater than the given number of keys.
+ */
+static inline size_t socket_index_pick_bucket_count(size_t num_keys)
+{
+	size_t buckets = 1;
+	while ((buckets < num_keys) && (buckets < MAX_BUCKETS))
+		buckets <<= 1;
+	return buckets;
+}
+
+struct socket_index *socket_index_new(size_t num_keys)
+{
+	struct socket_index *index = calloc(1, sizeof(struct socket_index));
+	index->num_buckets = socket_index_pick_bucket_count(num_keys);
+	index->bucket_mask = index->num_buckets - 1;
+	index->buckets = calloc(index->num_buckets,
+				sizeof(struct socket_index_node *));
+	return index;
+}
+
+void socket_index_free(struct socket_index *index)
+{
+	size_t bucket_num;
+	for (bucket_num = 0; bucket_num < index->num_buckets; ++bucket_num) {
+		struct socket_index_node *node = NULL;
+		struct socket_index_node *next = NULL;
+		for (node = index->buckets[bucket_num]; node != NULL;
+		     node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+
+	free(index->buckets);
+	memset(index, 0, sizeof(*index));	/* paranoia to help catch bugs */
+	free(index);
+}
+
+/* Link the given node into the correct bucket linked list. */
+static void socket_index_link(struct socket_index *index,
+			      struct socket_index_node *node)
+{
+	const size_t bucket_num = socket_index_bucket_num(index, &node->tuple);
+	node->next = index->buckets[bucket_num];
+	index->buckets[bucket_num] = node;
+}
+
+/* Double the number of buckets and rehash all the nodes. */
+static void socket_index_grow(struct socket_index *index)
+{
+	const size_t old_num_buckets = index->num_buckets;
+	struct socket_index_node **old_buckets = index->buckets;
+	size_t old_bucket_num = 0;
+
+	index->num_buckets *= 2;
+	index->bucket_mask = index->num_buckets - 1;
+	index->buckets = calloc(index->num_buckets,
+				sizeof(struct socket_index_node *));
+
+	for (old_bucket_num = 0; old_bucket_num < old_num_buckets;
+	     ++old_bucket_num) {
+		struct socket_index_node *node = NULL;
+		struct socket_index_node *next = NULL;
+		for (node = old_buckets[old_bucket_num]; node != NULL;
+		     node = next) {
+			next = node->next;
+			socket_index_link(index, node);
+		}
+	}
+
+	free(old_buckets);
+}
+
+void socket_index_set(struct socket_index *index,
+		      const struct tuple *tuple, struct socket *socket)
+{
+	const size_t bucket_num = socket_index_bucket_num(index, tuple);
+	struct socket_index_node *node = NULL;
+
+	for (node = index->buckets[bucket_num]; node != NULL;
+	     node = node->next) {
+		if (is_equal_tuple(&node->tuple, tuple)) {
+			node->socket = socket;
+			return;
+		}
+	}
+
+	/* To keep things simple, we target a load factor of 1.0. */
+	if ((index->num_keys >= index->num_buckets) &&
+	    (index->num_buckets < MAX_BUCKETS)) {
+		socket_index_grow(index);
+	}
+	++index->num_keys;
+	node = calloc(1, sizeof(struct socket_index_node));
+	memcpy(&node->tuple, tuple, sizeof(node->tuple));
+	node->socket = socket;
+	socket_index_link(index, node);
+}
+
+void socket_index_remove(struct socket_index *index,
+			 const struct tuple *tuple,
+			 const struct socket *socket)
+{
+	const size_t bucket_num = socket_index_bucket_num(index, tuple);
+	struct socket_index_node **link = NULL;
+
+	for (link = &index->buckets[bucket_num]; *link != NULL;
+	     link = &(*link)->next) {
+		struct socket_index_node *node = *link;
+		if (is_equal_tuple(&node->tuple, tuple)) {
+			if (node->socket == socket) {
+				*link = node->next;
+				free(node);
+				--index->num_keys;
+			}
+			return;
+		}
+	}
+}
+
+struct socket *socket_index_get(const struct socket_index *index,
+				const struct tuple *tuple)
+{
+	const size_t bucket_num = socket_index_bucket_num(index, tuple);
+	struct socket_index_node *node = NULL;
+
+	for (node = index->buckets[bucket_num]; node != NULL;
+	     node = node->next) {
+		if (is_equal_tuple(&node->tuple, tuple))
+			return node->socket;
+	}
+	return NULL;
+}
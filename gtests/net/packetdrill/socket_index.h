@@ -0,0 +1,72 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Interface for a hash index of the sockets we're tracking, keyed by
+ * 4-tuple, so that we can find the socket for a packet in constant
+ * time no matter how many connections a script has open.
+ */
+
+#ifndef __SOCKET_INDEX_H__
+#define __SOCKET_INDEX_H__
+
+#include "types.h"
+
+#include "socket.h"
+
+/* Node for socket index buckets; maps a tuple to a socket. */
+struct socket_index_node {
+	struct tuple tuple;		/* outbound tuple of the socket */
+	struct socket *socket;
+	struct socket_index_node *next;
+};
+
+/* Hash index mapping outbound 4-tuples to sockets. */
+struct socket_index {
+	size_t num_keys;		/* number of keys */
+	size_t num_buckets;		/* number of buckets (a power of 2) */
+	size_t bucket_mask;		/* bit mask to find bucket number */
+	struct socket_index_node **buckets;	/* array of hash buckets */
+};
+
+extern struct socket_index *socket_index_new(size_t num_keys);
+
+/* Free the index. The sockets it points to are not freed. */
+extern void socket_index_free(struct socket_index *index);
+
+/* Map the given tuple to the given socket, replacing any previous
+ * socket for that tuple. The tuple must have been zeroed before being
+ * filled in, as get_packet_tuple() and friends do, since we hash and
+ * compare all of its bytes.
+ */
+extern void socket_index_set(struct socket_index *index,
+			     const struct tuple *tuple,
+			     struct socket *socket);
+
+/* Remove the mapping for the given tuple if it maps to the given
+ * socket. A newer socket that took over the tuple keeps its mapping.
+ */
+extern void socket_index_remove(struct socket_index *index,
+				const struct tuple *tuple,
+				const struct socket *socket);
+
+/* Return the socket for the given tuple, or NULL if there is none. */
+extern struct socket *socket_index_get(const struct socket_index *index,
+				       const struct tuple *tuple);
+
+#endif /* __SOCKET_INDEX_H__ */
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Unit test for socket_index.c.
+ */
+
+#include "socket_index.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Fill in a socket for a flow between the usual live addresses, with
+ * the given local and remote ports.
+ */
+static void init_flow(struct socket *socket, u16 local_port, u16 remote_port)
+{
+	memset(socket, 0, sizeof(*socket));
+	socket->live.local.ip = ipv4_parse("192.168.0.1");
+	socket->live.local.port = htons(local_port);
+	socket->live.remote.ip = ipv4_parse("192.0.2.1");
+	socket->live.remote.port = htons(remote_port);
+}
+
+static void test_many_flows(void)
+{
+	const int num_flows = 1000;
+	struct socket *sockets = calloc(num_flows, sizeof(struct socket));
+	struct socket_index *index = socket_index_new(1);
+	struct tuple outbound, inbound;
+	int i;
+
+	/* Many connections to one listening port, as a server sees. */
+	for (i = 0; i < num_flows; ++i) {
+		init_flow(&sockets[i], 8080, 40000 + i);
+		socket_get_outbound(&sockets[i].live, &outbound);
+		socket_index_set(index, &outbound, &sockets[i]);
+	}
+	assert(index->num_keys == num_flows);
+	assert(index->num_buckets >= num_flows);
+
+	for (i = 0; i < num_flows; ++i) {
+		socket_get_outbound(&sockets[i].live, &outbound);
+		assert(socket_index_get(index, &outbound) == &sockets[i]);
+
+		/* Inbound packets carry the reverse tuple, which is
+		 * not a key.
+		 */
+		socket_get_inbound(&sockets[i].live, &inbound);
+		assert(socket_index_get(index, &inbound) == NULL);
+	}
+
+	/* A flow we never added is not found. */
+	init_flow(&sockets[0], 8080, 40000 + num_flows);
+	socket_get_outbound(&sockets[0].live, &outbound);
+	assert(socket_index_get(index, &outbound) == NULL);
+
+	socket_index_free(index);
+	free(sockets);
+}
+
+static void test_remove(void)
+{
+	struct socket_index *index = socket_index_new(1);
+	struct socket a, b, c;
+	struct tuple tuple_a, tuple_b;
+
+	init_flow(&a, 8080, 40000);
+	init_flow(&b, 8080, 40001);
+	socket_get_outbound(&a.live, &tuple_a);
+	socket_get_outbound(&b.live, &tuple_b);
+	socket_index_set(index, &tuple_a, &a);
+	socket_index_set(index, &tuple_b, &b);
+
+	/* Closing one flow leaves the other. */
+	socket_index_remove(index, &tuple_a, &a);
+	assert(socket_index_get(index, &tuple_a) == NULL);
+	assert(socket_index_get(index, &tuple_b) == &b);
+	assert(index->num_keys == 1);
+
+	/* Removing a tuple that is not there is harmless. */
+	socket_index_remove(index, &tuple_a, &a);
+	assert(index->num_keys == 1);
+
+	/* A new socket reusing b's tuple takes it over, and removing
+	 * the old socket does not remove the new one's mapping.
+	 */
+	init_flow(&c, 8080, 40001);
+	socket_index_set(index, &tuple_b, &c);
+	assert(socket_index_get(index, &tuple_b) == &c);
+	assert(index->num_keys == 1);
+	socket_index_remove(index, &tuple_b, &b);
+	assert(socket_index_get(index, &tuple_b) == &c);
+	socket_index_remove(index, &tuple_b, &c);
+	assert(socket_index_get(index, &tuple_b) == NULL);
+	assert(index->num_keys == 0);
+
+	socket_index_free(index);
+}
+
+int main(void)
+{
+	test_many_flows();
+	test_remove();
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Implementation for per-event-type timing error reports.
+ */
+
+#include "timing_report.h"
+
+#include <string.h>
+
+const char *timing_event_to_string(enum timing_event_t event)
+{
+	switch (event) {
+	case TIMING_INBOUND_PACKET:	return "inbound_packet";
+	case TIMING_OUTBOUND_PACKET:	return "outbound_packet";
+	case TIMING_SYSCALL:		return "syscall";
+	case TIMING_SYSCALL_RETURN:	return "syscall_return";
+	case TIMING_COMMAND:		return "command";
+	case TIMING_CODE:		return "code";
+	case NUM_TIMING_EVENTS:		break;
+	/* We omit default case so compiler catches missing values. */
+	}
+	return "unknown";
+}
+
+void timing_report_reset(struct timing_report *report)
+{
+	int i;
+
+	memset(report, 0, sizeof(*report));
+	for (i = 0; i < NUM_TIMING_EVENTS; ++i)
+		histogram_reset(&report->stats[i].error);
+}
+
+void timing_report_add(struct timing_report *report,
+		       enum timing_event_t event,
+		       s64 expected_usecs, s64 expected_usecs_end,
+		       s64 actual_usecs)
+{
+	struct timing_stats *stats = &report->stats[event];
+	s64 delta_usecs = 0;	/* negative if early, positive if late */
+
+	if (actual_usecs < expected_usecs)
+		delta_usecs = actual_usecs - expected_usecs;
+	else if (actual_usecs > expected_usecs_end)
+		delta_usecs = actual_usecs - expected_usecs_end;
+
+	if (delta_usecs < 0) {
+		histogram_add(&stats->error, -delta_usecs);
+		if (-delta_usecs > stats->max_early_usecs)
+			stats->max_early_usecs = -delta_usecs;
+	} else {
+		histogram_add(&stats->error, delta_usecs);
+		if (delta_usecs > stats->max_late_usecs)
+			stats->max_late_usecs = delta_usecs;
+	}
+}
+
+/* Print the given string as a JSON string literal. */
+static void print_json_string(const char *s, FILE *out)
+{
+	fputc('"', out);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void print_text(const struct timing_report *report,
+		       const char *script_path, int tolerance_usecs,
+		       FILE *out)
+{
+	int i;
+
+	fprintf(out, "%s: timing error (usecs, tolerance %d):\n",
+		script_path, tolerance_usecs);
+	for (i = 0; i < NUM_TIMING_EVENTS; ++i) {
+		const struct timing_stats *stats = &report->stats[i];
+
+		if (stats->error.num_samples == 0)
+			continue;
+		fprintf(out, "  %-16s events: %llu p50: %lld p99: %lld "
+			"max: %lld early: %lld late: %lld\n",
+			timing_event_to_string(i),
+			stats->error.num_samples,
+			histogram_percentile(&stats->error, 50),
+			histogram_percentile(&stats->error, 99),
+			stats->error.max,
+			stats->max_early_usecs, stats->max_late_usecs);
+	}
+}
+
+static void print_json(const struct timing_report *report,
+		       const char *script_path, int tolerance_usecs,
+		       FILE *out)
+{
+	const char *separator = "";
+	int i;
+
+	fprintf(out, "{\"script\": ");
+	print_json_string(script_path, out);
+	fprintf(out, ", \"tolerance_usecs\": %d, \"events\": {",
+		tolerance_usecs);
+	for (i = 0; i < NUM_TIMING_EVENTS; ++i) {
+		const struct timing_stats *stats = &report->stats[i];
+
+		if (stats->error.num_samples == 0)
+			continue;
+		fprintf(out, "%s\"%s\": {\"count\": %llu, \"p50\": %lld, "
+			"\"p99\": %lld, \"max\": %lld, "
+			"\"max_early\": %lld, \"max_late\": %lld}",
+			separator, timing_event_to_string(i),
+			stats->error.num_samples,
+			histogram_percentile(&stats->error, 50),
+			histogram_percentile(&stats->error, 99),
+			stats->error.max,
+			stats->max_early_usecs, stats->max_late_usecs);
+		separator = ", ";
+	}
+	fprintf(out, "}}\n");
+}
+
+void timing_report_print(const struct timing_report *report,
+			 enum timing_report_format_t format,
+			 const char *script_path, int tolerance_usecs,
+			 FILE *out)
+{
+	switch (format) {
+	case TIMING_REPORT_NONE:
+		break;
+	case TIMING_REPORT_TEXT:
+		print_text(report, script_path, tolerance_usecs, out);
+		break;
+	case TIMING_REPORT_JSON:
+		print_json(report, script_path, tolerance_usecs, out);
+		break;
+	/* We omit default case so compiler catches missing values. */
+	}
+	fflush(out);
+}
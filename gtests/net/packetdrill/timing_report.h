@@ -0,0 +1,84 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Per-event-type summaries of how far live event times strayed from
+ * the times the script asked for, so that --tolerance_usecs can be
+ * tuned from data.
+ */
+
+#ifndef __TIMING_REPORT_H__
+#define __TIMING_REPORT_H__
+
+#include "types.h"
+
+#include <stdio.h>
+#include "histogram.h"
+
+/* The kinds of event whose timing we check, for grouping statistics. */
+enum timing_event_t {
+	TIMING_INBOUND_PACKET = 0,	/* injecting an inbound packet */
+	TIMING_OUTBOUND_PACKET,		/* kernel sending a packet */
+	TIMING_SYSCALL,			/* starting a system call */
+	TIMING_SYSCALL_RETURN,		/* a blocking system call returning */
+	TIMING_COMMAND,			/* running a shell command */
+	TIMING_CODE,			/* running a code snippet */
+	NUM_TIMING_EVENTS,
+};
+
+/* How to print the report at the end of a script, if at all. */
+enum timing_report_format_t {
+	TIMING_REPORT_NONE = 0,
+	TIMING_REPORT_TEXT,
+	TIMING_REPORT_JSON,
+};
+
+/* Timing error statistics for one kind of event. */
+struct timing_stats {
+	struct histogram error;	/* abs(actual - expected) in usecs */
+	s64 max_early_usecs;	/* most usecs an event was early */
+	s64 max_late_usecs;	/* most usecs an event was late */
+};
+
+struct timing_report {
+	struct timing_stats stats[NUM_TIMING_EVENTS];
+};
+
+/* Return a short name for the kind of event, like "inbound_packet". */
+extern const char *timing_event_to_string(enum timing_event_t event);
+
+/* Clear out all statistics. */
+extern void timing_report_reset(struct timing_report *report);
+
+/* Record an event that the script expected in the time range
+ * [expected_usecs, expected_usecs_end] and that happened at
+ * actual_usecs. For events expected at a single time, pass the same
+ * value for both ends of the range.
+ */
+extern void timing_report_add(struct timing_report *report,
+			      enum timing_event_t event,
+			      s64 expected_usecs, s64 expected_usecs_end,
+			      s64 actual_usecs);
+
+/* Print the report for the given script to the given file. */
+extern void timing_report_print(const struct timing_report *report,
+				enum timing_report_format_t format,
+				const char *script_path, int tolerance_usecs,
+				FILE *out);
+
+#endif /* __TIMING_REPORT_H__ */
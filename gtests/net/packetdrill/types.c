@@ -23,9 +23,12 @@
  */
 
 #include "types.h"
+
+#include <time.h>
 #ifdef ECOS
 #include "patch_for_ecos.h"
 #endif
+#include "logging.h"
 
 struct in_addr in4addr_any    = { .s_addr = INADDR_ANY };
 
@@ -54,3 +57,55 @@ void hex_dump(const u8 *buffer, int bytes, char **hex)
 	fprintf(s, "\n");
 	fclose(s);
 }
+
+#ifdef ECOS
+s64 now_usecs(void)
+{
+	struct timeval tv;
+	if (gettimeofday(&tv, NULL) < 0)
+		die_perror("gettimeofday");
+	return timeval_to_usecs(&tv);
+}
+
+s64 now_nsecs(void)
+{
+	return now_usecs() * 1000;
+}
+
+s64 wall_time_to_now_usecs(s64 wall_usecs)
+{
+	return wall_usecs;	/* now_usecs() is already wall clock time */
+}
+#else
+/* Return the current time on the given clock in microseconds. */
+static s64 clock_usecs(clockid_t clock)
+{
+	struct timespec ts;
+	if (clock_gettime(clock, &ts) < 0)
+		die_perror("clock_gettime");
+	return ((s64)ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+s64 now_usecs(void)
+{
+	return clock_usecs(CLOCK_MONOTONIC);
+}
+
+s64 now_nsecs(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		die_perror("clock_gettime");
+	return ((s64)ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+s64 wall_time_to_now_usecs(s64 wall_usecs)
+{
+	/* Sample the offset between the clocks now, rather than once
+	 * at start-up, so steps in the wall clock don't leak in.
+	 */
+	s64 offset_usecs = clock_usecs(CLOCK_REALTIME) -
+			   clock_usecs(CLOCK_MONOTONIC);
+	return wall_usecs - offset_usecs;
+}
+#endif
@@ -178,6 +178,20 @@ static inline s64 timeval_to_usecs(const struct timeval *tv)
 	return ((s64)tv->tv_sec) * 1000000LL + (s64)tv->tv_usec;
 }
 
+/* Get the current time in microseconds. On platforms that have it,
+ * this is CLOCK_MONOTONIC, so it is not affected by steps in the wall
+ * clock; all live times in a test run use this timebase.
+ */
+extern s64 now_usecs(void);
+
+/* Like now_usecs(), but in nanoseconds, for timing short operations. */
+extern s64 now_nsecs(void);
+
+/* Convert a wall clock timestamp in microseconds, such as the kernel
+ * takes for sniffed packets, to the timebase of now_usecs().
+ */
+extern s64 wall_time_to_now_usecs(s64 wall_usecs);
+
 /* Return a malloc-allocated hex dump of the given buffer of the given length */
 extern void hex_dump(const u8 *buffer, int bytes, char **hex);
 
@@ -27,8 +27,12 @@
 #include "config.h"
 #include "link_layer.h"
 #include "script.h"
+#include "script_cache.h"
 #include "run.h"
 
+/* Number of clock probes we send to estimate the server clock offset. */
+#define WIRE_CLOCK_PROBES	8
+
 struct wire_client *wire_client_new(void)
 {
 	return calloc(1, sizeof(struct wire_client));
@@ -38,6 +42,7 @@ void wire_client_free(struct wire_client *wire_client)
 {
 	if (wire_client->wire_conn != NULL)
 		wire_conn_free(wire_client->wire_conn);
+	free(wire_client->pending_done);
 
 	memset(wire_client, 0, sizeof(*wire_client));  /* help catch bugs */
 	free(wire_client);
@@ -49,6 +54,68 @@ static void wire_client_die(struct wire_client *wire_client,
 	die("error in TCP connection to wire server: %s\n", message);
 }
 
+/* Connect to the wire server and agree on a protocol version. A
+ * version 1 server takes our WIRE_HELLO for a bad first message and
+ * hangs up; then we reconnect and speak version 1, without clock
+ * probes, pipelining, or script digests.
+ */
+static void wire_client_connect(struct wire_client *wire_client,
+                                const struct config *config)
+{
+	struct wire_hello hello;
+	enum wire_op_t op = WIRE_INVALID;
+	void *buf = NULL;
+	int buf_len = -1;
+	int version = 0;
+
+	wire_client->wire_conn = wire_conn_new();
+	wire_conn_connect(wire_client->wire_conn,
+	                  &config->wire_server_ip,
+	                  config->wire_server_port);
+
+	hello.version = htonl(WIRE_PROTOCOL_VERSION);
+	if (wire_conn_write(wire_client->wire_conn,
+	                    WIRE_HELLO,
+	                    &hello, sizeof(hello)))
+		wire_client_die(wire_client, "error sending WIRE_HELLO");
+
+	if (wire_conn_read(wire_client->wire_conn,
+	                   &op, &buf, &buf_len))
+	{
+		fprintf(stderr,
+		        "warning: wire server does not speak wire protocol "
+		        "version %d; reconnecting with version %d\n",
+		        WIRE_PROTOCOL_VERSION, WIRE_PROTOCOL_V1);
+		wire_conn_free(wire_client->wire_conn);
+		wire_client->wire_conn = wire_conn_new();
+		wire_conn_connect(wire_client->wire_conn,
+		                  &config->wire_server_ip,
+		                  config->wire_server_port);
+		wire_client->protocol_version = WIRE_PROTOCOL_V1;
+		return;
+	}
+	if (op != WIRE_HELLO)
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: expected WIRE_HELLO");
+	}
+	if (buf_len != sizeof(hello))
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: bad WIRE_HELLO len");
+	}
+
+	memcpy(&hello, buf, sizeof(hello));
+	version = ntohl(hello.version);
+	if (version < WIRE_PROTOCOL_V1 || version > WIRE_PROTOCOL_VERSION)
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: bad WIRE_HELLO version");
+	}
+	DEBUGP("wire protocol version %d\n", version);
+	wire_client->protocol_version = version;
+}
+
 /* Serialize client-side argv into a single string with '\0'
  * characters between args. We do not send the -wire_client argument,
  * since we don't want to give the server an identity crisis.
@@ -118,10 +185,55 @@ static void wire_client_send_script_path(struct wire_client *wire_client,
 		                "error sending WIRE_SCRIPT_PATH");
 }
 
-/* Send the ASCII contents of the script we're about to run. */
+/* Offer the server a digest of the script we're about to run, and
+ * return whether the server says it already has that script.
+ */
+static bool wire_client_offer_script_digest(struct wire_client *wire_client,
+                                            const struct script *script)
+{
+	u8 digest[SCRIPT_DIGEST_BYTES];
+	struct wire_script_cached cached;
+	enum wire_op_t op = WIRE_INVALID;
+	void *buf = NULL;
+	int buf_len = -1;
+
+	script_digest(script->buffer, script->length, digest);
+	if (wire_conn_write(wire_client->wire_conn,
+	                    WIRE_SCRIPT_DIGEST,
+	                    digest, sizeof(digest)))
+		wire_client_die(wire_client,
+		                "error sending WIRE_SCRIPT_DIGEST");
+
+	if (wire_conn_read(wire_client->wire_conn,
+	                   &op, &buf, &buf_len))
+		wire_client_die(wire_client, "error reading WIRE_SCRIPT_CACHED");
+	if (op != WIRE_SCRIPT_CACHED)
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: expected WIRE_SCRIPT_CACHED");
+	}
+	if (buf_len != sizeof(cached))
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: bad WIRE_SCRIPT_CACHED length");
+	}
+
+	memcpy(&cached, buf, sizeof(cached));
+	DEBUGP("wire server %s the script\n",
+	       ntohl(cached.cached) ? "has" : "does not have");
+	return ntohl(cached.cached) != 0;
+}
+
+/* Send the ASCII contents of the script we're about to run, unless
+ * the server already has it.
+ */
 static void wire_client_send_script(struct wire_client *wire_client,
                                     const struct script *script)
 {
+	if (wire_client->protocol_version >= WIRE_PROTOCOL_V2 &&
+	        wire_client_offer_script_digest(wire_client, script))
+		return;
+
 	if (wire_conn_write(wire_client->wire_conn,
 	                    WIRE_SCRIPT,
 	                    script->buffer, script->length))
@@ -163,64 +275,196 @@ static void wire_client_receive_server_ready(struct wire_client *wire_client)
 	}
 }
 
-/* Tell server that client is starting script execution. */
-void wire_client_send_client_starting(struct wire_client *wire_client)
+/* Send one clock probe to the server and wait for its answer. Fill in
+ * the four NTP timestamps: t1 and t4 on our clock, t2 and t3 on the
+ * server's.
+ */
+static void wire_client_probe_clock(struct wire_client *wire_client,
+                                    s64 *t1, s64 *t2, s64 *t3, s64 *t4)
 {
+	struct wire_clock_ping ping;
+	struct wire_clock_pong pong;
+	enum wire_op_t op = WIRE_INVALID;
+	void *buf = NULL;
+	int buf_len = -1;
+
+	*t1 = now_usecs();
+	ping.client_send_usecs = wire_hton64(*t1);
+	if (wire_conn_write(wire_client->wire_conn,
+	                    WIRE_CLOCK_PING,
+	                    &ping, sizeof(ping)))
+		wire_client_die(wire_client, "error sending WIRE_CLOCK_PING");
+
+	if (wire_conn_read(wire_client->wire_conn,
+	                   &op, &buf, &buf_len))
+		wire_client_die(wire_client, "error reading WIRE_CLOCK_PONG");
+	*t4 = now_usecs();
+	if (op != WIRE_CLOCK_PONG)
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: expected WIRE_CLOCK_PONG");
+	}
+	if (buf_len != sizeof(pong))
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: bad WIRE_CLOCK_PONG len");
+	}
+	memcpy(&pong, buf, sizeof(pong));
+	if (wire_ntoh64(pong.client_send_usecs) != *t1)
+	{
+		wire_client_die(wire_client,
+		                "bad wire server: WIRE_CLOCK_PONG mismatch");
+	}
+	*t2 = wire_ntoh64(pong.server_receive_usecs);
+	*t3 = wire_ntoh64(pong.server_send_usecs);
+}
+
+/* Estimate the offset of the server's clock from ours, NTP-style. For
+ * each probe, offset = ((t2 - t1) + (t3 - t4)) / 2 and the round trip
+ * spent on the network is rtt = (t4 - t1) - (t3 - t2). We keep the
+ * probe with the lowest RTT, since it leaves the least room for
+ * asymmetric delays; the true offset is within rtt/2 of its estimate.
+ */
+static void wire_client_sync_clock(struct wire_client *wire_client,
+                                   const struct config *config)
+{
+	s64 t1, t2, t3, t4, rtt_usecs;
+	int i;
+
+	/* A version 1 server measures from when our messages arrive. */
+	if (wire_client->protocol_version < WIRE_PROTOCOL_V2)
+	{
+		wire_client->clock_offset_usecs = 0;
+		wire_client->clock_rtt_usecs = 0;
+		return;
+	}
+
+	wire_client->clock_rtt_usecs = -1;
+	for (i = 0; i < WIRE_CLOCK_PROBES; ++i)
+	{
+		wire_client_probe_clock(wire_client, &t1, &t2, &t3, &t4);
+		rtt_usecs = (t4 - t1) - (t3 - t2);
+		if (rtt_usecs < 0)
+			rtt_usecs = 0;
+		if (wire_client->clock_rtt_usecs < 0 ||
+		        rtt_usecs < wire_client->clock_rtt_usecs)
+		{
+			wire_client->clock_rtt_usecs = rtt_usecs;
+			wire_client->clock_offset_usecs =
+			    ((t2 - t1) + (t3 - t4)) / 2;
+		}
+	}
+
+	if (config->verbose)
+	{
+		printf("wire clock: offset %lld usecs, rtt %lld usecs, "
+		       "uncertainty +/-%lld usecs\n",
+		       wire_client->clock_offset_usecs,
+		       wire_client->clock_rtt_usecs,
+		       wire_client->clock_rtt_usecs / 2);
+	}
+	if (wire_client->clock_rtt_usecs / 2 > config->tolerance_usecs)
+	{
+		fprintf(stderr,
+		        "warning: wire clock uncertainty +/-%lld usecs "
+		        "exceeds --tolerance_usecs=%d\n",
+		        wire_client->clock_rtt_usecs / 2,
+		        config->tolerance_usecs);
+	}
+}
+
+/* Tell server that client is starting script execution, and when. */
+void wire_client_send_client_starting(struct wire_client *wire_client,
+                                      s64 start_usecs)
+{
+	struct wire_client_starting starting;
+	int starting_len = (wire_client->protocol_version >= WIRE_PROTOCOL_V2) ?
+	                   sizeof(starting) : 0;
+
+	starting.start_usecs =
+	    wire_hton64(start_usecs + wire_client->clock_offset_usecs);
+	starting.uncertainty_usecs = htonl(wire_client->clock_rtt_usecs / 2);
 	if (wire_conn_write(wire_client->wire_conn,
 	                    WIRE_CLIENT_STARTING,
-	                    NULL, 0))
+	                    &starting, starting_len))
 		wire_client_die(wire_client,
 		                "error sending WIRE_CLIENT_STARTING");
 }
 
-/* Send a client request for the server to execute some packet events. */
-static void wire_client_send_packets_start(struct wire_client *wire_client)
+/* Send a client request for the server to execute some packet events,
+ * noting when our previous event finished at 'prev_end_usecs'.
+ */
+static void wire_client_send_packets_start(struct wire_client *wire_client,
+                                           s64 prev_end_usecs)
 {
 	struct wire_packets_start start;
+	int start_len = (wire_client->protocol_version >= WIRE_PROTOCOL_V2) ?
+	                sizeof(start) : WIRE_PACKETS_START_V1_LEN;
+
 	start.num_events = htonl(wire_client->num_events);
+	start.prev_end_usecs =
+	    wire_hton64(prev_end_usecs + wire_client->clock_offset_usecs);
 	if (wire_conn_write(wire_client->wire_conn,
 	                    WIRE_PACKETS_START,
-	                    &start, sizeof(start)))
+	                    &start, start_len))
 		wire_client_die(wire_client,
 		                "error sending WIRE_PACKETS_START");
 }
 
-/* Receive a message from the server that the server is done executing
- * some packet events. Print any warnings we receive along the way.
+/* Remember that the server owes us a WIRE_PACKETS_DONE message for
+ * the packet events before the current one.
  */
-static void wire_client_receive_packets_done(struct wire_client *wire_client)
+static void wire_client_expect_packets_done(struct wire_client *wire_client)
+{
+	if (wire_client->num_pending_done == wire_client->pending_done_space)
+	{
+		wire_client->pending_done_space =
+		    2 * wire_client->pending_done_space + 4;
+		wire_client->pending_done =
+		    realloc(wire_client->pending_done,
+		            wire_client->pending_done_space * sizeof(int));
+	}
+	wire_client->pending_done[wire_client->num_pending_done++] =
+	    wire_client->num_events;
+}
+
+/* Read one message the server sent while executing packet events.
+ * Print any warning; check a WIRE_PACKETS_DONE against the oldest
+ * batch of packet events we're waiting on.
+ */
+static void wire_client_receive_packets_message(
+    struct wire_client *wire_client)
 {
 	enum wire_op_t op;
 	struct wire_packets_done done;
+	int done_len = (wire_client->protocol_version >= WIRE_PROTOCOL_V2) ?
+	               sizeof(done) : WIRE_PACKETS_DONE_V1_LEN;
 	void *buf = NULL;
 	int buf_len = -1;
+	int expected_events = 0;
 
-	DEBUGP("wire_client_receive_packets_done\n");
+	DEBUGP("wire_client_receive_packets_message\n");
 
-	while (1)
+	if (wire_conn_read(wire_client->wire_conn,
+	                   &op, &buf, &buf_len))
+		wire_client_die(wire_client, "error reading");
+	if (op == WIRE_PACKETS_WARN)
 	{
-		if (wire_conn_read(wire_client->wire_conn,
-		                   &op, &buf, &buf_len))
-			wire_client_die(wire_client, "error reading");
-		if (op == WIRE_PACKETS_DONE)
-			break;
-		else if (op == WIRE_PACKETS_WARN)
-		{
-			/* NULL-terminate the warning and print it. */
-			char *warning = strndup(buf, buf_len);
-			fprintf(stderr, "%s", warning);
-			free(warning);
-		}
-		else
-		{
-			wire_client_die(
-			    wire_client,
-			    "bad wire server: expected "
-			    "WIRE_PACKETS_DONE or WIRE_PACKETS_WARN");
-		}
+		/* NULL-terminate the warning and print it. */
+		char *warning = strndup(buf, buf_len);
+		fprintf(stderr, "%s", warning);
+		free(warning);
+		return;
+	}
+	else if (op != WIRE_PACKETS_DONE)
+	{
+		wire_client_die(
+		    wire_client,
+		    "bad wire server: expected "
+		    "WIRE_PACKETS_DONE or WIRE_PACKETS_WARN");
 	}
 
-	if (buf_len < sizeof(done) + 1)
+	if (buf_len < done_len + 1)
 	{
 		wire_client_die(wire_client,
 		                "bad wire server: bad WIRE_PACKETS_DONE len");
@@ -231,29 +475,56 @@ static void wire_client_receive_packets_done(struct wire_client *wire_client)
 		                "bad wire server: missing string terminator");
 	}
 
-	memcpy(&done, buf, sizeof(done));
+	memset(&done, 0, sizeof(done));
+	memcpy(&done, buf, done_len);
+
+	assert(wire_client->num_pending_done > 0);
+	expected_events = wire_client->pending_done[0];
+	--wire_client->num_pending_done;
+	memmove(wire_client->pending_done, wire_client->pending_done + 1,
+	        wire_client->num_pending_done * sizeof(int));
 
 	if (ntohl(done.result) == STATUS_ERR)
 	{
 		/* Die with the error message from the server, which
 		 * is a C string following the fixed "done" message.
 		 */
-		die("%s", (char *)(buf + sizeof(done)));
+		die("%s", (char *)(buf + done_len));
 	}
-	else if (ntohl(done.num_events) != wire_client->num_events)
+	else if (ntohl(done.num_events) != expected_events)
 	{
 		char *msg = NULL;
 #ifdef ECOS
 		int len = strlen("bad wire server: bad message count: got:  vs expected: ") + 16;
 		msg = malloc(len);
-		snprintf(msg, len, "bad wire server: bad message count: got: %d vs expected: %d", ntohl(done.num_events), wire_client->num_events);
+		snprintf(msg, len, "bad wire server: bad message count: got: %d vs expected: %d", ntohl(done.num_events), expected_events);
 #else
 		asprintf(&msg, "bad wire server: bad message count: "
 		         "got: %d vs expected: %d",
-		         ntohl(done.num_events), wire_client->num_events);
+		         ntohl(done.num_events), expected_events);
 #endif
 		wire_client_die(wire_client, msg);
 	}
+
+	/* A version 1 server just tells us it finished now. */
+	if (wire_client->protocol_version >= WIRE_PROTOCOL_V2)
+		wire_client->last_done_usecs =
+		    wire_ntoh64(done.end_usecs) -
+		    wire_client->clock_offset_usecs;
+	else
+		wire_client->last_done_usecs = now_usecs();
+}
+
+/* Handle messages from the server until it has finished all the
+ * packet events we asked for. If 'block' is false, only handle the
+ * messages that have already arrived.
+ */
+static void wire_client_receive_packets_done(struct wire_client *wire_client,
+                                             bool block)
+{
+	while (wire_client->num_pending_done > 0 &&
+	        (block || wire_conn_has_message(wire_client->wire_conn)))
+		wire_client_receive_packets_message(wire_client);
 }
 
 /* Connect to the wire server, pass it our command line argument
@@ -267,13 +538,12 @@ int wire_client_init(struct wire_client *wire_client,
 	DEBUGP("wire_client_init\n");
 	assert(config->is_wire_client);
 
+	wire_client->config = config;
+
 	get_hw_address(config->wire_client_device,
 	               &wire_client->client_ether_addr);
 
-	wire_client->wire_conn = wire_conn_new();
-	wire_conn_connect(wire_client->wire_conn,
-	                  &config->wire_server_ip,
-	                  config->wire_server_port);
+	wire_client_connect(wire_client, config);
 
 	wire_client_send_args(wire_client, config);
 
@@ -285,6 +555,8 @@ int wire_client_init(struct wire_client *wire_client,
 
 	wire_client_receive_server_ready(wire_client);
 
+	wire_client_sync_clock(wire_client, config);
+
 	return STATUS_OK;
 }
 
@@ -297,27 +569,55 @@ int wire_client_init(struct wire_client *wire_client,
  * not an on-the-wire event, or (ii) already knows what time to fire
  * this on-the-wire event because the previous event was also an
  * on-the-wire event.
+ *
+ * After a batch of packet events, we wait for the server to finish
+ * them only if this event has to come after them and the script's
+ * timing alone does not ensure that; otherwise the server's results
+ * are collected as they arrive. Either way, relative times are
+ * measured from when the previous event actually finished, on whichever
+ * host ran it, so the round trip to the server doesn't count against
+ * the script's timing.
  */
-void wire_client_next_event(struct wire_client *wire_client,
-                            struct event *event)
+s64 wire_client_next_event(struct wire_client *wire_client,
+                           struct event *event)
 {
+	const struct config *config = wire_client->config;
+	s64 prev_end_usecs = now_usecs();
+
 	/* Tell the server to start executing packet events. */
 	if (event && (event->type == PACKET_EVENT) &&
 	        (wire_client->last_event_type != PACKET_EVENT))
 	{
-		wire_client_send_packets_start(wire_client);
+		wire_client_send_packets_start(wire_client, prev_end_usecs);
 	}
 
 	/* Get the result from server execution of one or more packet events. */
 	if ((!event || (event->type != PACKET_EVENT)) &&
 	        (wire_client->last_event_type == PACKET_EVENT))
 	{
-		wire_client_receive_packets_done(wire_client);
+		wire_client_expect_packets_done(wire_client);
+		if (!event ||
+		        wire_client->protocol_version < WIRE_PROTOCOL_V2 ||
+		        !wire_events_are_ordered(wire_client->last_event, event,
+		                                 config->tolerance_usecs,
+		                                 wire_client->clock_rtt_usecs / 2))
+		{
+			wire_client_receive_packets_done(wire_client, true);
+			prev_end_usecs = wire_client->last_done_usecs;
+		}
 	}
 
+	/* Pick up results that are already here, so that a failure on
+	 * the server stops us promptly; at the end, wait for them all.
+	 */
+	wire_client_receive_packets_done(wire_client, event == NULL);
+
 	if (event)
 	{
 		wire_client->last_event_type = event->type;
+		wire_client->last_event = event;
 		++wire_client->num_events;
 	}
+
+	return prev_end_usecs;
 }
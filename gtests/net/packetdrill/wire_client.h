@@ -41,8 +41,23 @@ struct wire_client {
 
 	struct ether_addr client_ether_addr;	/* wire client hardware addr */
 
+	const struct config *config;		/* run-time configuration */
+	int protocol_version;			/* agreed with the server */
+
+	s64 clock_offset_usecs;		/* server clock minus our clock */
+	s64 clock_rtt_usecs;		/* RTT of best clock probe */
+
 	enum event_t last_event_type;	/* type of previous event */
+	struct event *last_event;		/* previous event, or NULL */
 	int num_events;				/* events executed so far */
+
+	/* Event counts expected in WIRE_PACKETS_DONE messages the server
+	 * has yet to send us, oldest first.
+	 */
+	int *pending_done;
+	int num_pending_done;
+	int pending_done_space;
+	s64 last_done_usecs;		/* when server finished last batch */
 };
 
 /* Allocate a new wire_client. */
@@ -57,14 +72,19 @@ extern int wire_client_init(struct wire_client *wire_client,
 /* Delete a wire_client and its associated objects. */
 extern void wire_client_free(struct wire_client *wire_client);
 
-/* Send a message that the client is starting now. */
-extern void wire_client_send_client_starting(struct wire_client *wire_client);
+/* Send a message that the client is starting script execution at
+ * 'start_usecs' on our clock, so the server can use the same timebase.
+ */
+extern void wire_client_send_client_starting(struct wire_client *wire_client,
+					     s64 start_usecs);
 
 /* Tell the client state machine that the script interpreter has moved
  * on to the next event, and is about to wait for and execute the
- * given event.
+ * given event. Returns the now_usecs() time at which the previous
+ * event finished, which is where relative times for this event are
+ * measured from.
  */
-extern void wire_client_next_event(struct wire_client *wire_client,
-				   struct event *event);
+extern s64 wire_client_next_event(struct wire_client *wire_client,
+				  struct event *event);
 
 #endif /* __WIRE_CLIENT_H__ */
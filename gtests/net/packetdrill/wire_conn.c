@@ -29,6 +29,7 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "logging.h"
@@ -166,16 +167,15 @@ void wire_conn_accept(struct wire_conn *listen_conn,
 	set_default_tcp_options(*accepted_conn);
 }
 
-/* Do blocking writes until all bytes are written.  Given our large
- * socket buffer size and typically small write sizes, in practice all
- * the writes should complete in one call.
+/* Do blocking writes until all bytes in the given iovecs are written.
+ * Given our large socket buffer size and typically small write sizes,
+ * in practice all the writes should complete in one call.
  */
-static int write_bytes(struct wire_conn *conn,
-                       const void *buf, int buf_len)
+static int write_iov(struct wire_conn *conn, struct iovec *iov, int iov_len)
 {
-	while (buf_len > 0)
+	while (iov_len > 0)
 	{
-		int bytes_written = write(conn->fd, buf, buf_len);
+		ssize_t bytes_written = writev(conn->fd, iov, iov_len);
 		if (bytes_written < 0)
 		{
 			if (errno == EINTR || errno == EAGAIN)
@@ -188,9 +188,18 @@ static int write_bytes(struct wire_conn *conn,
 				return STATUS_ERR;
 			}
 		}
-		assert(bytes_written <= buf_len);
-		buf_len -= bytes_written;
-		buf += bytes_written;
+		/* Skip past what was written, in case of a short write. */
+		while (iov_len > 0 && bytes_written >= iov->iov_len)
+		{
+			bytes_written -= iov->iov_len;
+			++iov;
+			--iov_len;
+		}
+		if (iov_len > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + bytes_written;
+			iov->iov_len -= bytes_written;
+		}
 	}
 	return STATUS_OK;
 }
@@ -202,48 +211,99 @@ int wire_conn_write(struct wire_conn *conn,
 	DEBUGP("wire_conn_write -> op: %s\n",
 	       wire_op_to_string(op));
 	struct wire_header header;
+	struct iovec iov[2];
 
 	header.length	= htonl(sizeof(header) + buf_len);
 	header.op	= htonl(op);
 
-	if (write_bytes(conn, &header, sizeof(header)))
-		return STATUS_ERR;
+	iov[0].iov_base	= &header;
+	iov[0].iov_len	= sizeof(header);
+	iov[1].iov_base	= (void *)buf;
+	iov[1].iov_len	= buf_len;
 
-	if (write_bytes(conn, buf, buf_len))
-		return STATUS_ERR;
+	return write_iov(conn, iov, buf_len > 0 ? 2 : 1);
+}
 
-	return STATUS_OK;
+/* Make room for at least 'bytes' bytes of data in the input buffer. */
+static void reserve_input(struct wire_conn *conn, int bytes)
+{
+	struct wire_conn_buffer *in = &conn->in;
+
+	if (in->buf_space < bytes)
+	{
+		in->buf_space = 2 * bytes;
+		in->buf = realloc(in->buf, in->buf_space);
+	}
 }
 
-/* Do blocking reads until we've read the given number of bytes. */
-static int read_bytes(struct wire_conn *conn,
-                      void *buf, int buf_len)
+/* Read whatever the socket has for us into the free space of the
+ * input buffer. Returns the number of bytes read, 0 if 'flags' asked
+ * us not to block and there was nothing to read, or -1 on error or
+ * if the remote side closed the connection.
+ */
+static int fill_input(struct wire_conn *conn, int flags)
 {
-	while (buf_len > 0)
+	struct wire_conn_buffer *in = &conn->in;
+
+	while (1)
 	{
-		int bytes_read = read(conn->fd, buf, buf_len);
+		int bytes_read = recv(conn->fd, in->buf + in->used,
+		                      in->buf_space - in->used, flags);
 		if (bytes_read < 0)
 		{
-			if (errno == EINTR || errno == EAGAIN)
-			{
+			if (errno == EINTR)
 				continue;
-			}
-			else
-			{
-				perror("TCP socket read");
-				return STATUS_ERR;
-			}
+			if (errno == EAGAIN && (flags & MSG_DONTWAIT))
+				return 0;
+			if (errno == EAGAIN)
+				continue;
+			perror("TCP socket read");
+			return -1;
 		}
 		else if (bytes_read == 0)
 		{
 			fprintf(stderr, "remote side closed connection\n");
-			return STATUS_ERR;
+			return -1;
 		}
-		assert(bytes_read <= buf_len);
-		buf_len -= bytes_read;
-		buf += bytes_read;
+		in->used += bytes_read;
+		return bytes_read;
 	}
-	return STATUS_OK;
+}
+
+/* Drop the message handed out by the previous wire_conn_read(),
+ * keeping any bytes of later messages we have already read.
+ */
+static void drop_consumed_input(struct wire_conn *conn)
+{
+	struct wire_conn_buffer *in = &conn->in;
+
+	if (in->consumed == 0)
+		return;
+	memmove(in->buf, in->buf + in->consumed, in->used - in->consumed);
+	in->used -= in->consumed;
+	in->consumed = 0;
+}
+
+/* Return the total length of the first buffered message, 0 if we
+ * don't have its whole header yet, or -1 if the header is invalid.
+ */
+static int buffered_message_len(struct wire_conn *conn)
+{
+	struct wire_header header;
+	int length = 0;
+
+	if (conn->in.used < sizeof(header))
+		return 0;
+	memcpy(&header, conn->in.buf, sizeof(header));
+	length = ntohl(header.length);
+	if ((length < (int)sizeof(header)) ||
+	        (length - (int)sizeof(header) > MAX_MESSAGE_BYTES))
+	{
+		fprintf(stderr, "invalid length %d from remote wire conn\n",
+		        length - (int)sizeof(header));
+		return -1;
+	}
+	return length;
 }
 
 int wire_conn_read(struct wire_conn *conn,
@@ -253,33 +313,55 @@ int wire_conn_read(struct wire_conn *conn,
 	DEBUGP("wire_conn_read\n");
 
 	struct wire_header header;
+	int length = 0;
 
-	if (read_bytes(conn, &header, sizeof(header)))
-		return STATUS_ERR;
-
-	*op = ntohl(header.op);
+	drop_consumed_input(conn);
 
-	DEBUGP("wire_conn_read -> op: %s\n", wire_op_to_string(*op));
-
-	*buf_len = ntohl(header.length) - sizeof(header);
-	if ((*buf_len < 0) || (*buf_len > MAX_MESSAGE_BYTES))
+	/* Read until we have the whole header, then the whole message.
+	 * Each read takes as much as the socket has, so small messages
+	 * that arrive back to back usually need just one read.
+	 */
+	reserve_input(conn, 4096);
+	while ((length = buffered_message_len(conn)) == 0)
 	{
-		fprintf(stderr, "invalid length %d from remote wire conn\n",
-		        *buf_len);
-		return STATUS_ERR;
+		if (fill_input(conn, 0) < 0)
+			return STATUS_ERR;
 	}
-
-	if (conn->in.buf_space < *buf_len)
+	if (length < 0)
+		return STATUS_ERR;
+	reserve_input(conn, length);
+	while (conn->in.used < length)
 	{
-		free(conn->in.buf);
-		conn->in.buf_space = 2 * *buf_len;
-		conn->in.buf = malloc(conn->in.buf_space);
+		if (fill_input(conn, 0) < 0)
+			return STATUS_ERR;
 	}
 
-	*buf = conn->in.buf;
+	memcpy(&header, conn->in.buf, sizeof(header));
+	*op = ntohl(header.op);
 
-	if (read_bytes(conn, *buf, *buf_len))
-		return STATUS_ERR;
+	DEBUGP("wire_conn_read -> op: %s\n", wire_op_to_string(*op));
+
+	*buf = conn->in.buf + sizeof(header);
+	*buf_len = length - sizeof(header);
+	conn->in.consumed = length;
 
 	return STATUS_OK;
 }
+
+bool wire_conn_has_message(struct wire_conn *conn)
+{
+	int length = 0;
+
+	drop_consumed_input(conn);
+	reserve_input(conn, 4096);
+	length = buffered_message_len(conn);
+	if (length == 0 || conn->in.used < length)
+	{
+		if (length > 0)
+			reserve_input(conn, length);
+		if (fill_input(conn, MSG_DONTWAIT) < 0)
+			return false;
+		length = buffered_message_len(conn);
+	}
+	return (length > 0) && (conn->in.used >= length);
+}
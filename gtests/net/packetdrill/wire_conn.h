@@ -35,6 +35,7 @@ struct wire_conn_buffer {
 	char *buf;	/* malloc-allocated buffer */
 	int buf_space;	/* bytes allocated in malloc-allocated "buf" buffer */
 	int used;	/* bytes of actual data at the start of "buf" */
+	int consumed;	/* bytes of the message last returned from "buf" */
 };
 
 /* A TCP socket used for client<->server communication for doing
@@ -65,7 +66,9 @@ void wire_conn_bind_listen(struct wire_conn *listen_conn, u16 port);
 void wire_conn_accept(struct wire_conn *listen_conn,
 		      struct wire_conn **accepted_conn);
 
-/* Blocking write of a single message. */
+/* Blocking write of a single message, with a single writev() call
+ * for the header and body in the common case.
+ */
 int wire_conn_write(struct wire_conn *conn,
 		    enum wire_op_t op,
 		    const void *buf, int buf_len);
@@ -81,4 +84,12 @@ int wire_conn_read(struct wire_conn *conn,
 		   enum wire_op_t *op,
 		   void **buf, int *buf_len);
 
+/* Non-blocking check: pull in whatever bytes the remote side has sent
+ * so far and return true iff a whole message is ready, so that the next
+ * wire_conn_read() will not block. Returns false on errors; those are
+ * reported by the next wire_conn_read(). Like wire_conn_read(), this
+ * invalidates the buffer returned by the previous wire_conn_read().
+ */
+bool wire_conn_has_message(struct wire_conn *conn);
+
 #endif /* __WIRE_CONN_H__ */
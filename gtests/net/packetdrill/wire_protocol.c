@@ -24,6 +24,8 @@
 
 #include "wire_protocol.h"
 
+#include "script.h"
+
 const char *wire_op_to_string(enum wire_op_t op)
 {
 	if (op < WIRE_INVALID)
@@ -41,9 +43,72 @@ const char *wire_op_to_string(enum wire_op_t op)
 	case WIRE_PACKETS_START:	return "WIRE_PACKETS_START";
 	case WIRE_PACKETS_WARN:		return "WIRE_PACKETS_WARN";
 	case WIRE_PACKETS_DONE:		return "WIRE_PACKETS_DONE";
+	case WIRE_CLOCK_PING:		return "WIRE_CLOCK_PING";
+	case WIRE_CLOCK_PONG:		return "WIRE_CLOCK_PONG";
+	case WIRE_SCRIPT_DIGEST:	return "WIRE_SCRIPT_DIGEST";
+	case WIRE_SCRIPT_CACHED:	return "WIRE_SCRIPT_CACHED";
+	case WIRE_HELLO:		return "WIRE_HELLO";
 	case WIRE_NUM_OPS:		return "WIRE_NUM_OPS";
 	/* We omit the default case so compiler catches missing values. */
 	}
 	assert(!"not reached");
 	return "";
 }
+
+__be64 wire_hton64(u64 value)
+{
+	__be32 words[2] = { htonl(value >> 32), htonl(value & 0xffffffff) };
+	__be64 result;
+
+	memcpy(&result, words, sizeof(result));
+	return result;
+}
+
+u64 wire_ntoh64(__be64 value)
+{
+	__be32 words[2];
+
+	memcpy(words, &value, sizeof(words));
+	return ((u64)ntohl(words[0]) << 32) | ntohl(words[1]);
+}
+
+/* Return the latest script time at which 'event' may finish, or -1 if
+ * that is only known at run time.
+ */
+static s64 latest_end_usecs(const struct event *event)
+{
+	s64 end_usecs = -1;
+
+	if (event->time_type == ABSOLUTE_TIME)
+		end_usecs = event->time_usecs;
+	else if (event->time_type == ABSOLUTE_RANGE_TIME)
+		end_usecs = event->time_usecs_end;
+	else
+		return -1;
+
+	if (event->type == SYSCALL_EVENT &&
+	    is_blocking_syscall(event->event.syscall) &&
+	    event->event.syscall->end_usecs > end_usecs)
+		end_usecs = event->event.syscall->end_usecs;
+
+	return end_usecs;
+}
+
+bool wire_events_are_ordered(const struct event *prev,
+			     const struct event *next,
+			     int tolerance_usecs,
+			     s64 uncertainty_usecs)
+{
+	s64 prev_end_usecs = -1;
+
+	if (prev == NULL)
+		return false;
+	prev_end_usecs = latest_end_usecs(prev);
+	if (prev_end_usecs < 0)
+		return false;
+	if (next->time_type != ABSOLUTE_TIME &&
+	    next->time_type != ABSOLUTE_RANGE_TIME)
+		return false;
+	return (next->time_usecs >
+		prev_end_usecs + tolerance_usecs + uncertainty_usecs);
+}
@@ -27,6 +27,8 @@
 
 #include "types.h"
 
+#include <stddef.h>
+
 /* Types of messages wire_client and wire_server send to each other. */
 enum wire_op_t {
 	WIRE_INVALID = 0,	/* invalid OP */
@@ -39,28 +41,115 @@ enum wire_op_t {
 	WIRE_PACKETS_START,	/* "please start handling packet events" */
 	WIRE_PACKETS_WARN,	/* "here's a warning about fishy packets" */
 	WIRE_PACKETS_DONE,	/* "i'm done handling packet events" */
+	WIRE_CLOCK_PING,	/* "what time is it on your clock?" */
+	WIRE_CLOCK_PONG,	/* "here's what time it is on my clock" */
+	WIRE_SCRIPT_DIGEST,	/* "here's a digest of the script" */
+	WIRE_SCRIPT_CACHED,	/* "whether i already have that script" */
+	WIRE_HELLO,		/* "here's the protocol version i speak" */
 	WIRE_NUM_OPS,
 };
 
+/* Versions of the wire protocol. Version 1 clients and servers predate
+ * WIRE_HELLO, clock probes, timestamped WIRE_PACKETS_START and
+ * WIRE_PACKETS_DONE messages, and script digests. Current clients open
+ * the connection with a WIRE_HELLO carrying the newest version they
+ * speak; the server answers with the version both sides will use.
+ */
+#define WIRE_PROTOCOL_V1	1
+#define WIRE_PROTOCOL_V2	2
+#define WIRE_PROTOCOL_VERSION	WIRE_PROTOCOL_V2
+
 /* Return the human-readable name for a given op (static string). */
 extern const char *wire_op_to_string(enum wire_op_t op);
 
+/* Convert 64-bit message fields to and from network order. */
+extern __be64 wire_hton64(u64 value);
+extern u64 wire_ntoh64(__be64 value);
+
 /* Header prefix before all messages in both directions. */
 struct wire_header {
 	__be32 length;	/* bytes in message (network order), including header */
 	__be32 op;	/* enum wire_op_t (network order) */
 };
 
-/* A client request for the server to execute some packet events. */
+/* The body of a WIRE_HELLO in either direction. */
+struct wire_hello {
+	__be32 version;		/* WIRE_PROTOCOL_V* (network order) */
+};
+
+/* A client probe to estimate the offset between the client and
+ * server clocks, NTP-style. The server answers with a wire_clock_pong.
+ */
+struct wire_clock_ping {
+	__be64 client_send_usecs;	/* client time when ping was sent */
+};
+
+/* The server's answer to a wire_clock_ping. */
+struct wire_clock_pong {
+	__be64 client_send_usecs;	/* echoed from the wire_clock_ping */
+	__be64 server_receive_usecs;	/* server time when ping arrived */
+	__be64 server_send_usecs;	/* server time when pong was sent */
+};
+
+/* The server's answer to a WIRE_SCRIPT_DIGEST, whose body is the
+ * script_digest() of the script text. If the server has already parsed
+ * a script with that digest under the same command line, the client
+ * skips sending WIRE_SCRIPT.
+ */
+struct wire_script_cached {
+	__be32 cached;		/* 1 if the server has the script, else 0 */
+};
+
+/* The client is starting script execution. Version 1 clients send an
+ * empty WIRE_CLIENT_STARTING message instead.
+ */
+struct wire_client_starting {
+	__be64 start_usecs;		/* client start time, on server clock */
+	__be32 uncertainty_usecs;	/* error bound on start_usecs */
+} __packed;
+
+/* A client request for the server to execute some packet events.
+ * Version 1 clients send only num_events.
+ */
 struct wire_packets_start {
 	__be32 num_events;	/* total events executed (network order) */
-};
+	__be64 prev_end_usecs;	/* when the client's last event finished,
+				 * on the server clock */
+} __packed;
 
-/* The server is done executing some packet events. */
+/* The server is done executing some packet events. Version 1 clients
+ * are sent this without end_usecs.
+ */
 struct wire_packets_done {
 	__be32 result;		/* STATUS_OK or TCPEST_ERR (network order) */
 	__be32 num_events;	/* total events executed (network order) */
+	__be64 end_usecs;	/* when the server's last packet event
+				 * finished, on the server clock */
 	char error_message[0];	/* '\0'-teriminated error message, or empty */
 };
 
+/* Bytes in the wire_packets_start and wire_packets_done messages
+ * exchanged under version 1 of the protocol.
+ */
+#define WIRE_PACKETS_START_V1_LEN	offsetof(struct wire_packets_start, \
+						 prev_end_usecs)
+#define WIRE_PACKETS_DONE_V1_LEN	offsetof(struct wire_packets_done, \
+						 end_usecs)
+
+struct event;
+
+/* Both sides of an on-the-wire test read the whole script, so each
+ * knows the full schedule of the other's events. Return true iff the
+ * schedule alone guarantees that 'next' starts after 'prev' finishes:
+ * both have absolute times and 'next' is due after the latest time at
+ * which 'prev' may finish, allowing for 'tolerance_usecs' of lateness
+ * and 'uncertainty_usecs' of error in the offset between the two
+ * hosts' clocks. If so, the side running 'next' need not wait to hear
+ * that the other side has finished 'prev'.
+ */
+extern bool wire_events_are_ordered(const struct event *prev,
+				    const struct event *next,
+				    int tolerance_usecs,
+				    s64 uncertainty_usecs);
+
 #endif /* __WIRE_PROTOCOL_H__ */
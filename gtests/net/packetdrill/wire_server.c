@@ -31,6 +31,7 @@
 #include "link_layer.h"
 #include "logging.h"
 #include "run.h"
+#include "script_cache.h"
 #include "wire_conn.h"
 #include "wire_server.h"
 #include "wire_server_netdev.h"
@@ -52,22 +53,42 @@ struct wire_server
 	char *script_buffer;			/* contents of script */
 
 	char *wire_server_device;		/* name of our eth interface */
+	struct wire_server_demux *demux;	/* shared capture, or NULL */
 	struct ether_addr client_ether_addr;	/* wire client hardware addr */
 	struct ether_addr server_ether_addr;	/* wire server hardware addr */
 
 	enum event_t last_event_type;	/* type of previous event */
+	struct event *last_event;		/* previous event, or NULL */
 	int num_events;				/* events executed so far */
+
+	/* Protocol version agreed with the client. From version 2 on,
+	 * the client sends timestamped WIRE_PACKETS_START messages, so we
+	 * need not wait for those the script's timing already orders.
+	 */
+	int protocol_version;
+	s64 clock_uncertainty_usecs;	/* error in client start time */
+
+	/* Event counts expected in WIRE_PACKETS_START messages the client
+	 * has sent or will send, oldest first.
+	 */
+	int *pending_start;
+	int num_pending_start;
+	int pending_start_space;
+	s64 last_start_usecs;		/* when client's last event ended */
 };
 
 static struct wire_server *wire_server_new(struct wire_conn *accepted_conn,
                                            const char *wire_server_device,
-                                           u16 wire_server_port)
+                                           u16 wire_server_port,
+                                           struct wire_server_demux *demux)
 {
 	struct wire_server *wire_server = calloc(1, sizeof(struct wire_server));
 	wire_server->wire_conn = accepted_conn;
 	wire_server->wire_server_device = strdup(wire_server_device);
+	wire_server->demux = demux;
 	get_hw_address(wire_server_device, &wire_server->server_ether_addr);
 	wire_server->port = wire_server_port;
+	wire_server->protocol_version = WIRE_PROTOCOL_V1;
 	return wire_server;
 }
 
@@ -77,6 +98,7 @@ static void wire_server_free(struct wire_server *wire_server)
 	free(wire_server->script_path);
 	free(wire_server->script_buffer);
 	free(wire_server->wire_server_device);
+	free(wire_server->pending_start);
 	memset(wire_server, 0, sizeof(*wire_server));  /* catch bugs */
 	free(wire_server);
 }
@@ -129,7 +151,47 @@ static void wire_server_unserialize_argv(struct wire_server *wire_server,
 	wire_server->argv = argv;
 }
 
-/* Receive a WIRE_COMMAND_LINE_ARGS message */
+/* Answer a client's WIRE_HELLO with the newest protocol version that
+ * both of us speak.
+ */
+static int wire_server_answer_hello(struct wire_server *wire_server,
+                                    const void *buf, int buf_len)
+{
+	struct wire_hello hello;
+	int version = 0;
+
+	if (buf_len != sizeof(hello))
+	{
+		fprintf(stderr,
+		        "bad wire client: bad WIRE_HELLO length\n");
+		return STATUS_ERR;
+	}
+	memcpy(&hello, buf, sizeof(hello));
+	version = ntohl(hello.version);
+	if (version < WIRE_PROTOCOL_V1)
+	{
+		fprintf(stderr,
+		        "bad wire client: bad protocol version %d\n", version);
+		return STATUS_ERR;
+	}
+	if (version > WIRE_PROTOCOL_VERSION)
+		version = WIRE_PROTOCOL_VERSION;
+	wire_server->protocol_version = version;
+
+	hello.version = htonl(version);
+	if (wire_conn_write(wire_server->wire_conn, WIRE_HELLO,
+	                    &hello, sizeof(hello)))
+	{
+		fprintf(stderr, "error sending WIRE_HELLO\n");
+		return STATUS_ERR;
+	}
+	return STATUS_OK;
+}
+
+/* Receive a WIRE_COMMAND_LINE_ARGS message. Current clients first
+ * agree on a protocol version with a WIRE_HELLO; version 1 clients
+ * start right in with their arguments.
+ */
 static int wire_server_receive_args(struct wire_server *wire_server)
 {
 	enum wire_op_t op = WIRE_INVALID;
@@ -138,6 +200,14 @@ static int wire_server_receive_args(struct wire_server *wire_server)
 
 	if (wire_conn_read(wire_server->wire_conn, &op, &buf, &buf_len))
 		return STATUS_ERR;
+	if (op == WIRE_HELLO)
+	{
+		if (wire_server_answer_hello(wire_server, buf, buf_len))
+			return STATUS_ERR;
+		if (wire_conn_read(wire_server->wire_conn,
+		                   &op, &buf, &buf_len))
+			return STATUS_ERR;
+	}
 	if (op != WIRE_COMMAND_LINE_ARGS)
 	{
 		fprintf(stderr,
@@ -172,15 +242,64 @@ static int wire_server_receive_script_path(struct wire_server *wire_server)
 	return STATUS_OK;
 }
 
-/* Receive the script we're about to run. */
+/* Answer a client's WIRE_SCRIPT_DIGEST, and if we have already parsed
+ * a script with that digest under the same command line, take our copy
+ * of its text. Returns STATUS_OK and sets *cached to say which.
+ */
+static int wire_server_answer_script_digest(struct wire_server *wire_server,
+                                            const void *digest,
+                                            int digest_len,
+                                            bool *cached)
+{
+	struct wire_script_cached reply;
+	int length = 0;
+
+	if (digest_len != SCRIPT_DIGEST_BYTES)
+	{
+		fprintf(stderr,
+		        "bad wire client: bad WIRE_SCRIPT_DIGEST length\n");
+		return STATUS_ERR;
+	}
+
+	wire_server->script_buffer =
+	    script_cache_find_text(wire_server->argc, wire_server->argv,
+	                           digest, &length);
+	*cached = (wire_server->script_buffer != NULL);
+
+	reply.cached = htonl(*cached);
+	if (wire_conn_write(wire_server->wire_conn, WIRE_SCRIPT_CACHED,
+	                    &reply, sizeof(reply)))
+	{
+		fprintf(stderr, "error sending WIRE_SCRIPT_CACHED\n");
+		return STATUS_ERR;
+	}
+	return STATUS_OK;
+}
+
+/* Receive the script we're about to run. Current clients first offer
+ * a digest of it, and only send the text if we don't have it.
+ */
 static int wire_server_receive_script(struct wire_server *wire_server)
 {
 	enum wire_op_t op = WIRE_INVALID;
 	void *buf = NULL;
 	int buf_len = -1;
+	bool cached = false;
 
 	if (wire_conn_read(wire_server->wire_conn, &op, &buf, &buf_len))
 		return STATUS_ERR;
+	if (op == WIRE_SCRIPT_DIGEST &&
+	        wire_server->protocol_version >= WIRE_PROTOCOL_V2)
+	{
+		if (wire_server_answer_script_digest(wire_server,
+		                                     buf, buf_len, &cached))
+			return STATUS_ERR;
+		if (cached)
+			return STATUS_OK;
+		if (wire_conn_read(wire_server->wire_conn,
+		                   &op, &buf, &buf_len))
+			return STATUS_ERR;
+	}
 	if (op != WIRE_SCRIPT)
 	{
 		fprintf(stderr,
@@ -193,7 +312,6 @@ static int wire_server_receive_script(struct wire_server *wire_server)
 	return STATUS_OK;
 }
 
-
 /* Receive the ethernet address to which the server should send packets. */
 static int wire_server_receive_hw_address(struct wire_server *wire_server)
 {
@@ -234,38 +352,126 @@ static int wire_server_send_server_ready(struct wire_server *wire_server)
 	return STATUS_OK;
 }
 
-/* Wait for the client to say it's starting script execution. */
+/* Answer a client clock probe that arrived at 'receive_usecs'. */
+static int wire_server_send_clock_pong(struct wire_server *wire_server,
+                                       const void *buf, int buf_len,
+                                       s64 receive_usecs)
+{
+	struct wire_clock_ping ping;
+	struct wire_clock_pong pong;
+
+	if (buf_len != sizeof(ping))
+	{
+		fprintf(stderr,
+		        "bad wire client: bad WIRE_CLOCK_PING length\n");
+		return STATUS_ERR;
+	}
+	memcpy(&ping, buf, sizeof(ping));
+
+	pong.client_send_usecs		= ping.client_send_usecs;
+	pong.server_receive_usecs	= wire_hton64(receive_usecs);
+	pong.server_send_usecs		= wire_hton64(now_usecs());
+	if (wire_conn_write(wire_server->wire_conn,
+	                    WIRE_CLOCK_PONG,
+	                    &pong, sizeof(pong)))
+	{
+		fprintf(stderr, "error sending WIRE_CLOCK_PONG\n");
+		return STATUS_ERR;
+	}
+	return STATUS_OK;
+}
+
+/* Answer the client's clock probes until it says it's starting script
+ * execution, then start our script timebase at the same instant as the
+ * client's, translated to our clock.
+ */
 static int wire_server_receive_client_starting(struct wire_server *wire_server)
 {
+	struct state *state = wire_server->state;
+	struct wire_client_starting starting;
 	enum wire_op_t op = WIRE_INVALID;
 	void *buf = NULL;
 	int buf_len = -1;
+	s64 receive_usecs = 0;
 
-	if (wire_conn_read(wire_server->wire_conn, &op, &buf, &buf_len))
-		return STATUS_ERR;
+	while (1)
+	{
+		if (wire_conn_read(wire_server->wire_conn,
+		                   &op, &buf, &buf_len))
+			return STATUS_ERR;
+		receive_usecs = now_usecs();
+		if (op != WIRE_CLOCK_PING)
+			break;
+		if (wire_server_send_clock_pong(wire_server, buf, buf_len,
+		                                receive_usecs))
+			return STATUS_ERR;
+	}
 	if (op != WIRE_CLIENT_STARTING)
 	{
 		fprintf(stderr,
 		        "bad wire client: expected WIRE_CLIENT_STARTING\n");
 		return STATUS_ERR;
 	}
-	if (buf_len != 0)
+
+	/* A version 1 client just tells us it's starting now. */
+	if (wire_server->protocol_version < WIRE_PROTOCOL_V2 && buf_len == 0)
+	{
+		state->live_start_time_usecs = receive_usecs;
+		return STATUS_OK;
+	}
+	if (wire_server->protocol_version < WIRE_PROTOCOL_V2 ||
+	        buf_len != sizeof(starting))
 	{
 		fprintf(stderr,
 		        "bad wire client: bad WIRE_CLIENT_STARTING length\n");
 		return STATUS_ERR;
 	}
 
+	memcpy(&starting, buf, sizeof(starting));
+	state->live_start_time_usecs = wire_ntoh64(starting.start_usecs);
+	wire_server->clock_uncertainty_usecs =
+	    ntohl(starting.uncertainty_usecs);
+	if (wire_server->config.verbose)
+	{
+		printf("wire clock: client start time %lld usecs "
+		       "(%lld usecs from now), uncertainty +/-%u usecs\n",
+		       state->live_start_time_usecs,
+		       state->live_start_time_usecs - receive_usecs,
+		       ntohl(starting.uncertainty_usecs));
+	}
+
 	return STATUS_OK;
 }
 
-/* Wait for the client request for the server to execute some packet events. */
+/* Remember that the client owes us a WIRE_PACKETS_START message for
+ * the packet events starting with the current one.
+ */
+static void wire_server_expect_packets_start(struct wire_server *wire_server)
+{
+	if (wire_server->num_pending_start == wire_server->pending_start_space)
+	{
+		wire_server->pending_start_space =
+		    2 * wire_server->pending_start_space + 4;
+		wire_server->pending_start =
+		    realloc(wire_server->pending_start,
+		            wire_server->pending_start_space * sizeof(int));
+	}
+	wire_server->pending_start[wire_server->num_pending_start++] =
+	    wire_server->num_events;
+}
+
+/* Read one client request for the server to execute some packet
+ * events, and check it against the oldest one we're expecting.
+ */
 static int wire_server_receive_packets_start(struct wire_server *wire_server)
 {
 	enum wire_op_t op = WIRE_INVALID;
 	void *buf = NULL;
 	int buf_len = -1;
+	int expected_events = 0;
 	struct wire_packets_start start;
+	int start_len = (wire_server->protocol_version >= WIRE_PROTOCOL_V2) ?
+	                sizeof(start) : WIRE_PACKETS_START_V1_LEN;
 
 	if (wire_conn_read(wire_server->wire_conn, &op, &buf, &buf_len))
 		return STATUS_ERR;
@@ -275,22 +481,53 @@ static int wire_server_receive_packets_start(struct wire_server *wire_server)
 		        "bad wire client: expected WIRE_PACKETS_START\n");
 		return STATUS_ERR;
 	}
-	if (buf_len != sizeof(start))
+	if (buf_len != start_len)
 	{
 		fprintf(stderr,
 		        "bad wire client: bad WIRE_PACKETS_START length\n");
 		return STATUS_ERR;
 	}
 
-	memcpy(&start, buf, sizeof(start));
-	if (ntohl(start.num_events) != wire_server->num_events)
+	memset(&start, 0, sizeof(start));
+	memcpy(&start, buf, buf_len);
+
+	assert(wire_server->num_pending_start > 0);
+	expected_events = wire_server->pending_start[0];
+	--wire_server->num_pending_start;
+	memmove(wire_server->pending_start, wire_server->pending_start + 1,
+	        wire_server->num_pending_start * sizeof(int));
+
+	if (ntohl(start.num_events) != expected_events)
 	{
 		fprintf(stderr,
 		        "bad client event count; expected %d but got %d",
-		        wire_server->num_events, ntohl(start.num_events));
+		        expected_events, ntohl(start.num_events));
 		return STATUS_ERR;
 	}
 
+	/* A version 1 client just tells us its last event finished now. */
+	if (wire_server->protocol_version >= WIRE_PROTOCOL_V2)
+		wire_server->last_start_usecs =
+		    wire_ntoh64(start.prev_end_usecs);
+	else
+		wire_server->last_start_usecs = now_usecs();
+
+	return STATUS_OK;
+}
+
+/* Handle client requests to execute packet events until we have all
+ * we're expecting. If 'block' is false, only handle the requests that
+ * have already arrived.
+ */
+static int wire_server_receive_packets_starts(struct wire_server *wire_server,
+                                              bool block)
+{
+	while (wire_server->num_pending_start > 0 &&
+	        (block || wire_conn_has_message(wire_server->wire_conn)))
+	{
+		if (wire_server_receive_packets_start(wire_server))
+			return STATUS_ERR;
+	}
 	return STATUS_OK;
 }
 
@@ -313,36 +550,63 @@ static int wire_server_send_packets_done(struct wire_server *wire_server,
                                          const char *error)
 {
 	struct wire_packets_done done;
+	int done_len = (wire_server->protocol_version >= WIRE_PROTOCOL_V2) ?
+	               sizeof(done) : WIRE_PACKETS_DONE_V1_LEN;
 	int error_len = strlen(error) + 1;	/* +1 for '\0' */
-	int buf_len = sizeof(done) + error_len;
+	int buf_len = done_len + error_len;
 	char *buf = malloc(buf_len);
+	int status = STATUS_OK;
 
 	done.result	= htonl(result);
 	done.num_events	= htonl(wire_server->num_events);
-	memcpy(buf, &done, sizeof(done));
-	memcpy(buf + sizeof(done), error, error_len);
+	done.end_usecs	= wire_hton64(now_usecs());
+	memcpy(buf, &done, done_len);
+	memcpy(buf + done_len, error, error_len);
 
 	if (wire_conn_write(wire_server->wire_conn,
 	                    WIRE_PACKETS_DONE,
 	                    buf, buf_len))
 	{
 		fprintf(stderr, "error sending WIRE_PACKETS_DONE\n");
-		return STATUS_ERR;
+		status = STATUS_ERR;
 	}
 
-	return STATUS_OK;
+	free(buf);
+	return status;
 }
 
-/* Coordinate with the wire client. See wire_client_next_event(). */
+/* Coordinate with the wire client. See wire_client_next_event().
+ * Sets '*prev_end_usecs' to the now_usecs() time at which the
+ * previous event finished, which is where relative times for this
+ * event are measured from.
+ */
 static int wire_server_next_event(struct wire_server *wire_server,
-                                  struct event *event)
+                                  struct event *event,
+                                  s64 *prev_end_usecs)
 {
-	/* Wait for the client's request to start executing packet events. */
+	const struct config *config = &wire_server->config;
+
+	*prev_end_usecs = now_usecs();
+
+	/* Wait for the client's request to start executing packet events,
+	 * unless the script's timing already ensures that the client's
+	 * previous event is over by the time these are due.
+	 */
 	if (event && (event->type == PACKET_EVENT) &&
 	        (wire_server->last_event_type != PACKET_EVENT))
 	{
-		if (wire_server_receive_packets_start(wire_server))
-			return STATUS_ERR;
+		wire_server_expect_packets_start(wire_server);
+		if (wire_server->protocol_version < WIRE_PROTOCOL_V2 ||
+		        !wire_events_are_ordered(
+		            wire_server->last_event, event,
+		            config->tolerance_usecs,
+		            wire_server->clock_uncertainty_usecs))
+		{
+			if (wire_server_receive_packets_starts(wire_server,
+			                                       true))
+				return STATUS_ERR;
+			*prev_end_usecs = wire_server->last_start_usecs;
+		}
 	}
 
 	/* Send the result from server execution of packet events. */
@@ -353,9 +617,16 @@ static int wire_server_next_event(struct wire_server *wire_server,
 			return STATUS_ERR;
 	}
 
+	/* Check requests that are already here; at the end, wait for
+	 * them all, so we don't close the connection with them unread.
+	 */
+	if (wire_server_receive_packets_starts(wire_server, event == NULL))
+		return STATUS_ERR;
+
 	if (event)
 	{
 		wire_server->last_event_type = event->type;
+		wire_server->last_event = event;
 		++wire_server->num_events;
 	}
 
@@ -368,9 +639,26 @@ static int wire_server_run_packet_event(
     struct packet *packet, char **error)
 {
 	int result = STATUS_OK;
+	int batch_length = 1;
+
+	if (wire_server->config.inbound_batch)
+		batch_length = inbound_packet_batch_length(event);
 
-	result = run_packet_event(wire_server->state,
-	                          event, packet, error);
+	if (batch_length > 1)
+	{
+		/* Inject same-time packets together, so a device with a
+		 * transmit ring sends them with one system call. The
+		 * batch runs the events after this one itself.
+		 */
+		result = run_inbound_packet_batch(wire_server->state, error);
+		wire_server->num_events += batch_length - 1;
+		wire_server->last_event = wire_server->state->event;
+	}
+	else
+	{
+		result = run_packet_event(wire_server->state,
+		                          event, packet, error);
+	}
 	if (result == STATUS_ERR)
 	{
 		/* When we sniff an incorrect packet, don't exit the
@@ -407,10 +695,11 @@ static int wire_server_run_script(struct wire_server *wire_server,
 {
 	struct state *state = wire_server->state;
 	struct event *event = NULL;
+	s64 prev_end_usecs = 0;
 
 	DEBUGP("wire_server_run_script\n");
 
-	state->live_start_time_usecs = now_usecs();
+	/* The client's WIRE_CLIENT_STARTING set our start time. */
 	DEBUGP("live_start_time_usecs is %lld\n",
 	       state->live_start_time_usecs);
 
@@ -422,13 +711,15 @@ static int wire_server_run_script(struct wire_server *wire_server,
 		if (event == NULL)
 			break;
 
-		if (wire_server_next_event(wire_server, event))
+		if (wire_server_next_event(wire_server, event,
+		                           &prev_end_usecs))
 			return STATUS_ERR;
 
 		/* We adjust relative times after getting notification
-		 * that previous client-side events have completed.
+		 * that previous client-side events have completed, and
+		 * from the time they did.
 		 */
-		adjust_relative_event_times(state, event);
+		adjust_relative_event_times_from(state, event, prev_end_usecs);
 
 		switch (event->type)
 		{
@@ -456,7 +747,7 @@ static int wire_server_run_script(struct wire_server *wire_server,
 	}
 
 	/* Tell the client about any outstanding packet events it requested. */
-	wire_server_next_event(wire_server, NULL);
+	wire_server_next_event(wire_server, NULL, &prev_end_usecs);
 
 	DEBUGP("wire_server_run_script: done running\n");
 
@@ -501,7 +792,8 @@ static void *wire_server_thread(void *arg)
 	    wire_server_netdev_new(&wire_server->config,
 	                           wire_server->wire_server_device,
 	                           &wire_server->client_ether_addr,
-	                           &wire_server->server_ether_addr);
+	                           &wire_server->server_ether_addr,
+	                           wire_server->demux);
 
 	wire_server->state = state_new(&wire_server->config,
 	                               &wire_server->script,
@@ -545,9 +837,18 @@ static void start_wire_server_thread(struct wire_server *wire_server)
 void run_wire_server(const struct config *config)
 {
 	struct wire_conn *listen_conn = NULL;
+	struct wire_server_demux *demux = NULL;
 
 	wire_server_netdev_init(config->wire_server_device);
 
+	/* With a shared capture, one sniffing thread fans frames out
+	 * to all sessions, rather than each session thread sniffing
+	 * (and discarding) every frame on the device.
+	 */
+	if (config->wire_shared_capture)
+		demux = wire_server_demux_new(config->wire_server_device,
+		                              config->packet_socket_mode);
+
 	listen_conn = wire_conn_new();
 
 	wire_conn_bind_listen(listen_conn, config->wire_server_port);
@@ -560,7 +861,8 @@ void run_wire_server(const struct config *config)
 		struct wire_server *wire_server =
 		    wire_server_new(accepted_conn,
 		                    config->wire_server_device,
-		                    config->wire_server_port);
+		                    config->wire_server_port,
+		                    demux);
 
 		start_wire_server_thread(wire_server);
 	}
@@ -0,0 +1,429 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Shared packet capture for the wire server: one packet socket and
+ * sniffing thread per device, fanning frames out to client sessions.
+ */
+
+#include "wire_server_demux.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "logging.h"
+#include "netdev.h"
+#include "packet_parser.h"
+
+/* Maximum number of sniffed frames we queue for a session that has not
+ * yet asked for them. Beyond this we drop frames for the session.
+ */
+#define SESSION_QUEUE_PACKETS	256
+
+/* Number of buckets in the table of claimed flows (a power of 2). */
+#define DEMUX_FLOW_BUCKETS	1024
+
+/* A flow claimed by a session, keyed by the 4-tuple of its frames from
+ * the client.
+ */
+struct demux_flow {
+	struct tuple tuple;			/* tuple of client's frames */
+	struct wire_server_session *session;	/* session owning the flow */
+	struct demux_flow *next;		/* next flow in bucket */
+	struct demux_flow *session_next;	/* next flow of session */
+};
+
+struct wire_server_session {
+	struct wire_server_session *next;	/* next session on demux */
+	struct wire_server_demux *demux;	/* our demux (not owned) */
+	struct demux_flow *flows;		/* flows we claimed (owned) */
+
+	/* Connections the client opens for this session come from the
+	 * client's NIC and IP and are headed to the script's remote IP
+	 * and connect port (host order).
+	 */
+	struct ether_addr client_ether_addr;
+	struct ip_address client_ip;
+	struct ip_address remote_ip;
+	u16 connect_port;
+
+	/* Ring of sniffed frames waiting for the session thread. */
+	struct packet *queue[SESSION_QUEUE_PACKETS];
+	int queue_head;			/* index of oldest queued frame */
+	int queue_len;			/* number of queued frames */
+	int drops;			/* frames dropped due to full queue */
+	int ambiguous;			/* opening frames we had to drop */
+	pthread_cond_t queued;		/* signaled when a frame is queued */
+};
+
+struct wire_server_demux {
+	char *name;			/* copy of the interface name (owned) */
+	struct packet_socket *psock;	/* for sniffing packets (owned) */
+	pthread_t thread;		/* sniffs and dispatches frames */
+
+	pthread_mutex_t mutex;		/* protects sessions, flows, queues */
+	struct wire_server_session *sessions;	/* registered sessions */
+	struct demux_flow *flows[DEMUX_FLOW_BUCKETS];	/* claimed flows */
+};
+
+static void demux_lock(struct wire_server_demux *demux)
+{
+	if (pthread_mutex_lock(&demux->mutex) != 0)
+		die_perror("pthread_mutex_lock");
+}
+
+static void demux_unlock(struct wire_server_demux *demux)
+{
+	if (pthread_mutex_unlock(&demux->mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+}
+
+/* Find the bucket for a tuple. We use the fast, public-domain
+ * MurmurHash3, like the socket index does.
+ */
+static struct demux_flow **demux_flow_bucket(struct wire_server_demux *demux,
+					     const struct tuple *tuple)
+{
+	u32 hash;
+
+	MurmurHash3_x86_32(tuple, sizeof(*tuple), 0, &hash);
+	return &demux->flows[hash & (DEMUX_FLOW_BUCKETS - 1)];
+}
+
+/* Return the session that claimed the flow with the given tuple, or
+ * NULL if there is none. Caller must hold the demux lock.
+ */
+static struct wire_server_session *demux_flow_owner(
+	struct wire_server_demux *demux, const struct tuple *tuple)
+{
+	struct demux_flow *flow = *demux_flow_bucket(demux, tuple);
+
+	for (; flow != NULL; flow = flow->next) {
+		if (is_equal_tuple(&flow->tuple, tuple))
+			return flow->session;
+	}
+	return NULL;
+}
+
+/* Add the flow with the given tuple to the session, if no session has
+ * claimed it yet. Caller must hold the demux lock.
+ */
+static void demux_flow_claim(struct wire_server_session *session,
+			     const struct tuple *tuple)
+{
+	struct wire_server_demux *demux = session->demux;
+	struct demux_flow **bucket = demux_flow_bucket(demux, tuple);
+	struct demux_flow *flow = NULL;
+
+	if (demux_flow_owner(demux, tuple) != NULL)
+		return;
+
+	flow = calloc(1, sizeof(struct demux_flow));
+	memcpy(&flow->tuple, tuple, sizeof(flow->tuple));
+	flow->session = session;
+	flow->next = *bucket;
+	*bucket = flow;
+	flow->session_next = session->flows;
+	session->flows = flow;
+}
+
+/* Unlink and free all the flows the session claimed. Caller must hold
+ * the demux lock.
+ */
+static void demux_flows_release(struct wire_server_session *session)
+{
+	struct wire_server_demux *demux = session->demux;
+	struct demux_flow *flow = NULL, *next = NULL;
+
+	for (flow = session->flows; flow != NULL; flow = next) {
+		struct demux_flow **link = demux_flow_bucket(demux,
+							     &flow->tuple);
+
+		next = flow->session_next;
+		while (*link != flow)
+			link = &(*link)->next;
+		*link = flow->next;
+		free(flow);
+	}
+	session->flows = NULL;
+}
+
+/* Return true iff the given frame from the given hardware address is
+ * one the given session's client would send to open a connection.
+ */
+static bool session_opens_flow(const struct wire_server_session *session,
+			       const struct ether_addr *src_ether,
+			       const struct packet *packet,
+			       const struct tuple *tuple)
+{
+	if (packet->tcp != NULL) {
+		if (!packet->tcp->syn || packet->tcp->ack)
+			return false;
+	} else if (packet->udp == NULL) {
+		return false;
+	}
+
+	return (memcmp(src_ether, &session->client_ether_addr,
+		       sizeof(*src_ether)) == 0 &&
+		is_equal_ip(&tuple->src.ip, &session->client_ip) &&
+		is_equal_ip(&tuple->dst.ip, &session->remote_ip) &&
+		ntohs(tuple->dst.port) == session->connect_port);
+}
+
+/* Return the session that the given frame with the given tuple belongs
+ * to, or NULL if it belongs to no session. Frames of a claimed flow go
+ * to the session that claimed it. A frame opening a new connection
+ * goes to the one session whose client would open it, which then owns
+ * the flow; if several sessions could have opened it we can't tell
+ * which did, so nobody gets it. Caller must hold the demux lock.
+ */
+static struct wire_server_session *demux_find_session(
+	struct wire_server_demux *demux, const struct packet *packet,
+	const struct tuple *tuple)
+{
+	const struct ether_header *ether =
+		(const struct ether_header *)packet->buffer;
+	const struct ether_addr *src_ether =
+		(const struct ether_addr *)ether->ether_shost;
+	struct wire_server_session *session = NULL, *opener = NULL;
+	int num_openers = 0;
+
+	session = demux_flow_owner(demux, tuple);
+	if (session != NULL)
+		return session;
+
+	for (session = demux->sessions; session; session = session->next) {
+		if (session_opens_flow(session, src_ether, packet, tuple)) {
+			opener = session;
+			++num_openers;
+		}
+	}
+	if (num_openers == 1) {
+		demux_flow_claim(opener, tuple);
+		return opener;
+	}
+	if (num_openers > 1) {
+		for (session = demux->sessions; session;
+		     session = session->next) {
+			if (session_opens_flow(session, src_ether,
+					       packet, tuple))
+				++session->ambiguous;
+		}
+	}
+	return NULL;
+}
+
+/* Hand the given sniffed frame to the session it belongs to, or free
+ * it if no session wants it.
+ */
+static void demux_dispatch(struct wire_server_demux *demux,
+			   struct packet *packet)
+{
+	struct wire_server_session *session = NULL;
+	struct tuple tuple;
+
+	get_packet_tuple(packet, &tuple);
+
+	demux_lock(demux);
+	session = demux_find_session(demux, packet, &tuple);
+	if (session != NULL && session->queue_len < SESSION_QUEUE_PACKETS) {
+		int tail = (session->queue_head + session->queue_len) %
+			   SESSION_QUEUE_PACKETS;
+		session->queue[tail] = packet;
+		++session->queue_len;
+		packet = NULL;
+		if (pthread_cond_signal(&session->queued) != 0)
+			die_perror("pthread_cond_signal");
+	} else if (session != NULL) {
+		++session->drops;
+	}
+	demux_unlock(demux);
+
+	if (packet != NULL) {
+		DEBUGP("wire_server_demux: dropping frame\n");
+		packet_free(packet);
+	}
+}
+
+/* Sniff frames on the device forever, dispatching each to its session. */
+static void *wire_server_demux_thread(void *arg)
+{
+	struct wire_server_demux *demux = (struct wire_server_demux *)arg;
+
+	DEBUGP("wire_server_demux_thread: sniffing %s\n", demux->name);
+
+	while (1) {
+		struct packet *packet = NULL;
+		char *error = NULL;
+		int num_packets = 0;
+
+		if (netdev_receive_loop(demux->psock, PACKET_LAYER_2_ETHERNET,
+					DIRECTION_INBOUND, &packet,
+					&num_packets, &error)) {
+			/* A frame we can't parse, which on a busy NIC
+			 * is routine and no business of any session.
+			 */
+			DEBUGP("wire_server_demux: %s\n", error);
+			free(error);
+			continue;
+		}
+		demux_dispatch(demux, packet);
+	}
+
+	return NULL;
+}
+
+struct wire_server_demux *wire_server_demux_new(
+	const char *device_name, enum packet_socket_mode_t mode)
+{
+	struct wire_server_demux *demux =
+		calloc(1, sizeof(struct wire_server_demux));
+
+	DEBUGP("wire_server_demux_new: %s\n", device_name);
+
+	demux->name = strdup(device_name);
+	if (pthread_mutex_init(&demux->mutex, NULL) != 0)
+		die_perror("pthread_mutex_init");
+
+	/* We sniff for all sessions, so we can't install a per-client
+	 * filter; demux_dispatch() drops frames nobody wants.
+	 */
+	demux->psock = packet_socket_new(demux->name, mode);
+
+	if (pthread_create(&demux->thread, NULL, wire_server_demux_thread,
+			   demux) != 0)
+		die_perror("pthread_create");
+
+	return demux;
+}
+
+int wire_server_demux_writev(struct wire_server_demux *demux,
+			     const struct iovec *iov, int iovcnt)
+{
+	/* Each writev() on a packet socket sends one whole frame, so
+	 * session threads can share the socket without locking.
+	 */
+	return packet_socket_writev(demux->psock, iov, iovcnt);
+}
+
+struct wire_server_session *wire_server_session_new(
+	struct wire_server_demux *demux,
+	const struct config *config,
+	const struct ether_addr *client_ether_addr)
+{
+	struct wire_server_session *session =
+		calloc(1, sizeof(struct wire_server_session));
+
+	struct wire_server_session *other = NULL;
+
+	session->demux = demux;
+	ether_copy(&session->client_ether_addr, client_ether_addr);
+	session->client_ip	= config->live_local_ip;
+	session->remote_ip	= config->live_remote_ip;
+	session->connect_port	= config->live_connect_port;
+	if (pthread_cond_init(&session->queued, NULL) != 0)
+		die_perror("pthread_cond_init");
+
+	demux_lock(demux);
+	for (other = demux->sessions; other; other = other->next) {
+		if (is_equal_ip(&other->client_ip, &session->client_ip) &&
+		    is_equal_ip(&other->remote_ip, &session->remote_ip) &&
+		    other->connect_port == session->connect_port) {
+			fprintf(stderr, "wire_server_demux: concurrent tests "
+				"from %s use the same remote IP and connect "
+				"port; connections they open will be "
+				"dropped\n", config->live_local_ip_string);
+			break;
+		}
+	}
+	session->next = demux->sessions;
+	demux->sessions = session;
+	demux_unlock(demux);
+
+	return session;
+}
+
+void wire_server_session_claim(struct wire_server_session *session,
+			       const struct tuple *tuple)
+{
+	struct wire_server_demux *demux = session->demux;
+
+	demux_lock(demux);
+	demux_flow_claim(session, tuple);
+	demux_unlock(demux);
+}
+
+void wire_server_session_free(struct wire_server_session *session)
+{
+	struct wire_server_demux *demux = session->demux;
+	struct wire_server_session **link = NULL;
+
+	demux_lock(demux);
+	for (link = &demux->sessions; *link; link = &(*link)->next) {
+		if (*link == session) {
+			*link = session->next;
+			break;
+		}
+	}
+	demux_flows_release(session);
+	demux_unlock(demux);
+
+	if (session->drops > 0)
+		fprintf(stderr, "wire_server_demux: session dropped %d "
+			"frames due to full queue\n", session->drops);
+	if (session->ambiguous > 0)
+		fprintf(stderr, "wire_server_demux: session dropped %d "
+			"connection-opening frames another session could "
+			"have sent\n", session->ambiguous);
+
+	while (session->queue_len > 0) {
+		packet_free(session->queue[session->queue_head]);
+		session->queue_head = (session->queue_head + 1) %
+				      SESSION_QUEUE_PACKETS;
+		--session->queue_len;
+	}
+
+	if (pthread_cond_destroy(&session->queued) != 0)
+		die_perror("pthread_cond_destroy");
+	memset(session, 0, sizeof(*session));  /* paranoia */
+	free(session);
+}
+
+int wire_server_session_receive(struct wire_server_session *session,
+				struct packet **packet,
+				char **error)
+{
+	struct wire_server_demux *demux = session->demux;
+
+	assert(*packet == NULL);	/* should be no packet yet */
+
+	demux_lock(demux);
+	while (session->queue_len == 0) {
+		if (pthread_cond_wait(&session->queued, &demux->mutex) != 0)
+			die_perror("pthread_cond_wait");
+	}
+	*packet = session->queue[session->queue_head];
+	session->queue_head = (session->queue_head + 1) %
+			      SESSION_QUEUE_PACKETS;
+	--session->queue_len;
+	demux_unlock(demux);
+
+	return STATUS_OK;
+}
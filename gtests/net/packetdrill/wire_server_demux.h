@@ -0,0 +1,84 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+/*
+ * Shared packet capture for the wire server. Instead of every client
+ * session opening its own packet socket on the server's NIC (and so
+ * every session thread waking up for every frame on the wire), a
+ * demux owns one packet socket per device and a thread that sniffs
+ * frames and hands each one to the session it belongs to.
+ */
+
+#ifndef __WIRE_SERVER_DEMUX_H__
+#define __WIRE_SERVER_DEMUX_H__
+
+#include "types.h"
+
+#include <sys/uio.h>
+#include "config.h"
+#include "ethernet.h"
+#include "packet.h"
+#include "packet_socket.h"
+#include "socket.h"
+
+struct wire_server_demux;
+struct wire_server_session;
+
+/* Allocate a demux that sniffs the given device with the given packet
+ * socket mode, and start its sniffing thread. The demux lives for the
+ * lifetime of the server process.
+ */
+extern struct wire_server_demux *wire_server_demux_new(
+	const char *device_name, enum packet_socket_mode_t mode);
+
+/* Send the given frame out of the demux's device using writev. Return
+ * STATUS_OK on success, or STATUS_ERR if writev returns an error.
+ */
+extern int wire_server_demux_writev(struct wire_server_demux *demux,
+				    const struct iovec *iov, int iovcnt);
+
+/* Register a session so that the demux starts queuing frames sent by
+ * the given client, for the test described by the given config. Until
+ * the session claims a flow, the only frames it gets are those opening
+ * a connection from the client's IP to the config's remote IP and
+ * connect port.
+ */
+extern struct wire_server_session *wire_server_session_new(
+	struct wire_server_demux *demux,
+	const struct config *config,
+	const struct ether_addr *client_ether_addr);
+
+/* Claim the flow with the given 4-tuple, as seen in frames from the
+ * client, for this session: from now on the demux hands every frame
+ * with exactly that tuple to this session.
+ */
+extern void wire_server_session_claim(struct wire_server_session *session,
+				      const struct tuple *tuple);
+
+/* Unregister the session and free any frames still queued for it. */
+extern void wire_server_session_free(struct wire_server_session *session);
+
+/* Block until the demux hands us the next frame for this session, and
+ * return a pointer to the newly-allocated packet. Caller must free the
+ * packet with packet_free(). Same contract as netdev_receive().
+ */
+extern int wire_server_session_receive(struct wire_server_session *session,
+				       struct packet **packet,
+				       char **error);
+
+#endif /* __WIRE_SERVER_DEMUX_H__ */
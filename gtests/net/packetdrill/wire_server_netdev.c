@@ -25,6 +25,7 @@
 
 #include "wire_server_netdev.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/uio.h>
@@ -35,6 +36,7 @@
 #include "packet.h"
 #include "packet_socket.h"
 #include "packet_parser.h"
+#include "run.h"
 
 struct wire_server_netdev {
 	struct netdev netdev;		/* "inherit" from netdev */
@@ -45,9 +47,35 @@ struct wire_server_netdev {
 	struct ether_addr client_ether_addr;
 	struct ether_addr server_ether_addr;
 
+	/* We either sniff with our own packet socket, or get our
+	 * frames from a demux shared with other sessions.
+	 */
 	struct packet_socket *psock;	/* for sniffing packets (owned) */
+	struct wire_server_demux *demux;	/* shared capture (not owned) */
+	struct wire_server_session *session;	/* our demux session (owned) */
+	struct tuple claimed;		/* flow we last claimed on the demux */
+
+	s64 send_usecs;			/* total time spent sending frames */
+	s64 max_batch_usecs;		/* longest time to send one batch */
+	int tx_stamped;			/* sent frames with kernel or NIC
+					 * timestamps */
 };
 
+/* A gateway IP we have configured on a server NIC on behalf of one or
+ * more concurrent tests. Concurrent tests often use the same gateway
+ * IP, so we only add it for the first and delete it after the last.
+ */
+struct gateway_ip {
+	struct gateway_ip *next;	/* next in gateway_ips list */
+	char *device_name;		/* interface holding the IP (owned) */
+	struct ip_address ip;		/* the gateway IP itself */
+	int prefix_len;			/* prefix length it was added with */
+	int refcount;			/* number of tests using it */
+};
+
+static struct gateway_ip *gateway_ips;	/* all gateway IPs in use */
+static pthread_mutex_t gateway_ips_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 struct netdev_ops wire_server_netdev_ops;
 
 /* "Downcast" an abstract netdev to our flavor. */
@@ -100,11 +128,77 @@ void wire_server_netdev_init(const char *netdev_name)
 #endif
 }
 
+/* Take a reference on the given gateway IP, configuring it on the
+ * device if no other test is using it.
+ */
+static void gateway_ip_get(const char *device_name,
+			   const struct ip_address *ip, int prefix_len)
+{
+	struct gateway_ip *gateway = NULL;
+
+	if (pthread_mutex_lock(&gateway_ips_mutex) != 0)
+		die_perror("pthread_mutex_lock");
+
+	for (gateway = gateway_ips; gateway; gateway = gateway->next) {
+		if (is_equal_ip(&gateway->ip, ip) &&
+		    strcmp(gateway->device_name, device_name) == 0)
+			break;
+	}
+
+	if (gateway == NULL) {
+		net_setup_dev_address(device_name, ip, prefix_len);
+
+		gateway = calloc(1, sizeof(struct gateway_ip));
+		gateway->device_name	= strdup(device_name);
+		gateway->ip		= *ip;
+		gateway->prefix_len	= prefix_len;
+		gateway->next		= gateway_ips;
+		gateway_ips		= gateway;
+	}
+	++gateway->refcount;
+	DEBUGP("gateway_ip_get: refcount %d\n", gateway->refcount);
+
+	if (pthread_mutex_unlock(&gateway_ips_mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+}
+
+/* Drop a reference on the given gateway IP, removing it from the
+ * device when the last test using it is done.
+ */
+static void gateway_ip_put(const char *device_name,
+			   const struct ip_address *ip)
+{
+	struct gateway_ip **link = NULL, *gateway = NULL;
+
+	if (pthread_mutex_lock(&gateway_ips_mutex) != 0)
+		die_perror("pthread_mutex_lock");
+
+	for (link = &gateway_ips; *link; link = &(*link)->next) {
+		if (is_equal_ip(&(*link)->ip, ip) &&
+		    strcmp((*link)->device_name, device_name) == 0)
+			break;
+	}
+	gateway = *link;
+	assert(gateway != NULL);
+
+	if (--gateway->refcount == 0) {
+		*link = gateway->next;
+		net_del_dev_address(gateway->device_name, &gateway->ip,
+				    gateway->prefix_len);
+		free(gateway->device_name);
+		free(gateway);
+	}
+
+	if (pthread_mutex_unlock(&gateway_ips_mutex) != 0)
+		die_perror("pthread_mutex_unlock");
+}
+
 struct netdev *wire_server_netdev_new(
 	struct config *config,
 	const char *wire_server_device,
 	const struct ether_addr *client_ether_addr,
-	const struct ether_addr *server_ether_addr)
+	const struct ether_addr *server_ether_addr,
+	struct wire_server_demux *demux)
 {
 	DEBUGP("wire_server_netdev_new\n");
 
@@ -119,53 +213,86 @@ struct netdev *wire_server_netdev_new(
 
 	/* Add the gateway IP to our NIC, so it answers ARP or
 	 * neighbor discovery requests, so we can receive packets from
-	 * the client. TODO(ncardwell): support multiple concurrent
-	 * tests, by perhaps ref-counting the gateway IPs we need to
-	 * be using. TODO(ncardwell): make sure we don't delete our
+	 * the client. The IP is ref-counted so concurrent tests can
+	 * share it. TODO(ncardwell): make sure we don't delete our
 	 * primary host IP (the one matching our hostname).
 	 */
-	net_setup_dev_address(netdev->name,
-			      &config->live_gateway_ip,
-			      config->live_prefix_len);
+	gateway_ip_get(netdev->name,
+		       &config->live_gateway_ip,
+		       config->live_prefix_len);
 
-	netdev->psock = packet_socket_new(netdev->name);
+	if (demux != NULL) {
+		/* The demux only hands us frames of our client's flows. */
+		netdev->demux = demux;
+		netdev->session = wire_server_session_new(demux, config,
+							  client_ether_addr);
+		return (struct netdev *)netdev;
+	}
+
+	netdev->psock = packet_socket_new(netdev->name,
+					  config->packet_socket_mode);
 
 	/* Make sure we only see packets from the machine under test. */
 	packet_socket_set_filter(netdev->psock,
 				 client_ether_addr,
 				 &config->live_local_ip);  /* client IP */
 
+	packet_socket_enable_timestamps(netdev->psock, config->timestamps);
+
 	return (struct netdev *)netdev;
 }
 
+/* Print how fast we sent frames, and how far apart in time the frames
+ * of a batch may have gone out, which bounds the error in the times we
+ * record for them.
+ */
+static void wire_server_netdev_report(struct wire_server_netdev *netdev)
+{
+	struct packet_socket_stats stats;
+
+	packet_socket_get_stats(netdev->psock, &stats);
+	printf("wire netdev %s: sent %d frames with %d system calls",
+	       netdev->name, stats.tx_frames, stats.tx_batches);
+	if (netdev->send_usecs > 0)
+		printf(" (%.0f frames/sec while sending)",
+		       stats.tx_frames * 1000000.0 / netdev->send_usecs);
+	printf("; %d send times from kernel or NIC timestamps, "
+	       "the rest accurate to %lld usecs\n",
+	       netdev->tx_stamped, netdev->max_batch_usecs);
+	printf("wire netdev %s: sniffed %d frames, dropped %d\n",
+	       netdev->name, stats.rx_frames, stats.rx_drops);
+}
+
 static void wire_server_netdev_free(struct netdev *a_netdev)
 {
 	struct wire_server_netdev *netdev = to_server_netdev(a_netdev);
 
 	DEBUGP("wire_server_netdev_free\n");
 
-	net_del_dev_address(netdev->name,
-			    &netdev->config->live_gateway_ip,
-			    netdev->config->live_prefix_len);
+	if (netdev->psock && netdev->config->verbose)
+		wire_server_netdev_report(netdev);
+
+	gateway_ip_put(netdev->name, &netdev->config->live_gateway_ip);
 
 	free(netdev->name);
 	if (netdev->psock)
 		packet_socket_free(netdev->psock);
+	if (netdev->session)
+		wire_server_session_free(netdev->session);
 
 	memset(netdev, 0, sizeof(*netdev));  /* paranoia */
 	free(netdev);
 }
 
-static int wire_server_netdev_send(struct netdev *a_netdev,
-				   struct packet *packet)
+/* Send the given packet, prepending an ethernet header. If we have our
+ * own packet socket, just queue it to go out with the next flush.
+ */
+static int wire_server_netdev_queue(struct wire_server_netdev *netdev,
+				    struct packet *packet)
 {
-	struct wire_server_netdev *netdev = to_server_netdev(a_netdev);
 	struct ether_header ether;
 	struct iovec ether_frame[2];
 	int address_family = packet_address_family(packet);
-	int result = STATUS_ERR;
-
-	DEBUGP("wire_server_netdev_send\n");
 
 	/* Prepend an ethernet header. */
 	ether_copy(ether.ether_dhost, &netdev->client_ether_addr);
@@ -178,10 +305,75 @@ static int wire_server_netdev_send(struct netdev *a_netdev,
 	ether_frame[1].iov_base	= packet_start(packet);
 	ether_frame[1].iov_len	= packet->ip_bytes;
 
-	result = packet_socket_writev(netdev->psock,
-				      ether_frame, ARRAY_SIZE(ether_frame));
+	if (netdev->demux != NULL) {
+		struct tuple tuple, reply;
+
+		/* Have the demux hand us the client's replies. */
+		get_packet_tuple(packet, &tuple);
+		memset(&reply, 0, sizeof(reply));
+		reverse_tuple(&tuple, &reply);
+		if (!is_equal_tuple(&reply, &netdev->claimed)) {
+			wire_server_session_claim(netdev->session, &reply);
+			netdev->claimed = reply;
+		}
+		return wire_server_demux_writev(netdev->demux, ether_frame,
+						ARRAY_SIZE(ether_frame));
+	} else
+		return packet_socket_queue(netdev->psock, ether_frame,
+					   ARRAY_SIZE(ether_frame));
+}
 
-	return result;
+static int wire_server_netdev_send_batch(struct netdev *a_netdev,
+					 struct packet **packets,
+					 int num_packets)
+{
+	struct wire_server_netdev *netdev = to_server_netdev(a_netdev);
+	s64 start_usecs = now_usecs(), end_usecs = 0;
+	s64 tx_usecs[MAX_INBOUND_BATCH_PACKETS];
+	enum packet_time_source_t source = TIME_SOURCE_USER;
+	int i;
+
+	DEBUGP("wire_server_netdev_send_batch: %d packets\n", num_packets);
+	assert(num_packets <= MAX_INBOUND_BATCH_PACKETS);
+
+	for (i = 0; i < num_packets; ++i) {
+		if (wire_server_netdev_queue(netdev, packets[i]))
+			return STATUS_ERR;
+	}
+	if (netdev->psock != NULL && packet_socket_flush(netdev->psock))
+		return STATUS_ERR;
+	end_usecs = now_usecs();
+
+	netdev->send_usecs += end_usecs - start_usecs;
+	netdev->max_batch_usecs = max(netdev->max_batch_usecs,
+				      end_usecs - start_usecs);
+
+	/* Use the kernel's or NIC's record of when each frame left if
+	 * we have one; otherwise all we know is that each left between
+	 * the start and end of the batch.
+	 */
+	if (netdev->psock != NULL)
+		source = packet_socket_tx_times(netdev->psock, tx_usecs,
+						num_packets);
+	for (i = 0; i < num_packets; ++i) {
+		packets[i]->time_source = source;
+		if (source == TIME_SOURCE_USER)
+			packets[i]->time_usecs = end_usecs;
+		else
+			packets[i]->time_usecs =
+				wall_time_to_now_usecs(tx_usecs[i]);
+	}
+	if (source != TIME_SOURCE_USER)
+		netdev->tx_stamped += num_packets;
+	return STATUS_OK;
+}
+
+static int wire_server_netdev_send(struct netdev *a_netdev,
+				   struct packet *packet)
+{
+	DEBUGP("wire_server_netdev_send\n");
+
+	return wire_server_netdev_send_batch(a_netdev, &packet, 1);
 }
 
 static int wire_server_netdev_receive(struct netdev *a_netdev,
@@ -192,6 +384,10 @@ static int wire_server_netdev_receive(struct netdev *a_netdev,
 
 	DEBUGP("wire_server_netdev_receive\n");
 
+	if (netdev->session != NULL)
+		return wire_server_session_receive(netdev->session,
+						   packet, error);
+
 	return netdev_receive_loop(netdev->psock, PACKET_LAYER_2_ETHERNET,
 				   DIRECTION_INBOUND, packet, &num_packets,
 				   error);
@@ -201,4 +397,5 @@ struct netdev_ops wire_server_netdev_ops = {
 	.free = wire_server_netdev_free,
 	.send = wire_server_netdev_send,
 	.receive = wire_server_netdev_receive,
+	.send_batch = wire_server_netdev_send_batch,
 };
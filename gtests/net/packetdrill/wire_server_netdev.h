@@ -31,17 +31,22 @@
 #include "config.h"
 #include "ethernet.h"
 #include "netdev.h"
+#include "wire_server_demux.h"
 
 struct wire_server_netdev;
 
 /* Do any one-time start-up initialization a wire server netdev needs. */
 extern void wire_server_netdev_init(const char *netdev_name);
 
-/* Allocate and return a new wire server netdev. */
+/* Allocate and return a new wire server netdev. If demux is non-NULL,
+ * sniff and send through that shared capture instead of opening a
+ * packet socket of our own.
+ */
 extern struct netdev *wire_server_netdev_new(
 	struct config *config,
 	const char *wire_server_device,
 	const struct ether_addr *client_ether_addr,
-	const struct ether_addr *server_ether_addr);
+	const struct ether_addr *server_ether_addr,
+	struct wire_server_demux *demux);
 
 #endif /* __WIRE_SERVER_NETDEV_H__ */